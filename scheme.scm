@@ -1,29 +1,30 @@
 (load "lib.scm")
 
-(define (sqr freq t) (if (> 0 (sin (* t freq 2 pi))) 1 0))   ;; square signal (sort-of)
-(define (rnd) (- (random 2.) 1))                             ;; random number in [-1; 1]
+;; (sqr freq t) is built in: a band-limited square wave in [-1; 1]
+;; (noise) is built in: white noise in [-1; 1)
+;; freq, gate and note-time are set by the unit: the note its freq and gate
+;; controls play, and the time in seconds the gate last went up (-1 before)
+(define rnd noise)
 
-(define (my-sound f t0)
-  (let ((freq f)
-        (l (mk-line-down t0 0.3)))
-    (lambda (t)
-      (+ (* (sqr freq t) 0.5)
-         (* (rnd) (* (l t) 0.5)) ))))
-
-(define sequencer
-  (make-loop-seq :A4 :E4 :G4 :D4 :F4 :C4 :E4 :B3))
-
-(define t1 0)         ;; a timestamp
-(define dt 0.7)       ;; time increment
-(define cur-freq 0)   ;; current frequency
+;; The tune, on the node of this file while the transport rolls: a note every
+;; 1.4 beats (0.7 s at 120 bpm). Loaded as scheme.so there is no seq; play it
+;; with the seq command.
+(if (defined? 'seq)
+  (begin
+    (seq 1 "scheme" "A4*0.5 E4*0.5 G4*0.5 D4*0.5 F4*0.5 C4*0.5 E4*0.5 B3*0.5")
+    (seq-rate 1 1.4)))
 
-(define my-snd (my-sound 0 0))   ;; a sound object
+(define line-time -1)                       ;; the note the line was made for
+(define line (mk-line-down 0 0))            ;; noise level, down in 0.3 s
 
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 (define (f t in)
-  (if (>= t (+ t1 dt))
+  (if (< note-time 0)
+    0
     (begin
-      (set! my-snd (my-sound (note->freq (sequencer)) t))
-      (set! t1 t)))
-
-  (my-snd t))
+      (if (not (= line-time note-time))
+        (begin
+          (set! line (mk-line-down note-time 0.3))
+          (set! line-time note-time)))
+      (+ (* (sqr freq t) 0.5)
+         (* (rnd) (* (line t) 0.5))))))
@@ -1,11 +1,212 @@
+#include <math.h>
+
+#include <mutex>
+
 #include "exception.h"
 #include "audiounit.h"
 
+// A timestamped control change.
+struct CtlEvent
+{
+   uint64_t time;          // sample time, 0 for the next block
+   ctlHandle_t handle;
+   double value;
+   uint32_t ramp;          // frames to glide over
+   RampShape shape;
+};
+
+// What CtlQueue::apply() changed.
+enum
+{
+   CTL_SET = 1,            // an event was applied
+   CTL_RAMPED = 2          // a glide moved on
+};
+
+// A control gliding to a new value; idle when length is 0.
+struct CtlRamp
+{
+   double from, to;
+   uint32_t length, elapsed;
+   RampShape shape;
+};
+
+/* Control events of a unit. The editing threads push into the ring (serialized
+ * by the producer mutex); the render thread moves them into the time-sorted
+ * pending list and applies them at their sample offset. */
+struct CtlQueue
+{
+   static const size_t size = 256;
+
+   std::mutex producer;
+   std::atomic<size_t> head;           // next slot to write
+   std::atomic<size_t> tail;           // next slot to read
+   CtlEvent ring[size];
+
+   // render side
+   CtlEvent pending[size];
+   size_t pendingCount;
+   std::vector<CtlRamp> ramps;         // indexed by ctlHandle_t
+   size_t activeRamps;
+
+   CtlQueue(size_t controls) : head(0), tail(0), pendingCount(0), ramps(controls), activeRamps(0)
+   {
+      for (CtlRamp &r : ramps)
+         r.length = r.elapsed = 0;
+   }
+
+   bool push(const CtlEvent *events, size_t n);
+   void receive();
+   int apply(uint64_t now, controlTable_t &controls);
+   jack_nframes_t span(uint64_t now, jack_nframes_t len);
+   void advance(jack_nframes_t len);
+};
+
+//=================================================================================
+// < CtlQueue >
+// Producer: queue n events at once; the render thread sees all of them or
+// none. Returns false when the queue has no room for them.
+bool CtlQueue::push(const CtlEvent *events, size_t n)
+{
+   std::lock_guard<std::mutex> lock(producer);
+
+   size_t h = head.load(std::memory_order_relaxed);
+   if (h - tail.load(std::memory_order_acquire) + n > size)
+      return false;
+
+   for (size_t i = 0; i < n; i ++)
+      ring[(h + i) % size] = events[i];
+   head.store(h + n, std::memory_order_release);
+   return true;
+}
+
+//=================================================================================
+// < CtlQueue >
+// Render side: move the new events into the pending list, keeping it sorted.
+void CtlQueue::receive()
+{
+   size_t t = tail.load(std::memory_order_relaxed);
+   size_t h = head.load(std::memory_order_acquire);
+
+   for (; t != h && pendingCount < size; t ++)
+   {
+      const CtlEvent &e = ring[t % size];
+
+      // Keep the order of events with the same time.
+      size_t i = pendingCount ++;
+      for (; i > 0 && pending[i - 1].time > e.time; i --)
+         pending[i] = pending[i - 1];
+      pending[i] = e;
+   }
+
+   tail.store(t, std::memory_order_release);
+}
+
+//=================================================================================
+// < CtlQueue >
+// Render side: apply the events due at now and move the ramps on.
+// Returns what has changed, as CTL_SET and CTL_RAMPED bits.
+int CtlQueue::apply(uint64_t now, controlTable_t &controls)
+{
+   int changed = 0;
+   size_t due = 0;
+
+   for (; due < pendingCount && pending[due].time <= now; due ++)
+   {
+      const CtlEvent &e = pending[due];
+      if (e.handle >= ramps.size() || controls[e.handle].ptr == NULL)
+         continue;
+
+      CtlRamp &r = ramps[e.handle];
+      if (r.length > 0)
+         activeRamps --;
+
+      if (e.ramp == 0)
+      {
+         *controls[e.handle].ptr = e.value;
+         r.length = r.elapsed = 0;
+      }
+      else
+      {
+         r.from = *controls[e.handle].ptr;
+         r.to = e.value;
+         r.length = e.ramp;
+         r.elapsed = 0;
+         r.shape = (e.shape == RAMP_EXP && r.from * r.to > 0) ? RAMP_EXP : RAMP_LINEAR;
+         activeRamps ++;
+      }
+      changed |= CTL_SET;
+   }
+
+   if (due > 0)
+   {
+      std::copy(pending + due, pending + pendingCount, pending);
+      pendingCount -= due;
+   }
+
+   for (size_t h = 0; activeRamps > 0 && h < ramps.size(); h ++)
+   {
+      CtlRamp &r = ramps[h];
+      if (r.length == 0)
+         continue;
+
+      double x = (double) r.elapsed / r.length;
+      if (r.elapsed == r.length)
+      {
+         // Land exactly on the target.
+         *controls[h].ptr = r.to;
+         r.length = r.elapsed = 0;
+         activeRamps --;
+      }
+      else if (r.shape == RAMP_EXP)
+         *controls[h].ptr = r.from * pow(r.to / r.from, x);
+      else
+         *controls[h].ptr = r.from + (r.to - r.from) * x;
+      changed |= CTL_RAMPED;
+   }
+
+   return changed;
+}
+
+//=================================================================================
+// < CtlQueue >
+// Render side: how much of len frames from now can render before a control changes.
+jack_nframes_t CtlQueue::span(uint64_t now, jack_nframes_t len)
+{
+   if (pendingCount > 0)
+      len = (jack_nframes_t) std::min((uint64_t) len, pending[0].time - now);
+   if (activeRamps > 0)
+   {
+      // Short ramps still get a few steps.
+      for (size_t h = 0; h < ramps.size(); h ++)
+         if (ramps[h].length > ramps[h].elapsed)
+         {
+            jack_nframes_t step = std::max(std::min(ramps[h].length / 8, ctlRampStep), 1u);
+            len = std::min(len, std::min(step, ramps[h].length - ramps[h].elapsed));
+         }
+   }
+
+   return len;
+}
+
+//=================================================================================
+// < CtlQueue >
+// Render side: len frames have been rendered.
+void CtlQueue::advance(jack_nframes_t len)
+{
+   for (size_t h = 0; activeRamps > 0 && h < ramps.size(); h ++)
+      if (ramps[h].length > 0)
+         ramps[h].elapsed = std::min(ramps[h].length, ramps[h].elapsed + len);
+}
+
+// What an unmodulated control input reads.
+static const sample_t noModulation = 0;
+
 //=================================================================================
 // Default constructor
 AudioUnit::AudioUnit()
 {
    t0 = 0;
+   ctlQueue = NULL;
 }
 
 //=================================================================================
@@ -13,19 +214,127 @@ AudioUnit::AudioUnit()
 AudioUnit::AudioUnit(uint64_t t)
 {
    t0 = t;
+   ctlQueue = NULL;
+}
+
+//=================================================================================
+// Destructor
+AudioUnit::~AudioUnit()
+{
+   delete ctlQueue.load();
+}
+
+//=================================================================================
+// Render nframes samples in place starting at sample t: the engine's entry point.
+// Control events are applied at their sample offsets, splitting the block,
+// and onControlUpdate() runs here, on the render thread: at every offset
+// where events land, and at most once a block for the steps of the glides.
+// mods are the modulations of the control inputs for this block.
+int AudioUnit::render(jack_nframes_t nframes, sample_t *out, uint64_t t, const CtlMod *mods, size_t nmods)
+{
+   CtlQueue *q = ctlQueue.load(std::memory_order_acquire);
+   if (q == NULL && nmods == 0)
+      return process(nframes, out, t);
+
+   if (q != NULL)
+      q->receive();
+
+   bool updated = false;
+   for (jack_nframes_t done = 0; done < nframes; )
+   {
+      uint64_t now = t + done;
+      jack_nframes_t len = nframes - done;
+
+      if (q != NULL)
+      {
+         int changed = q->apply(now, controls);
+         if ((changed & CTL_SET) || (changed && !updated))
+         {
+            onControlUpdate();
+            updated = true;
+         }
+         len = q->span(now, len);
+      }
+
+      bindInputs(done, mods, nmods);
+      process(len, out + done, now);
+      if (q != NULL)
+         q->advance(len);
+
+      done += len;
+   }
+
+   unbindInputs(mods, nmods);
+
+   return 0;
 }
 
 //=================================================================================
-// Process a buffer of nframes samples.
+// Whether control changes are waiting to be applied before sample until.
+// Render side.
+bool AudioUnit::ctlPending(uint64_t until)
+{
+   CtlQueue *q = ctlQueue.load(std::memory_order_acquire);
+   if (q == NULL)
+      return false;
+
+   return q->head.load(std::memory_order_acquire) != q->tail.load(std::memory_order_relaxed)
+      || (q->pendingCount > 0 && q->pending[0].time < until)
+      || q->activeRamps > 0;
+}
+
+//=================================================================================
+// Point the modulated control inputs at their sources, offset frames into the block.
+void AudioUnit::bindInputs(jack_nframes_t offset, const CtlMod *mods, size_t nmods)
+{
+   for (size_t i = 0; i < nmods; i ++)
+   {
+      if (!ctlModulatable(mods[i].handle))
+         continue;
+
+      CtlInput *in = controls[mods[i].handle].input;
+      in->mod = mods[i].source + offset;
+      in->stride = mods[i].audioRate ? 1 : 0;
+      in->depth = mods[i].depth;
+   }
+}
+
+//=================================================================================
+// Return the modulated control inputs to their plain values.
+void AudioUnit::unbindInputs(const CtlMod *mods, size_t nmods)
+{
+   for (size_t i = 0; i < nmods; i ++)
+   {
+      if (!ctlModulatable(mods[i].handle))
+         continue;
+
+      CtlInput *in = controls[mods[i].handle].input;
+      in->mod = &noModulation;
+      in->stride = 0;
+      in->depth = 0;
+   }
+}
+
+//=================================================================================
+// Process a buffer of nframes samples in place.
 // Virtual. Can be overloaded in a program for detailed control.
 int AudioUnit::process(jack_nframes_t nframes, sample_t *out, uint64_t t)
 {
-   for (jack_nframes_t i = 0; i < nframes; i ++)
-      out[i] = this->operator()(t + i, out[i]);
-
+   processBlock(out, out, nframes, t);
    return 0;
 }
 
+//=================================================================================
+// Process n samples of in into out, starting at sample t. in and out may be
+// the same buffer; the engine passes buffers aligned to blockAlign bytes.
+// Virtual. Units overload it to work on whole blocks; the default calls
+// operator() for every sample.
+void AudioUnit::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   for (size_t i = 0; i < n; i ++)
+      out[i] = this->operator()(t + i, in[i]);
+}
+
 //=================================================================================
 // Modifying controls.
 // Virtual. To be overloaded.
@@ -34,45 +343,112 @@ void AudioUnit::onControlUpdate()
 }
 
 //=================================================================================
-// Adds a control to the hashmap.
-void AudioUnit::addCtl(std::string control, double *ptr)
+// Adds a control to the parameter table. A unit passes an input for
+// the controls it reads through CtlInput::at(), which can be modulated.
+void AudioUnit::addCtl(std::string control, double *ptr, CtlInput *input)
+{
+   if (input != NULL)
+   {
+      input->value = ptr;
+      input->mod = &noModulation;
+      input->stride = 0;
+      input->depth = 0;
+   }
+
+   std::map<std::string,ctlHandle_t>::iterator el = controlIndex.find(control);
+   if (el != controlIndex.end())
+   {
+      controls[el->second].ptr = ptr;
+      controls[el->second].input = input;
+      return;
+   }
+
+   controlIndex[control] = controls.size();
+   controls.push_back(Control { control, ptr, input });
+}
+
+//=================================================================================
+// Resolve a control name to its handle.
+ctlHandle_t AudioUnit::ctlHandle(const std::string &control)
 {
-   controls[control] = ptr;   
+   std::map<std::string,ctlHandle_t>::iterator el = controlIndex.find(control);
+   if (el == controlIndex.end())
+      throw Exception("Unsupported control");
+
+   return el->second;
 }
 
 //=================================================================================
-// Assign a value to a control.
-void AudioUnit::setCtl(std::string control, double value)
+// Queue a new value for a control. The render thread applies it at sample time
+// (or at its next block when time is in the past), gliding to it over ramp frames.
+void AudioUnit::setCtl(ctlHandle_t control, double value, uint64_t time, uint32_t ramp, RampShape shape)
 {
-   controlIter_t el = controls.find(control);
-   if (el != controls.end())
-   {
-      double *ptr = el->second;
-      if (ptr != NULL)
-      {
-         *ptr = value;
-         onControlUpdate();
-      }
-   }
-   else
+   if (control >= controls.size())
       throw Exception("Unsupported control");
+
+   CtlEvent e { time, control, value, ramp, shape };
+   if (!queue()->push(&e, 1))
+      throw Exception("Control queue is full");
 }
 
 //=================================================================================
-// Get a value of a control.
-double AudioUnit::getCtl(std::string control)
+// Queue values for a number of controls at once; they land in the same block
+// and onControlUpdate() runs once for them.
+void AudioUnit::setCtls(const CtlValue *values, size_t n, uint64_t time)
 {
-   controlIter_t el = controls.find(control);
-   if (el != controls.end())
+   std::vector<CtlEvent> events;
+   for (size_t i = 0; i < n; i ++)
+      if (values[i].handle < controls.size())
+         events.push_back(CtlEvent { time, values[i].handle, values[i].value, 0, RAMP_LINEAR });
+
+   if (!events.empty() && !queue()->push(events.data(), events.size()))
+      throw Exception("Control queue is full");
+}
+
+//=================================================================================
+// The control queue, made by the first thread that needs it.
+CtlQueue* AudioUnit::queue()
+{
+   CtlQueue *q = ctlQueue.load(std::memory_order_acquire);
+   if (q == NULL)
    {
-      double *ptr = el->second;
-      return *ptr;
+      CtlQueue *fresh = new CtlQueue(controls.size());
+      if (ctlQueue.compare_exchange_strong(q, fresh, std::memory_order_acq_rel))
+         q = fresh;
+      else
+         delete fresh;
    }
-   else
+
+   return q;
+}
+
+//=================================================================================
+// Render side, between blocks: set a control at once, ending a glide of it,
+// and let the unit know. For the engine's scheduled events.
+void AudioUnit::applyCtl(ctlHandle_t control, double value)
+{
+   if (control >= controls.size() || controls[control].ptr == NULL)
+      return;
+
+   CtlQueue *q = ctlQueue.load(std::memory_order_acquire);
+   if (q != NULL && q->ramps[control].length > 0)
    {
-      throw Exception("Unsupported control");
-      return 0;
+      q->ramps[control].length = q->ramps[control].elapsed = 0;
+      q->activeRamps --;
    }
+
+   *controls[control].ptr = value;
+   onControlUpdate();
+}
+
+//=================================================================================
+// Get a value of a control.
+double AudioUnit::getCtl(ctlHandle_t control)
+{
+   if (control >= controls.size() || controls[control].ptr == NULL)
+      throw Exception("Unsupported control");
+
+   return *controls[control].ptr;
 }
 
 //=================================================================================
@@ -3,7 +3,9 @@
 
 #include <iostream>
 #include <algorithm>
+#include <atomic>
 #include <map>
+#include <vector>
 
 #include <jack/jack.h>
 
@@ -11,6 +13,16 @@ typedef jack_default_audio_sample_t sample_t;
 
 #define T(t) ((double)(t) / SampleRate)
 
+// The engine hands processBlock() buffers aligned to this many bytes.
+// Blocks split at control events start where the event falls.
+static const size_t blockAlign = 64;
+
+// tailFrames() of a unit that sounds without input.
+static const uint64_t noTail = UINT64_MAX;
+
+// Longest stretch of a control ramp rendered at a constant value.
+static const jack_nframes_t ctlRampStep = 32;
+
 enum
 {
    MSG_INT,
@@ -18,30 +30,133 @@ enum
    MSG_ARG
 };
 
-typedef std::map<std::string,double*> controlMap_t;
-typedef std::map<std::string,double*>::iterator controlIter_t;
+// Index of a control in the parameter table of a unit.
+// Stays valid for the life of the unit; resolve it once by name.
+typedef uint32_t ctlHandle_t;
+
+/* Per-block view of a control that can be modulated by another unit.
+ * at(i) is the control's value plus the modulation at sample i of the block;
+ * mod points to a constant (stride 0) or to a buffer (stride 1), so the inner
+ * loop of a unit reads it without branching. */
+struct CtlInput
+{
+   const double *value;
+   const sample_t *mod;
+   size_t stride;
+   double depth;
+
+   double at(size_t i) const { return *value + depth * mod[i * stride]; }
+};
+
+// A control: a named value of the unit.
+struct Control
+{
+   std::string name;
+   double *ptr;
+   CtlInput *input;     // NULL unless the control takes modulation
+};
+
+// A modulation of a control, bound by the engine for one block.
+struct CtlMod
+{
+   ctlHandle_t handle;
+   const sample_t *source;    // buffer of the modulating unit
+   double depth;
+   bool audioRate;            // follow every sample, or take one value per block
+};
+
+// A control update for the bulk setter.
+struct CtlValue
+{
+   ctlHandle_t handle;
+   double value;
+};
+
+typedef std::vector<Control> controlTable_t;
+typedef std::vector<Control>::iterator controlIter_t;
+
+// How a control glides to a new value.
+enum RampShape
+{
+   RAMP_LINEAR,
+   RAMP_EXP          // falls back to linear across zero
+};
+
+// Control events on their way to the render thread; see audiounit.cpp.
+struct CtlQueue;
 
 class AudioUnit
 {
    protected:
       uint64_t t0;
-      controlMap_t controls;
-      void addCtl(std::string s, double *ptr);
+      controlTable_t controls;                           // indexed by ctlHandle_t
+      std::map<std::string,ctlHandle_t> controlIndex;    // name lookup for the CLI
+      std::atomic<CtlQueue*> ctlQueue;                   // created by the first setCtl()
+      void addCtl(std::string s, double *ptr, CtlInput *input = NULL);
+      CtlQueue* queue();
+      void bindInputs(jack_nframes_t offset, const CtlMod *mods, size_t nmods);
+      void unbindInputs(const CtlMod *mods, size_t nmods);
 
    public:
       AudioUnit();
       AudioUnit(uint64_t t);
-      virtual ~AudioUnit() {};
+      virtual ~AudioUnit();
+
+      int render(jack_nframes_t nframes, sample_t *out, uint64_t t,
+                 const CtlMod *mods = NULL, size_t nmods = 0);
 
       virtual int process(jack_nframes_t nframes, sample_t *out, uint64_t t);
+      virtual void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
       virtual void onControlUpdate();
+
+      // Runs once the sample rate is known, before the first render: the
+      // engine calls it for the units it loads, an Oversampler for its unit at
+      // the higher rate, and a unit for the units it is made of. Memory sized
+      // by the rate is taken here.
       virtual void setup() {};
       virtual double operator() (uint64_t t, double in = 0) {return 0;}
 
-      void setCtl(std::string control, double value);
-      double getCtl(std::string control);
+      // Silence detection. The engine stops calling process() while the
+      // input is silent and either isSilent() is true or the input has been
+      // silent for tailFrames(); a control change or input signal wakes the unit.
+      virtual bool isSilent() { return false; }
+      virtual uint64_t tailFrames() { return noTail; }
+      bool ctlPending(uint64_t until);
+
+      ctlHandle_t ctlHandle(const std::string &control);
+      size_t ctlCount() { return controls.size(); }
+      bool ctlModulatable(ctlHandle_t control) { return control < controls.size() && controls[control].input != NULL; }
+
+      void setCtl(ctlHandle_t control, double value, uint64_t time = 0,
+                  uint32_t ramp = 0, RampShape shape = RAMP_LINEAR);
+      void setCtls(const CtlValue *values, size_t n, uint64_t time = 0);
+      double getCtl(ctlHandle_t control);
+      void applyCtl(ctlHandle_t control, double value);
+
+      void setCtl(const std::string &control, double value) { setCtl(ctlHandle(control), value); }
+      double getCtl(const std::string &control) { return getCtl(ctlHandle(control)); }
       controlIter_t ctlListIter();
       controlIter_t ctlListEnd();
 };
 
+/* Base for units whose operator() is known at compile time, such as the ones
+ * build.sh makes out of script.cpp. The sample loop is instantiated around
+ * Derived::operator() and calls it without the vtable, so the compiler can
+ * inline and vectorize it. Derived should be final. */
+template <class Derived>
+class StaticUnit : public AudioUnit
+{
+   public:
+      StaticUnit() {}
+      StaticUnit(uint64_t t) : AudioUnit(t) {}
+
+      virtual void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+      {
+         Derived *self = static_cast<Derived*>(this);
+
+         for (size_t i = 0; i < n; i ++)
+            out[i] = self->Derived::operator()(t + i, in[i]);
+      }
+};
+
 #endif
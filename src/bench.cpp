@@ -0,0 +1,282 @@
+// Benchmarks for the units.
+// Build with 'make b', run with 'LD_LIBRARY_PATH=. ./bench'.
+
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include "unitlib.h"
+#include "graph.h"
+
+using namespace std;
+
+// sample1.cpp as built before StaticUnit: the sample loop calls operator()
+// through the vtable.
+class VirtualSample1 : public AudioUnit
+{
+   public:
+      VirtualSample1() { this->setup(); }
+#include "sample1.cpp"
+};
+
+// sample1.cpp as script.cpp builds it now.
+class StaticSample1 final : public StaticUnit<StaticSample1>
+{
+   public:
+      StaticSample1() { this->setup(); }
+#include "sample1.cpp"
+};
+
+// A light user unit, where the per-sample call is most of the cost.
+#define GAIN_STAGE \
+   double gain = 0.5; \
+   double operator()(uint64_t t, double in) { return in * gain + 0.1; }
+
+class VirtualGain : public AudioUnit { public: GAIN_STAGE };
+class StaticGain final : public StaticUnit<StaticGain> { public: GAIN_STAGE };
+
+//=================================================================================
+// Render seconds of audio with the unit in blocks of the given size and
+// return the samples rendered per second of CPU time.
+double samplesPerSecond(AudioUnit &unit, double seconds, size_t block = 256)
+{
+   vector<sample_t> buf(block, 0);
+   uint64_t total = seconds * SampleRate;
+   uint64_t t = 0;
+
+   auto start = chrono::steady_clock::now();
+   for (; t < total; t += block)
+      unit.process(block, buf.data(), t);
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+   // keep the result alive
+   volatile sample_t sink = buf[0];
+   (void) sink;
+
+   return t / elapsed.count();
+}
+
+//=================================================================================
+// As samplesPerSecond, with a control of the unit modulated at audio rate by a
+// 5 Hz sine of the given depth.
+double modulatedSamplesPerSecond(AudioUnit &unit, const string &control, double depth,
+                                 double seconds, size_t block = 256)
+{
+   vector<sample_t> buf(block, 0), lfo(block);
+   CtlMod mod = { unit.ctlHandle(control), lfo.data(), depth, true };
+   uint64_t total = seconds * SampleRate;
+   uint64_t t = 0;
+
+   auto start = chrono::steady_clock::now();
+   for (; t < total; t += block)
+   {
+      for (size_t i = 0; i < block; i ++)
+         lfo[i] = sin(2 * M_PI * 5 * (t + i) / SampleRate);
+      unit.render(block, buf.data(), t, &mod, 1);
+   }
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+   volatile sample_t sink = buf[0];
+   (void) sink;
+
+   return t / elapsed.count();
+}
+
+//=================================================================================
+// Run a sine over a block of phases for seconds of audio and return the samples
+// computed per second of CPU time.
+template <typename Fn>
+double sinesPerSecond(Fn fn, double seconds, size_t block = 256)
+{
+   vector<sample_t> x(block), y(block);
+   for (size_t i = 0; i < block; i ++)
+      x[i] = -M_PI + 2 * M_PI * i / block;
+   uint64_t total = seconds * SampleRate;
+   uint64_t t = 0;
+
+   auto start = chrono::steady_clock::now();
+   for (; t < total; t += block)
+   {
+      fn(x.data(), y.data(), block);
+      x[0] = y[0];         // a dependency, so the calls are not folded away
+   }
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+   volatile sample_t sink = y[block - 1];
+   (void) sink;
+
+   return t / elapsed.count();
+}
+
+//=================================================================================
+// Filter seconds of audio for each lane of a biquad bank and return the voice
+// samples per second of CPU time.
+template <size_t L>
+double bankSamplesPerSecond(double seconds, size_t block = 256)
+{
+   BiquadBank<L> bank;
+   for (size_t l = 0; l < L; l ++)
+      bank.set(l, LOWPASS, 500 * (l + 1), 1);
+
+   vector<sample_t> frames(block * L, 0.1);
+   uint64_t total = seconds * SampleRate;
+   uint64_t t = 0;
+
+   auto start = chrono::steady_clock::now();
+   for (; t < total; t += block)
+      bank.process(frames.data(), block);
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+   volatile sample_t sink = frames[0];
+   (void) sink;
+
+   return t * L / elapsed.count();
+}
+
+//=================================================================================
+// Render seconds of audio from a graph of independent units, each a ladder
+// oversampled twice, on a pool of the given threads and return the output
+// samples per second.
+double graphSamplesPerSecond(size_t units, unsigned threads, double seconds,
+                             jack_nframes_t block = 256)
+{
+   vector<unique_ptr<AudioUnit>> owned;
+   GraphSpec spec;
+   for (size_t i = 0; i < units; i ++)
+   {
+      owned.emplace_back(new Oversampler(unique_ptr<AudioUnit>(new Ladder(500 + 10 * i, 0.5, 2)), 2));
+      spec.units.push_back(owned.back().get());
+      spec.outputs.push_back(i);
+   }
+
+   WorkerPool pool(threads, vector<int>());
+   ProcessGraph graph(1, spec, pool.size());
+   vector<sample_t> buf(block);
+   uint64_t total = seconds * SampleRate;
+   uint64_t t = 0;
+
+   auto start = chrono::steady_clock::now();
+   for (; t < total; t += block)
+   {
+      graph.prepare(block, t);
+      pool.run(graph);
+      graph.mix(buf.data(), block);
+   }
+   chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+
+   volatile sample_t sink = buf[0];
+   (void) sink;
+
+   return t / elapsed.count();
+}
+
+//=================================================================================
+void report(string name, double sps)
+{
+   printf("%-32s %12.0f samples/s  (%.1fx realtime)\n", name.c_str(), sps, sps / SampleRate);
+}
+
+//=================================================================================
+int main(int argc, char **argv)
+{
+   SampleRate = 48000;
+   double seconds = argc > 1 ? atof(argv[1]) : 60;
+
+   VirtualSample1 v;
+   StaticSample1 s;
+   report("sample1.cpp, virtual operator()", samplesPerSecond(v, seconds));
+   report("sample1.cpp, StaticUnit", samplesPerSecond(s, seconds));
+
+   VirtualGain vg;
+   StaticGain sg;
+   report("gain stage, virtual operator()", samplesPerSecond(vg, seconds));
+   report("gain stage, StaticUnit", samplesPerSecond(sg, seconds));
+
+   auto libmSin = [](const sample_t *x, sample_t *y, size_t n)
+   {
+      for (size_t i = 0; i < n; i ++)
+         y[i] = std::sin(x[i]);
+   };
+   report("std::sin per sample", sinesPerSecond(libmSin, seconds));
+   report("blockSin", sinesPerSecond(blockSin, seconds));
+
+   SinOsc osc(440.0);
+   report("SinOsc", samplesPerSecond(osc, seconds));
+
+   SawOsc saw(440.0);
+   report("SawOsc (PolyBLEP)", samplesPerSecond(saw, seconds));
+
+   WaveOsc wave(Wavetable::saw(), 440.0);
+   report("WaveOsc saw", samplesPerSecond(wave, seconds));
+
+   // voice samples per second: one output sample is 64 voices
+   WaveBank bank(Wavetable::saw(), 64);
+   for (size_t v = 0; v < bank.voices(); v ++)
+      bank.setVoice(v, 55 * pow(2, v / 12.0), 1.0 / bank.voices());
+   report("WaveBank saw, per voice", samplesPerSecond(bank, seconds / 16) * bank.voices());
+
+   WhiteNoise white;
+   PinkNoise pink;
+   BrownNoise brown;
+   report("WhiteNoise", samplesPerSecond(white, seconds));
+   report("PinkNoise", samplesPerSecond(pink, seconds));
+   report("BrownNoise", samplesPerSecond(brown, seconds));
+
+   Biquad lp(LOWPASS, 1000);
+   report("Biquad", samplesPerSecond(lp, seconds));
+
+   report("BiquadBank<4>, per voice", bankSamplesPerSecond<4>(seconds));
+   report("BiquadBank<8>, per voice", bankSamplesPerSecond<8>(seconds));
+
+   // one voice each: x realtime is the voices a core runs at 48 kHz
+   SVF svf(LOWPASS, 1000);
+   report("SVF", samplesPerSecond(svf, seconds));
+   report("SVF, audio-rate cutoff", modulatedSamplesPerSecond(svf, "freq", 500, seconds));
+
+   Ladder ladder(1000, 0.5, 2);
+   report("Ladder", samplesPerSecond(ladder, seconds));
+   report("Ladder, audio-rate cutoff", modulatedSamplesPerSecond(ladder, "freq", 500, seconds));
+
+   Oversampler ladder2(unique_ptr<AudioUnit>(new Ladder(1000, 0.5, 2)), 2);
+   Oversampler ladder4(unique_ptr<AudioUnit>(new Ladder(1000, 0.5, 2)), 4);
+   report("Ladder, 2x oversampled", samplesPerSecond(ladder2, seconds / 4));
+   report("Ladder, 4x oversampled", samplesPerSecond(ladder4, seconds / 4));
+   report("Ladder, 4x, audio-rate cutoff", modulatedSamplesPerSecond(ladder4, "freq", 500, seconds / 4));
+
+   Delay delay;
+   Chorus chorus;
+   Flanger flanger;
+   Comb comb;
+   delay.setup();
+   chorus.setup();
+   flanger.setup();
+   comb.setup();
+   report("Delay", samplesPerSecond(delay, seconds));
+   report("Delay, audio-rate time", modulatedSamplesPerSecond(delay, "time", 0.1, seconds));
+   report("Chorus", samplesPerSecond(chorus, seconds));
+   report("Flanger", samplesPerSecond(flanger, seconds));
+   report("Comb", samplesPerSecond(comb, seconds));
+   report("Comb, audio-rate freq", modulatedSamplesPerSecond(comb, "freq", 100, seconds));
+
+   // scaling of the worker pool: near linear is the goal, up to 8 threads or
+   // the cores there are
+   unsigned cores = max(thread::hardware_concurrency(), 1u);
+   double single = 0;
+   for (unsigned threads = 1; threads <= 8 && threads <= cores; threads *= 2)
+   {
+      double sps = graphSamplesPerSecond(64, threads, seconds / 64);
+      if (threads == 1)
+         single = sps;
+      char name[64];
+      snprintf(name, sizeof(name), "64 ladders 2x, %u threads", threads);
+      report(name, sps);
+      printf("%-32s %12.2fx\n", "  speedup", sps / single);
+   }
+
+   return 0;
+}
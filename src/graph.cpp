@@ -0,0 +1,343 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "exception.h"
+#include "graph.h"
+
+//=================================================================================
+// < WorkDeque >
+// Allocate room for capacity items.
+void WorkDeque::init(size_t capacity)
+{
+   mItems.reset(new std::atomic<int>[std::max(capacity, (size_t) 1)]);
+   reset();
+}
+
+//=================================================================================
+// < WorkDeque >
+// Owner: add an item at the bottom.
+void WorkDeque::push(int item)
+{
+   long b = mBottom.load(std::memory_order_relaxed);
+   mItems[b].store(item, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+   mBottom.store(b + 1, std::memory_order_relaxed);
+}
+
+//=================================================================================
+// < WorkDeque >
+// Owner: take the item at the bottom.
+int WorkDeque::pop()
+{
+   long b = mBottom.load(std::memory_order_relaxed) - 1;
+   mBottom.store(b, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   long t = mTop.load(std::memory_order_relaxed);
+
+   if (t > b)
+   {
+      mBottom.store(b + 1, std::memory_order_relaxed);
+      return empty;
+   }
+
+   int item = mItems[b].load(std::memory_order_relaxed);
+   if (t == b)
+   {
+      // The last item: race the thieves for it.
+      if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+         item = empty;
+      mBottom.store(b + 1, std::memory_order_relaxed);
+   }
+
+   return item;
+}
+
+//=================================================================================
+// < WorkDeque >
+// Thief: take the item at the top.
+int WorkDeque::steal()
+{
+   long t = mTop.load(std::memory_order_acquire);
+   std::atomic_thread_fence(std::memory_order_seq_cst);
+   long b = mBottom.load(std::memory_order_acquire);
+
+   if (t >= b)
+      return empty;
+
+   int item = mItems[t].load(std::memory_order_relaxed);
+   if (!mTop.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+      return empty;
+
+   return item;
+}
+
+//=================================================================================
+// < ProcessGraph >
+// Compile the graph described by spec. Throws when the graph has a cycle.
+ProcessGraph::ProcessGraph(uint64_t gen, const GraphSpec &spec, unsigned workers)
+   : generation(gen)
+{
+   mNodeCount = spec.units.size();
+   mNodes.reset(new Node[mNodeCount]);
+   mWorkers = std::max(workers, 1u);
+   mOutputs.assign(spec.outputs.begin(), spec.outputs.end());
+   mBuffers = NULL;
+
+   for (size_t i = 0; i < mNodeCount; i ++)
+   {
+      mNodes[i].unit = spec.units[i];
+      mNodes[i].serial = i < spec.serials.size() ? spec.serials[i] : 0;
+      mNodes[i].inPlace = false;
+      mNodes[i].output = false;
+      mNodes[i].silent = false;
+      mNodes[i].quietFrames = 0;
+      mNodes[i].asleep = false;
+      mNodes[i].skipped = 0;
+   }
+   for (size_t n : spec.outputs)
+      mNodes[n].output = true;
+
+   for (const std::pair<size_t, size_t> &e : spec.edges)
+   {
+      mNodes[e.second].inputs.push_back(e.first);
+      mNodes[e.first].consumers.push_back(e.second);
+   }
+
+   // A modulation orders the nodes like an edge, without summing the signal.
+   for (const Modulation &m : spec.modulations)
+   {
+      mNodes[m.to].modSources.push_back(m.from);
+      mNodes[m.to].mods.push_back(CtlMod { m.control, NULL, m.depth, m.audioRate });
+      mNodes[m.from].consumers.push_back(m.to);
+   }
+
+   // Topological sort, to reject cycles.
+   std::vector<unsigned> order, degree(mNodeCount);
+   for (size_t i = 0; i < mNodeCount; i ++)
+   {
+      degree[i] = mNodes[i].inputs.size() + mNodes[i].modSources.size();
+      if (degree[i] == 0)
+      {
+         mRoots.push_back(i);
+         order.push_back(i);
+      }
+   }
+   for (size_t k = 0; k < order.size(); k ++)
+      for (unsigned c : mNodes[order[k]].consumers)
+         if (-- degree[c] == 0)
+            order.push_back(c);
+
+   if (order.size() != mNodeCount)
+      throw Exception("the graph has a cycle");
+
+   // Share as few buffers between the nodes as the graph allows.
+   std::vector<size_t> slots;
+   mBufferCount = assignBuffers(order, slots);
+
+   void *p = NULL;
+   if (posix_memalign(&p, renderBufferAlign, std::max(mBufferCount, (size_t) 1) * renderBlockFrames * sizeof(sample_t)) != 0)
+      throw Exception("cannot allocate render buffers", errno);
+   mBuffers = (sample_t*) p;
+
+   for (size_t i = 0; i < mNodeCount; i ++)
+      mNodes[i].buffer = mBuffers + slots[i] * renderBlockFrames;
+
+   for (size_t i = 0; i < mNodeCount; i ++)
+      for (size_t k = 0; k < mNodes[i].mods.size(); k ++)
+         mNodes[i].mods[k].source = mNodes[mNodes[i].modSources[k]].buffer;
+
+   mDeques.reset(new WorkDeque[mWorkers]);
+   for (unsigned w = 0; w < mWorkers; w ++)
+      mDeques[w].init(mNodeCount);
+}
+
+//=================================================================================
+// < ProcessGraph >
+// Map the nodes onto physical buffers, register-allocation style, and return
+// the number of buffers needed. slots[n] receives the buffer of node n.
+//
+// A node's buffer is live until every node reading it (its consumers, or the
+// final mix for an output) is done. Nodes run in parallel in any order the
+// edges allow, so a buffer is handed on to node v only when its last holder
+// and all of the holder's readers are ancestors of v. A node that is the only reader of one
+// of its inputs simply renders over that input in place.
+size_t ProcessGraph::assignBuffers(const std::vector<unsigned> &order, std::vector<size_t> &slots)
+{
+   std::vector<std::vector<bool>> ancestors(mNodeCount, std::vector<bool>(mNodeCount, false));
+   std::vector<unsigned> holder;            // last node written into each buffer
+
+   slots.assign(mNodeCount, 0);
+
+   for (unsigned v : order)
+   {
+      Node &node = mNodes[v];
+
+      for (const std::vector<unsigned> *sources : { &node.inputs, &node.modSources })
+         for (unsigned u : *sources)
+         {
+            ancestors[v][u] = true;
+            for (size_t k = 0; k < mNodeCount; k ++)
+               if (ancestors[u][k])
+                  ancestors[v][k] = true;
+         }
+
+      // Render over an input nobody else reads.
+      for (size_t i = 0; i < node.inputs.size() && !node.inPlace; i ++)
+      {
+         Node &in = mNodes[node.inputs[i]];
+         if (!in.output && in.consumers.size() == 1)
+         {
+            std::swap(node.inputs[0], node.inputs[i]);
+            node.inPlace = true;
+         }
+      }
+      if (node.inPlace)
+      {
+         slots[v] = slots[node.inputs[0]];
+         holder[slots[v]] = v;
+         continue;
+      }
+
+      // Reuse a buffer whose holder and readers have all finished before v
+      // starts. A holder nobody reads may still run alongside v.
+      size_t b;
+      for (b = 0; b < holder.size(); b ++)
+      {
+         Node &h = mNodes[holder[b]];
+         bool free = !h.output && ancestors[v][holder[b]];
+         for (size_t k = 0; free && k < h.consumers.size(); k ++)
+            free = ancestors[v][h.consumers[k]];
+         if (free)
+            break;
+      }
+
+      if (b == holder.size())
+         holder.push_back(v);
+      holder[b] = v;
+      slots[v] = b;
+   }
+
+   return holder.size();
+}
+
+//=================================================================================
+// < ProcessGraph >
+// Destructor.
+ProcessGraph::~ProcessGraph()
+{
+   free(mBuffers);
+}
+
+//=================================================================================
+// < ProcessGraph >
+// Get ready to render a block. Called while the pool is idle.
+void ProcessGraph::prepare(jack_nframes_t nframes, uint64_t t)
+{
+   mFrames = nframes;
+   mTime = t;
+   mRemaining.store(mNodeCount, std::memory_order_relaxed);
+
+   for (size_t i = 0; i < mNodeCount; i ++)
+      mNodes[i].pending.store(mNodes[i].inputs.size() + mNodes[i].modSources.size(), std::memory_order_relaxed);
+
+   for (unsigned w = 0; w < mWorkers; w ++)
+      mDeques[w].reset();
+
+   // Deal the roots out to the workers.
+   for (size_t i = 0; i < mRoots.size(); i ++)
+      mDeques[i % mWorkers].push(mRoots[i]);
+}
+
+//=================================================================================
+// < ProcessGraph >
+// Pool job: render nodes until the whole graph is done.
+void ProcessGraph::run(unsigned worker)
+{
+   WorkDeque &own = mDeques[worker];
+
+   while (mRemaining.load(std::memory_order_acquire) > 0)
+   {
+      int n = own.pop();
+
+      // Nothing of our own: look for work at the other threads.
+      for (unsigned k = 1; n == WorkDeque::empty && k < mWorkers; k ++)
+         n = mDeques[(worker + k) % mWorkers].steal();
+
+      if (n != WorkDeque::empty)
+         renderNode(n, worker);
+   }
+}
+
+//=================================================================================
+// < ProcessGraph >
+// Mix the inputs of node n, run its unit and release the nodes waiting for it.
+// A unit with silent input that has nothing to say is skipped.
+void ProcessGraph::renderNode(unsigned n, unsigned worker)
+{
+   Node &node = mNodes[n];
+
+   bool quiet = true;
+   for (unsigned i : node.inputs)
+      quiet = quiet && mNodes[i].silent;
+   for (unsigned i : node.modSources)
+      quiet = quiet && mNodes[i].silent;
+
+   node.quietFrames = quiet ? node.quietFrames + mFrames : 0;
+
+   AudioUnit *unit = node.unit;
+   uint64_t tail = unit->tailFrames();
+   bool sleep = quiet && !unit->ctlPending(mTime + mFrames)
+      && (unit->isSilent() || (tail != noTail && node.quietFrames >= tail + mFrames));
+
+   if (sleep)
+   {
+      // Silent inputs hold zeros already, in place or not.
+      if (!node.inPlace)
+         memset(node.buffer, 0, mFrames * sizeof(sample_t));
+      node.skipped.fetch_add(1, std::memory_order_relaxed);
+   }
+   else
+   {
+      // An in-place node finds its first input in its buffer already.
+      if (!node.inPlace)
+         memset(node.buffer, 0, mFrames * sizeof(sample_t));
+      for (size_t i = node.inPlace ? 1 : 0; i < node.inputs.size(); i ++)
+         if (!mNodes[node.inputs[i]].silent)
+            mixBus(node.buffer, mNodes[node.inputs[i]].buffer, mFrames);
+
+      unit->render(mFrames, node.buffer, mTime, node.mods.data(), node.mods.size());
+   }
+
+   node.silent = sleep;
+   node.asleep.store(sleep, std::memory_order_relaxed);
+
+   for (unsigned c : node.consumers)
+      if (mNodes[c].pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+         mDeques[worker].push(c);
+
+   mRemaining.fetch_sub(1, std::memory_order_release);
+}
+
+//=================================================================================
+// < ProcessGraph >
+// Sum the output nodes into out.
+void ProcessGraph::mix(sample_t *out, jack_nframes_t nframes)
+{
+   memset(out, 0, nframes * sizeof(sample_t));
+   for (unsigned n : mOutputs)
+      mixBus(out, mNodes[n].buffer, nframes);
+}
+
+//=================================================================================
+// < ProcessGraph >
+// Whether unit is one of the nodes. Compares pointers only, so unit may be gone.
+bool ProcessGraph::contains(const AudioUnit *unit, uint64_t serial)
+{
+   for (size_t n = 0; n < mNodeCount; n ++)
+      if (mNodes[n].unit == unit && mNodes[n].serial == serial)
+         return true;
+   return false;
+}
@@ -0,0 +1,128 @@
+#ifndef _GRAPH_H_
+#define _GRAPH_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "audiounit.h"
+#include "workerpool.h"
+
+// Longest block rendered in one go; longer requests are split.
+static const jack_nframes_t renderBlockFrames = 2048;
+
+// Alignment of the render buffers, in bytes.
+static const size_t renderBufferAlign = blockAlign;
+
+// Add a buffer into a mix. Written so that the compiler vectorizes it.
+static inline void mixBus(sample_t *__restrict out, const sample_t *__restrict in, size_t n)
+{
+   in = (const sample_t*) __builtin_assume_aligned(in, renderBufferAlign);
+
+   for (size_t i = 0; i < n; i ++)
+      out[i] += in[i];
+}
+
+// A node driving a control of another node.
+struct Modulation
+{
+   size_t from, to;
+   ctlHandle_t control;
+   double depth;
+   bool audioRate;
+};
+
+// Description of a processing graph, as edited by the engine.
+struct GraphSpec
+{
+   std::vector<AudioUnit*> units;                     // one node per unit
+   std::vector<uint64_t> serials;                     // of the units, if the engine numbers them
+   std::vector<std::pair<size_t, size_t>> edges;      // from node, to node
+   std::vector<Modulation> modulations;
+   std::vector<size_t> outputs;                       // nodes mixed into the output port
+};
+
+/* Fixed size work-stealing deque (Chase-Lev). The owner pushes and pops at the
+ * bottom, the other workers steal from the top. It is reset between blocks and
+ * never holds more than one block worth of nodes, so it never wraps. */
+class WorkDeque
+{
+   private:
+      std::atomic<long> mTop;
+      std::atomic<long> mBottom;
+      std::unique_ptr<std::atomic<int>[]> mItems;
+
+   public:
+      static const int empty = -1;
+
+      void init(size_t capacity);
+      void reset() { mTop = 0; mBottom = 0; }
+
+      void push(int item);
+      int pop();
+      int steal();
+};
+
+/* Immutable, compiled processing graph published to the render code.
+ * Rendering a block is a pool job: every thread runs the nodes whose inputs
+ * are done, taking them from its own deque or stealing from the others. */
+class ProcessGraph : public PoolJob
+{
+   private:
+      struct Node
+      {
+         AudioUnit *unit;
+         uint64_t serial;
+         std::vector<unsigned> inputs;       // summed into the node's buffer
+         std::vector<unsigned> modSources;   // driving its controls
+         std::vector<CtlMod> mods;
+         std::vector<unsigned> consumers;    // nodes reading this one's buffer
+         std::atomic<unsigned> pending;      // sources not rendered yet in this block
+         sample_t *buffer;
+         bool inPlace;                       // buffer is taken over from inputs[0]
+         bool output;                        // mixed into the output port
+
+         // silence detection, render side
+         bool silent;                        // the buffer holds zeros this block
+         uint64_t quietFrames;               // frames the input has been silent
+         std::atomic<bool> asleep;           // process() was skipped last block
+         std::atomic<uint64_t> skipped;      // blocks skipped
+      };
+
+      std::unique_ptr<Node[]> mNodes;
+      size_t mNodeCount;
+      std::vector<unsigned> mRoots;          // nodes without inputs
+      std::vector<unsigned> mOutputs;
+      std::unique_ptr<WorkDeque[]> mDeques;  // one per pool thread
+      unsigned mWorkers;
+      sample_t *mBuffers;
+      size_t mBufferCount;                   // physical buffers shared by the nodes
+
+      std::atomic<size_t> mRemaining;        // nodes not rendered yet in this block
+      jack_nframes_t mFrames;
+      uint64_t mTime;
+
+      size_t assignBuffers(const std::vector<unsigned> &order, std::vector<size_t> &slots);
+      void renderNode(unsigned n, unsigned worker);
+
+   public:
+      const uint64_t generation;
+
+      ProcessGraph(uint64_t gen, const GraphSpec &spec, unsigned workers);
+      ~ProcessGraph();
+
+      size_t size() { return mNodeCount; }
+      size_t bufferCount() { return mBufferCount; }
+      size_t bufferBytes() { return mBufferCount * renderBlockFrames * sizeof(sample_t); }
+      bool isAsleep(size_t n) { return mNodes[n].asleep.load(std::memory_order_relaxed); }
+      uint64_t skippedBlocks(size_t n) { return mNodes[n].skipped.load(std::memory_order_relaxed); }
+      bool contains(const AudioUnit *unit, uint64_t serial);
+
+      void prepare(jack_nframes_t nframes, uint64_t t);
+      void run(unsigned worker);
+      void mix(sample_t *out, jack_nframes_t nframes);
+};
+
+#endif
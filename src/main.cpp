@@ -15,6 +15,7 @@
 #include <readline/history.h>
 
 #include <algorithm>
+#include <functional>
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -45,6 +46,56 @@ int jack_buffsize_cb(jack_nframes_t nframes, void *arg);
 // Callback for jack shutdown event.
 void jack_shutdown_cb(void *arg);
 
+// Callback for jack xrun event.
+int jack_xrun_cb(void *arg);
+
+// Scheduled control change.
+static void ctlEvent(const Event &e, void *context);
+
+// What the events run between blocks get as their context.
+struct RenderContext
+{
+   ProcessGraph *graph;          // the graph being rendered
+   Transport *transport;
+   Scheduler *scheduler;
+};
+
+// Name of the output port in the graph.
+static const string dacNode = "dac";
+
+// Length of the fade to silence on a ringbuffer underrun.
+static const jack_nframes_t underrunFadeFrames = 32;
+
+// Jack periods the ringbuffer holds at least; Jack rounds its size up to a
+// power of two, which makes it about twice that.
+static const size_t renderAheadPeriods = 2;
+
+
+//=================================================================================
+// < XrunStats >
+// Zero all the counters.
+void XrunStats::reset()
+{
+   periods = 0;
+   underruns = 0;
+   missingFrames = 0;
+   worstMissing = 0;
+   jackXruns = 0;
+}
+
+//=================================================================================
+// < XrunStats >
+// Account for a period that was short of missing frames.
+void XrunStats::addUnderrun(uint64_t missing)
+{
+   underruns.fetch_add(1, std::memory_order_relaxed);
+   missingFrames.fetch_add(missing, std::memory_order_relaxed);
+
+   uint64_t worst = worstMissing.load(std::memory_order_relaxed);
+   while (missing > worst
+          && !worstMissing.compare_exchange_weak(worst, missing, std::memory_order_relaxed))
+      ;
+}
 
 //=================================================================================
 // < CppLoader >
@@ -79,6 +130,33 @@ CppLoader::~CppLoader()
    dlclose(mDlHandle);
 }
 
+//=================================================================================
+// < JackEngine >
+// Constructor.
+JackEngine::JackEngine(RenderMode mode, unsigned threads, const vector<int> &cpus)
+   : mPool(threads, cpus)
+{
+   mRenderMode = mode;
+   mFrameTime = 0;
+   mLastSample = 0;
+   mJackSync = false;
+   ringbuffer = NULL;
+
+   mGeneration = 1;
+   mSerial = 0;
+   mGraph = new ProcessGraph(mGeneration, GraphSpec(), mPool.size());
+   mSeqTracks = new SeqTracks(maxSeqTracks);
+}
+
+//=================================================================================
+// < JackEngine >
+// Destructor. The render code must be stopped by now.
+JackEngine::~JackEngine()
+{
+   delete mGraph.load();
+   delete mSeqTracks.load();
+}
+
 //=================================================================================
 // < JackEngine >
 // Initialize JackEngine, the interface with Jack.
@@ -92,14 +170,15 @@ void JackEngine::init()
 
    jack_set_process_callback(client, jack_process_cb, (void*) this);
    jack_set_buffer_size_callback(client, jack_buffsize_cb, (void*) this);
+   jack_set_xrun_callback(client, jack_xrun_cb, (void*) this);
    jack_on_shutdown(client, jack_shutdown_cb, (void*) this);
 
    sampleRate = jack_get_sample_rate(client);
    SampleRate = sampleRate;
+   mTransport.setRate(sampleRate);
 
-   // Create a ringbuffer.
-
-   ringbuffer = jack_ringbuffer_create(2048);
+   // Create a ringbuffer for the period the server runs at.
+   resizeRingbuffer(jack_get_buffer_size(client));
 
    // Create two ports.
    input_port  = jack_port_register(client, "input",  JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput,  0);
@@ -107,6 +186,12 @@ void JackEngine::init()
 
    if (jack_activate(client))
       throw Exception("cannot activate Jack client");
+
+   // The process callback waits for the pool helpers: they must not be
+   // preempted by anything it would not be.
+   int priority = jack_client_real_time_priority(client);
+   if (priority >= 0 && mPool.size() > 1 && !mPool.setRealtime(priority))
+      cout << "Warning: cannot give the render threads a realtime priority" << endl;
 }
 
 //=================================================================================
@@ -118,12 +203,234 @@ void JackEngine::shutdown()
    jack_ringbuffer_free(ringbuffer);
 }
 
+//=================================================================================
+// < JackEngine >
+// Make room in the ringbuffer for renderAheadPeriods of the period. What it
+// held is dropped. The process callback must not run meanwhile.
+void JackEngine::resizeRingbuffer(jack_nframes_t period)
+{
+   size_t bytes = (renderAheadPeriods * period + 1) * sizeof(jack_default_audio_sample_t);
+   if (ringbuffer != NULL && ringbuffer->size > bytes && ringbuffer->size <= 2 * bytes)
+      return;
+
+   jack_ringbuffer_t *rb = jack_ringbuffer_create(bytes);
+   if (rb == NULL)
+      throw Exception("cannot create the ringbuffer");
+
+   // The render-ahead thread writes to the ringbuffer under the render lock.
+   while (mRenderLock.test_and_set(std::memory_order_acquire))
+      usleep(100);
+
+   jack_ringbuffer_t *old = ringbuffer;
+   ringbuffer = rb;
+   mRenderLock.clear(std::memory_order_release);
+
+   if (old != NULL)
+      jack_ringbuffer_free(old);
+
+   pthread_cond_signal(&jackRingbufCanWrite);
+}
+
+//=================================================================================
+// < JackEngine >
+// Switch between rendering in the process callback and rendering ahead.
+void JackEngine::setRenderMode(RenderMode mode)
+{
+   mRenderMode = mode;
+
+   // Wake up the render-ahead thread in case it is waiting.
+   pthread_cond_signal(&jackRingbufCanWrite);
+}
+
+//=================================================================================
+// < JackEngine >
+// Get the current render mode.
+RenderMode JackEngine::getRenderMode()
+{
+   return (RenderMode) mRenderMode.load();
+}
+
+//=================================================================================
+// < JackEngine >
+// Render the next nframes of all the units into buf.
+// The caller must hold mRenderLock.
+void JackEngine::render(sample_t *buf, jack_nframes_t nframes)
+{
+   // Pin the graph so that the reclaimer does not free it under us.
+   ProcessGraph *graph = mReclaimer.enter(mGraph);
+   const SeqTracks *tracks = mSeqTracks.load();     // published before the graph
+   uint64_t t = mFrameTime.load(std::memory_order_relaxed);
+   RenderContext context { graph, &mTransport, &mScheduler };
+
+   if (mJackSync.load(std::memory_order_relaxed))
+      followJack(t);
+
+   while (nframes > 0)
+   {
+      jack_nframes_t n = min(nframes, renderBlockFrames);
+
+      // Run the events due now, transport changes among them, then queue the
+      // pattern steps up to the next event and run those due now too. The
+      // block ends where the next event is due.
+      n = mScheduler.dispatch(t, n, &context);
+      mSequencer.run(*tracks, mTransport.state(), sampleRate, t, n, mScheduler, ctlEvent);
+      n = mScheduler.dispatch(t, n, &context);
+
+      // Render the nodes on all the pool threads and sum up the outputs.
+      graph->prepare(n, t);
+      mPool.run(*graph);
+      graph->mix(buf, n);
+
+      buf += n;
+      nframes -= n;
+      t += n;
+      mFrameTime.store(t, std::memory_order_relaxed);
+   }
+
+   mReclaimer.leave();
+}
+
+//=================================================================================
+// Look a control up without throwing.
+static bool findCtl(AudioUnit *unit, const string &name, ctlHandle_t &handle)
+{
+   try
+   {
+      handle = unit->ctlHandle(name);
+      return true;
+   }
+   catch (Exception &e)
+   {
+      return false;
+   }
+}
+
+//=================================================================================
+// < JackEngine >
+// Compile the unit list and the connections into a new graph and hand it over
+// to the render code. Throws if the graph cannot be built.
+// Must be called with mEditMtx held.
+void JackEngine::publish()
+{
+   GraphSpec spec;
+   map<string, size_t> index;
+
+   for (unique_ptr<UnitLoader> &u : mUnitLoaders)
+   {
+      index[u->getNodeName()] = spec.units.size();
+      spec.units.push_back(u->getUnit().get());
+      spec.serials.push_back(u->getSerial());
+   }
+
+   // Nodes without explicit connections play to the output.
+   vector<bool> connected(spec.units.size(), false);
+   for (const pair<string, string> &e : mEdges)
+   {
+      size_t from = index.at(e.first);
+      connected[from] = true;
+
+      if (e.second == dacNode)
+         spec.outputs.push_back(from);
+      else
+         spec.edges.push_back(make_pair(from, index.at(e.second)));
+   }
+   // Modulators drive controls instead of playing.
+   for (const ModulationSpec &m : mModulations)
+   {
+      AudioUnit *unit = spec.units[index.at(m.to)];
+      ctlHandle_t h;
+
+      // The node may have been replaced by a unit without the control.
+      try
+      {
+         h = unit->ctlHandle(m.control);
+      }
+      catch (Exception &e)
+      {
+         continue;
+      }
+      if (!unit->ctlModulatable(h))
+         continue;
+
+      spec.modulations.push_back(Modulation { index.at(m.from), index.at(m.to), h, m.depth, m.audioRate });
+      connected[index.at(m.from)] = true;
+   }
+
+   for (size_t i = 0; i < connected.size(); i ++)
+      if (!connected[i])
+         spec.outputs.push_back(i);
+
+   ProcessGraph *graph = new ProcessGraph(mGeneration + 1, spec, mPool.size());
+   mGeneration ++;
+
+   // The patterns go out first: whoever sees the new graph sees them too.
+   SeqTracks *tracks = new SeqTracks(maxSeqTracks);
+   for (const SequenceSpec &q : mSequences)
+   {
+      SeqTrack &track = (*tracks)[q.track];
+      track.unit = spec.units[index.at(q.node)];
+      track.serial = spec.serials[index.at(q.node)];
+      track.hasFreq = findCtl(track.unit, "freq", track.freq);
+      track.hasGate = findCtl(track.unit, "gate", track.gate);
+      track.pattern = q.pattern;
+
+      // The node may have been replaced by a unit without the controls.
+      if (!track.hasFreq && !track.hasGate)
+         track.unit = NULL;
+   }
+
+   SeqTracks *oldTracks = mSeqTracks.exchange(tracks);
+   ProcessGraph *old = mGraph.exchange(graph);
+   mReclaimer.retire(mGeneration, shared_ptr<ProcessGraph>(old));
+   mReclaimer.retire(mGeneration, shared_ptr<SeqTracks>(oldTracks));
+}
+
+//=================================================================================
+// < JackEngine >
+// Find a unit by its node name.
+// Must be called with mEditMtx held.
+UnitLoader* JackEngine::findNode(string nodeName)
+{
+   for (unique_ptr<UnitLoader> &u : mUnitLoaders)
+      if (u->getNodeName() == nodeName)
+         return u.get();
+
+   return NULL;
+}
+
+//=================================================================================
+// < JackEngine >
+// Hand a unit removed from the list over to the reclaimer, which destroys it
+// (and closes its library) once the render code no longer sees it.
+// Must be called after the publish() that removed it.
+void JackEngine::retire(unique_ptr<UnitLoader> &&synth)
+{
+   mReclaimer.retire(mGeneration, shared_ptr<UnitLoader>(std::move(synth)));
+}
+
+
 //=================================================================================
 // < JackEngine >
 // Add a synthesizer.
-size_t JackEngine::addSynth(unique_ptr<UnitLoader> &&s)
+size_t JackEngine::addSynth(unique_ptr<UnitLoader> &&s, string nodeName)
 {
+   lock_guard<mutex> lock(mEditMtx);
+
+   // Pick a free node name, derived from the file name unless given.
+   if (nodeName == "")
+   {
+      nodeName = s->getName();
+      for (unsigned k = 2; nodeName == dacNode || findNode(nodeName) != NULL; k ++)
+         nodeName = s->getName() + "." + to_string(k);
+   }
+   else if (nodeName == dacNode || findNode(nodeName) != NULL)
+      throw Exception("node name already in use: " + nodeName);
+
+   s->getUnit()->setup();
+   s->setNodeName(nodeName);
+   s->setSerial(++mSerial);
    mUnitLoaders.push_back(std::move(s));
+   publish();
    return mUnitLoaders.size(); // synth's id;
 }
 
@@ -132,7 +439,29 @@ size_t JackEngine::addSynth(unique_ptr<UnitLoader> &&s)
 // Del a synthesizer by number.
 void JackEngine::delNthSynth(size_t n)
 {
+   lock_guard<mutex> lock(mEditMtx);
+
+   unique_ptr<UnitLoader> old = std::move(mUnitLoaders[n]);
    mUnitLoaders.erase(mUnitLoaders.begin() + n);
+
+   // Drop the connections of the node.
+   for (auto it = mEdges.begin(); it != mEdges.end(); )
+      if (it->first == old->getNodeName() || it->second == old->getNodeName())
+         it = mEdges.erase(it);
+      else
+         it ++;
+
+   mModulations.erase(remove_if(mModulations.begin(), mModulations.end(),
+                                [&](const ModulationSpec &m)
+                                { return m.from == old->getNodeName() || m.to == old->getNodeName(); }),
+                      mModulations.end());
+
+   mSequences.erase(remove_if(mSequences.begin(), mSequences.end(),
+                              [&](const SequenceSpec &q) { return q.node == old->getNodeName(); }),
+                    mSequences.end());
+
+   publish();
+   retire(std::move(old));
 }
 
 //=================================================================================
@@ -140,13 +469,25 @@ void JackEngine::delNthSynth(size_t n)
 // Replace a synthesizer with a new one.
 void JackEngine::replaceNthSynth(size_t n, unique_ptr<UnitLoader> &&s)
 {
+   lock_guard<mutex> lock(mEditMtx);
+
+   s->getUnit()->setup();
+   s->setNodeName(mUnitLoaders[n]->getNodeName());
+   s->setSerial(++mSerial);
+
+   unique_ptr<UnitLoader> old = std::move(mUnitLoaders[n]);
    mUnitLoaders[n] = std::move(s);
+   publish();
+   retire(std::move(old));
 }
 
 //=================================================================================
 void JackEngine::swapSynths(size_t n1, size_t n2)
 {
+   lock_guard<mutex> lock(mEditMtx);
+
    swap(mUnitLoaders[n1], mUnitLoaders[n2]);
+   publish();
 }
 
 //=================================================================================
@@ -173,90 +514,724 @@ size_t JackEngine::getSynthCount()
    return mUnitLoaders.size();
 }
 
+//=================================================================================
+// < JackEngine >
+// Connect the nodes of the chain one after another. The last one may be "dac".
+void JackEngine::connect(const vector<string> &chain)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   for (size_t i = 0; i < chain.size(); i ++)
+      if ((chain[i] != dacNode || i + 1 != chain.size()) && findNode(chain[i]) == NULL)
+         throw Exception("no such node: " + chain[i]);
+
+   vector<pair<string, string>> added;
+   for (size_t i = 0; i + 1 < chain.size(); i ++)
+      if (mEdges.insert(make_pair(chain[i], chain[i + 1])).second)
+         added.push_back(make_pair(chain[i], chain[i + 1]));
+
+   try
+   {
+      publish();
+   }
+   catch (Exception &e)
+   {
+      // Take the new connections back, they make a cycle.
+      for (const pair<string, string> &e : added)
+         mEdges.erase(e);
+      throw;
+   }
+}
+
+//=================================================================================
+// < JackEngine >
+// Remove the connection between two nodes.
+void JackEngine::disconnect(string from, string to)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   if (mEdges.erase(make_pair(from, to)) == 0)
+      throw Exception("no such connection");
+
+   publish();
+}
+
+//=================================================================================
+// < JackEngine >
+// Let a node drive a control of another node. Replaces an earlier modulation
+// of the same control.
+void JackEngine::modulate(const ModulationSpec &m)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   UnitLoader *from = findNode(m.from);
+   UnitLoader *to = findNode(m.to);
+   if (from == NULL || to == NULL)
+      throw Exception("no such node: " + (from == NULL ? m.from : m.to));
+   if (!to->getUnit()->ctlModulatable(to->getUnit()->ctlHandle(m.control)))
+      throw Exception("the control does not take modulation: " + m.control);
+
+   vector<ModulationSpec> saved = mModulations;
+   mModulations.erase(remove_if(mModulations.begin(), mModulations.end(),
+                                [&](const ModulationSpec &o) { return o.to == m.to && o.control == m.control; }),
+                      mModulations.end());
+   mModulations.push_back(m);
+
+   try
+   {
+      publish();
+   }
+   catch (Exception &e)
+   {
+      // The modulation makes a cycle.
+      mModulations = saved;
+      throw;
+   }
+}
+
+//=================================================================================
+// < JackEngine >
+// Stop modulating a control.
+void JackEngine::unmodulate(string to, string control)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   size_t count = mModulations.size();
+   mModulations.erase(remove_if(mModulations.begin(), mModulations.end(),
+                                [&](const ModulationSpec &o) { return o.to == to && o.control == control; }),
+                      mModulations.end());
+   if (mModulations.size() == count)
+      throw Exception("no such modulation");
+
+   publish();
+}
+
+//=================================================================================
+// < JackEngine >
+// Get the names of the nodes a node plays to.
+vector<string> JackEngine::getOutputs(string nodeName)
+{
+   lock_guard<mutex> lock(mEditMtx);
+   vector<string> outs;
+
+   for (const pair<string, string> &e : mEdges)
+      if (e.first == nodeName)
+         outs.push_back(e.second);
+
+   for (const ModulationSpec &m : mModulations)
+      if (m.from == nodeName)
+         outs.push_back("~" + m.to + "." + m.control);
+
+   if (outs.empty())
+      outs.push_back(dacNode);
+
+   return outs;
+}
+
+//=================================================================================
+// < JackEngine >
+// Get the size of the current graph and of the buffers it renders into.
+void JackEngine::getGraphInfo(size_t &nodes, size_t &buffers, size_t &bytes)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   // Only editing retires the graph, so it is safe to look at under the lock.
+   ProcessGraph *graph = mGraph.load();
+   nodes = graph->size();
+   buffers = graph->bufferCount();
+   bytes = graph->bufferBytes();
+}
+
+//=================================================================================
+// < JackEngine >
+// Whether the nth node was skipped as silent in the last block, and how many
+// blocks it has been skipped since the graph was published. False for a node
+// that is gone: the listing commands may race with an unload.
+bool JackEngine::getNodeIdle(size_t n, uint64_t &skipped)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   ProcessGraph *graph = mGraph.load();
+   skipped = 0;
+   if (n >= graph->size())
+      return false;
+
+   skipped = graph->skippedBlocks(n);
+   return graph->isAsleep(n);
+}
+
+//=================================================================================
+// Scheduled control change. The unit may have been removed since, in which case
+// the render code no longer has it in the graph; another unit may even have
+// been loaded at its address, so the serial has to match as well.
+static void ctlEvent(const Event &e, void *context)
+{
+   ProcessGraph *graph = ((RenderContext*) context)->graph;
+   AudioUnit *unit = (AudioUnit*) e.target;
+
+   if (graph->contains(unit, e.serial))
+      unit->applyCtl(e.control, e.value);
+}
+
+//=================================================================================
+// < JackEngine >
+// Set a control of the nth node on the sample time, which is counted in frames
+// rendered (see getFrameTime()).
+void JackEngine::scheduleCtl(uint64_t time, size_t n, string control, double value)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   if (n >= mUnitLoaders.size())
+      throw Exception("Index out of bounds.");
+
+   AudioUnit *unit = mUnitLoaders[n]->getUnit().get();
+   if (!mScheduler.schedule(time, ctlEvent, unit, unit->ctlHandle(control), value,
+                            mUnitLoaders[n]->getSerial()))
+      throw Exception("Too many scheduled events");
+}
+
+//=================================================================================
+// Control change due on a beat. The render thread looks again every block for
+// when the beat plays, in case the tempo changed.
+static void launchEvent(const Event &e, void *context)
+{
+   RenderContext *r = (RenderContext*) context;
+
+   if (r->transport->onBeat(e, *r->scheduler, renderBlockFrames))
+      ctlEvent(e, context);
+}
+
+//=================================================================================
+// < JackEngine >
+// Set a control of the nth node on a beat of the transport. Returns the sample
+// time it is due at as the tempo stands; it moves with the tempo changes made
+// before then.
+uint64_t JackEngine::scheduleCtlAtBeat(double beat, size_t n, string control, double value)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   if (n >= mUnitLoaders.size())
+      throw Exception("Index out of bounds.");
+
+   uint64_t now = getFrameTime(), time;
+   if (!mTransport.state().timeOfBeat(beat, sampleRate, time) || time < now)
+      throw Exception("The transport is stopped or past the beat");
+
+   AudioUnit *unit = mUnitLoaders[n]->getUnit().get();
+   if (!mScheduler.schedule(now, launchEvent, unit, unit->ctlHandle(control), value,
+                            mUnitLoaders[n]->getSerial(), beat))
+      throw Exception("Too many scheduled events");
+   return time;
+}
+
+//=================================================================================
+// < JackEngine >
+// Set a control of the nth node on the next bar that is a multiple of bars.
+// Returns the sample time it is due at as the tempo stands.
+uint64_t JackEngine::launchCtl(size_t n, string control, double value, unsigned bars)
+{
+   TransportState s = mTransport.state();
+   if (!s.rolling)
+      throw Exception("The transport is stopped");
+
+   return scheduleCtlAtBeat(s.barAfter(getFrameTime(), sampleRate, bars), n, control, value);
+}
+
+//=================================================================================
+// Transport changes, run on the render thread at their sample.
+static void startEvent(const Event &e, void *context) { ((Transport*) e.target)->start(e.time); }
+static void stopEvent(const Event &e, void *context) { ((Transport*) e.target)->stop(e.time); }
+static void locateEvent(const Event &e, void *context) { ((Transport*) e.target)->locate(e.value, e.time); }
+static void tempoEvent(const Event &e, void *context) { ((Transport*) e.target)->setTempo(e.value, e.time); }
+static void meterEvent(const Event &e, void *context) { ((Transport*) e.target)->setMeter((unsigned) e.value); }
+
+//=================================================================================
+// < JackEngine >
+// Have the render thread change the transport at its next block.
+void JackEngine::post(EventFn fn, double value)
+{
+   if (!mScheduler.schedule(getFrameTime(), fn, &mTransport, 0, value))
+      throw Exception("Too many scheduled events");
+}
+
+//=================================================================================
+// < JackEngine >
+// Start the transport, or the Jack transport when following it.
+void JackEngine::transportStart()
+{
+   if (mJackSync)
+      jack_transport_start(client);
+   else
+      post(startEvent);
+}
+
+//=================================================================================
+// < JackEngine >
+// Stop the transport, or the Jack transport when following it.
+void JackEngine::transportStop()
+{
+   if (mJackSync)
+      jack_transport_stop(client);
+   else
+      post(stopEvent);
+}
+
+//=================================================================================
+// < JackEngine >
+// Move the transport to a beat, or the Jack transport to its frame.
+void JackEngine::transportLocate(double beat)
+{
+   if (mJackSync)
+      jack_transport_locate(client, (jack_nframes_t) (beat * 60 * sampleRate / mTransport.state().bpm));
+   else
+      post(locateEvent, beat);
+}
+
+//=================================================================================
+// < JackEngine >
+// Change the tempo. The Jack transport's tempo belongs to its timebase master.
+void JackEngine::setTempo(double bpm)
+{
+   if (bpm <= 0)
+      throw Exception("The tempo must be positive");
+   if (mJackSync)
+      throw Exception("The tempo follows the Jack transport");
+   post(tempoEvent, bpm);
+}
+
+//=================================================================================
+// < JackEngine >
+// Change the beats in a bar.
+void JackEngine::setMeter(unsigned beatsPerBar)
+{
+   if (beatsPerBar == 0)
+      throw Exception("A bar needs a beat");
+   if (mJackSync)
+      throw Exception("The meter follows the Jack transport");
+   post(meterEvent, beatsPerBar);
+}
+
+//=================================================================================
+// < JackEngine >
+// Follow the Jack transport or go on from where it left the clock.
+void JackEngine::setJackSync(bool on)
+{
+   mJackSync = on;
+}
+
+//=================================================================================
+// Find the pattern of a track.
+static vector<SequenceSpec>::iterator findTrack(vector<SequenceSpec> &sequences, unsigned track)
+{
+   return find_if(sequences.begin(), sequences.end(),
+                  [&](const SequenceSpec &q) { return q.track == track; });
+}
+
+//=================================================================================
+// < JackEngine >
+// Play steps on a node's "freq" and "gate" controls. A track already playing
+// keeps its timing and its place in the song.
+void JackEngine::setSequence(unsigned track, string node, const Pattern &pattern)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   if (track >= maxSeqTracks)
+      throw Exception("no such track");
+   UnitLoader *u = findNode(node);
+   if (u == NULL)
+      throw Exception("no such node: " + node);
+
+   ctlHandle_t h;
+   if (!findCtl(u->getUnit().get(), "freq", h) && !findCtl(u->getUnit().get(), "gate", h))
+      throw Exception("the node has no freq or gate control: " + node);
+
+   vector<SequenceSpec>::iterator it = findTrack(mSequences, track);
+   if (it == mSequences.end())
+      mSequences.push_back(SequenceSpec { track, node, pattern });
+   else
+   {
+      it->node = node;
+      it->pattern.steps = pattern.steps;
+   }
+
+   publish();
+}
+
+//=================================================================================
+// < JackEngine >
+// Set the beats per step and the swing of a track.
+void JackEngine::setSeqTiming(unsigned track, double stepBeats, double swing)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   if (stepBeats <= 0 || swing <= 0 || swing >= 1)
+      throw Exception("a step needs a length and a swing between 0 and 1");
+
+   vector<SequenceSpec>::iterator it = findTrack(mSequences, track);
+   if (it == mSequences.end())
+      throw Exception("no such track");
+
+   it->pattern.stepBeats = stepBeats;
+   it->pattern.swing = swing;
+   publish();
+}
+
+//=================================================================================
+// < JackEngine >
+// Silence a track.
+void JackEngine::clearSequence(unsigned track)
+{
+   lock_guard<mutex> lock(mEditMtx);
+
+   vector<SequenceSpec>::iterator it = findTrack(mSequences, track);
+   if (it == mSequences.end())
+      throw Exception("no such track");
+
+   mSequences.erase(it);
+   publish();
+}
+
+//=================================================================================
+// < JackEngine >
+// Get the patterns being played.
+vector<SequenceSpec> JackEngine::getSequences()
+{
+   lock_guard<mutex> lock(mEditMtx);
+   return mSequences;
+}
+
+//=================================================================================
+// < JackEngine >
+// Render side: move the clock to where the Jack transport is. What waits in
+// the ringbuffer plays before the frames rendered now.
+void JackEngine::followJack(uint64_t now)
+{
+   jack_position_t pos;
+   jack_transport_state_t state = jack_transport_query(client, &pos);
+   bool rolling = state == JackTransportRolling || state == JackTransportLooping;
+
+   TransportState s = mTransport.state();
+   double bpm = 0, beat, tolerance = 0;
+   unsigned beatsPerBar = 0;
+
+   if (pos.valid & JackPositionBBT)
+   {
+      bpm = pos.beats_per_minute;
+      beatsPerBar = (unsigned) pos.beats_per_bar;
+      beat = (pos.bar - 1) * pos.beats_per_bar + (pos.beat - 1) + pos.tick / pos.ticks_per_beat;
+
+      // The position is whole ticks, frames before the cycle when Jack says
+      // so: only a jump of more than a tick moves the clock.
+      if (pos.valid & JackBBTFrameOffset)
+         beat += pos.bbt_offset * bpm / (60.0 * sampleRate);
+      tolerance = 1 / pos.ticks_per_beat;
+   }
+   else
+      beat = pos.frame * s.bpm / (60.0 * sampleRate);
+
+   if (rolling && getRenderMode() == RENDER_AHEAD)
+   {
+      double ahead = jack_ringbuffer_read_space(ringbuffer) / sizeof(sample_t);
+      beat += ahead * (bpm > 0 ? bpm : s.bpm) / (60.0 * sampleRate);
+   }
+
+   mTransport.follow(rolling, beat, bpm, beatsPerBar, now, tolerance);
+}
+
 //=================================================================================
 // Callback for Jack.
 int jack_process_cb(jack_nframes_t nframes, void *arg)
 {
-   static uint64_t t = 0;
    JackEngine *jack = (JackEngine*) arg;
 
-   jack_default_audio_sample_t *out = (jack_default_audio_sample_t *) jack_port_get_buffer(jack->output_port, nframes);
+   jack_default_audio_sample_t *out = (jack_default_audio_sample_t *) jack_port_get_buffer(jack->output_port, nframes);
+
+   jack->xruns.periods.fetch_add(1, std::memory_order_relaxed);
+
+   if (jack->getRenderMode() == RENDER_DIRECT)
+   {
+      // Drop whatever the render-ahead thread has left behind.
+      jack_ringbuffer_read_advance(jack->ringbuffer, jack_ringbuffer_read_space(jack->ringbuffer));
+
+      // Render straight into the port buffer unless the render-ahead thread
+      // is still finishing its last chunk after a mode switch.
+      if (!jack->mRenderLock.test_and_set(std::memory_order_acquire))
+      {
+         jack->render(out, nframes);
+         jack->mRenderLock.clear(std::memory_order_release);
+      }
+      else
+      {
+         memset(out, 0, nframes * sizeof(jack_default_audio_sample_t));
+         jack->xruns.addUnderrun(nframes);
+      }
+
+      return 0;
+   }
+
+   // Take whatever the render-ahead thread has produced, never wait for more.
+   size_t readLen = nframes * sizeof(jack_default_audio_sample_t);
+   size_t got = jack_ringbuffer_read(jack->ringbuffer, (char*) out, readLen)
+      / sizeof(jack_default_audio_sample_t);
+
+   // Let the render-ahead thread refill the buffer.
+   pthread_cond_signal(&jackRingbufCanWrite);
+
+   if (got < nframes)
+   {
+      // Underrun: fade out from the last sample sent and fill the rest with silence.
+      uint64_t missing = nframes - got;
+      sample_t last = got > 0 ? out[got - 1] : jack->mLastSample;
+      jack_nframes_t fade = min((jack_nframes_t) missing, underrunFadeFrames);
+
+      for (jack_nframes_t i = 0; i < fade; i ++)
+         out[got + i] = last * (fade - i - 1) / fade;
+      memset(out + got + fade, 0, (missing - fade) * sizeof(jack_default_audio_sample_t));
+
+      jack->xruns.addUnderrun(missing);
+   }
+
+   if (nframes > 0)
+      jack->mLastSample = out[nframes - 1];
+
+   return 0;      
+}
+
+//=================================================================================
+// Processing function. Writes the data into the jack's ringbuffer.
+void* jack_thread_func(void *arg)
+{
+   static const size_t writeBufSize = 1024768;
+   static jack_default_audio_sample_t writeBuf[writeBufSize];
+
+   JackEngine *jack = (JackEngine*) arg;
+
+   while (!globalExit)
+   {
+      // The number of samples to write. The ringbuffer is only resized under
+      // the render lock.
+      bool locked = jack->getRenderMode() == RENDER_AHEAD
+         && !jack->mRenderLock.test_and_set(std::memory_order_acquire);
+      size_t nframes = 0;
+      if (locked)
+         nframes = min(jack_ringbuffer_write_space(jack->ringbuffer) / sizeof(jack_default_audio_sample_t),
+                       writeBufSize);
+
+      // Sleep while there is no room in the buffer or the process callback
+      // renders by itself.
+      if (nframes == 0)
+      {
+         if (locked)
+            jack->mRenderLock.clear(std::memory_order_release);
+
+         // Wait for the buffer to be read
+         pthread_mutex_lock(&jackRingbufMtx);
+         pthread_cond_wait(&jackRingbufCanWrite, &jackRingbufMtx);
+         pthread_mutex_unlock(&jackRingbufMtx);
+         continue;
+      }
+
+      jack->render(writeBuf, nframes);
+      jack_ringbuffer_write(jack->ringbuffer, (const char*) writeBuf, nframes * sizeof(jack_default_audio_sample_t));
+      jack->mRenderLock.clear(std::memory_order_release);
+   }
+
+   return NULL;
+}
+
+//=================================================================================
+// Callback for the buffer size change event. Jack does not run the process
+// callback meanwhile.
+int jack_buffsize_cb(jack_nframes_t nframes, void *arg)
+{
+   JackEngine *jack = (JackEngine*) arg;
+
+   try
+   {
+      jack->resizeRingbuffer(nframes);
+   }
+   catch (Exception &e)
+   {
+      cout << "Error: " << e.text << endl;
+      return 1;
+   }
+
+   return 0;
+}
+
+//=================================================================================
+// Callback for the xrun event.
+int jack_xrun_cb(void *arg)
+{
+   JackEngine *jack = (JackEngine*) arg;
+   jack->xruns.jackXruns.fetch_add(1, std::memory_order_relaxed);
+   return 0;
+}
+
+//=================================================================================
+// Callback for Jack shutdown.
+void jack_shutdown_cb(void *arg)
+{
+   JackEngine *jack = (JackEngine*) arg;
+   jack->shutdown();
+}
+
+//=================================================================================
+// Sequencer functions for Scheme files. They belong at the top level of a file,
+// which runs when it is loaded: before the engine has its node, so the edits
+// they ask for wait in scmPending until the node is added.
+static JackEngine *scmJack = NULL;
+static vector<function<void()>> scmPending;
+
+// Make the edits the file being loaded asked for, or drop them if it failed.
+static void runScmPending(bool loaded, bool quiet)
+{
+   vector<function<void()>> edits;
+   edits.swap(scmPending);
+
+   for (size_t i = 0; loaded && i < edits.size(); i ++)
+   {
+      try
+      {
+         edits[i]();
+      }
+      catch (Exception &e)
+      {
+         if (!quiet)
+            cout << "seq: " << e.text << endl;
+      }
+   }
+}
+
+// s7_error does not return but jumps back into the interpreter, skipping the
+// C++ destructors: the callers have none left in scope, the message being a
+// Scheme string by then.
+static s7_pointer scmSeqError(s7_scheme *sc, s7_pointer message)
+{
+   return s7_error(sc, s7_make_symbol(sc, "seq-error"), s7_list(sc, 1, message));
+}
+
+// (seq track node steps): steps as a string, as for the seq command, or as a
+// list of note numbers, note names (C4 or :C4) and #f for rests.
+static s7_pointer scmSeq(s7_scheme *sc, s7_pointer args)
+{
+   s7_pointer error = NULL;
+
+   try
+   {
+      s7_pointer steps = s7_caddr(args);
+      Pattern p;
+
+      if (!s7_is_string(s7_cadr(args)))
+         throw Exception("the node must be a string");
+
+      if (s7_is_string(steps))
+         p = Pattern::parse(s7_string(steps));
+      else
+      {
+         for (; s7_is_pair(steps); steps = s7_cdr(steps))
+         {
+            s7_pointer x = s7_car(steps);
+            Step step { restNote, 1, 1, 1 };
 
-   memset(out, 0, nframes * sizeof(jack_default_audio_sample_t));
+            if (s7_is_number(x))
+               step.note = s7_number_to_real(sc, x);
+            else if (s7_is_symbol(x))
+            {
+               string name = s7_symbol_name(x);
+               name.erase(0, name.find_first_not_of(':'));
+               step.note = parseNote(name.substr(0, name.find(':')));
+            }
+            else if (x != s7_f(sc))
+               throw Exception("bad step");
 
-   size_t readLen = nframes * sizeof(jack_default_audio_sample_t);
-   char *outP = (char*)out;
+            p.steps.push_back(step);
+         }
+      }
 
-   // Read the ringbuffer until the output buffer is filled.
-   while (readLen > 0)
+      unsigned track = (unsigned) s7_number_to_integer(sc, s7_car(args)) - 1;
+      string node = s7_string(s7_cadr(args));
+      scmPending.push_back([=]() { scmJack->setSequence(track, node, p); });
+   }
+   catch (Exception &e)
    {
-      size_t l = jack_ringbuffer_read(jack->ringbuffer, outP, readLen);
-      outP += l;        // Increment the buffer pointer.
-      readLen -= l;     // Decrement the number of bytes to be read.
-
-      // Notify that the buffer can be written
-      if (l > 0)
-         pthread_cond_signal(&jackRingbufCanWrite);
+      error = s7_make_string(sc, e.text.c_str());
    }
 
-   t += nframes;
-
-   return 0;      
+   return error == NULL ? s7_t(sc) : scmSeqError(sc, error);
 }
 
-//=================================================================================
-// Processing function. Writes the data into the jack's ringbuffer.
-void* jack_thread_func(void *arg)
+// (seq-euclid track node pulses steps [rotate [note]])
+static s7_pointer scmSeqEuclid(s7_scheme *sc, s7_pointer args)
 {
-   //TODO! corrently there's no guarantee nframe is less than the buffer size!
-
-   static uint64_t t = 0;     // Frame count.
-   static const size_t writeBufSize = 1024768;
-   static jack_default_audio_sample_t writeBuf[writeBufSize];
+   s7_pointer error = NULL;
 
-   JackEngine *jack = (JackEngine*) arg;
-
-   while (!globalExit)
+   try
    {
-      // The number of samples to write.
-      size_t nframes = jack_ringbuffer_write_space(jack->ringbuffer) / sizeof(jack_default_audio_sample_t);
+      s7_pointer rest = s7_cdddr(s7_cdr(args));
+      int rotate = 0;
+      double note = 60;
 
-      if (nframes == 0)
+      if (!s7_is_string(s7_cadr(args)))
+         throw Exception("the node must be a string");
+      if (s7_is_pair(rest))
       {
-         // Wait for the buffer to be read
-         pthread_mutex_lock(&jackRingbufMtx);
-         pthread_cond_wait(&jackRingbufCanWrite, &jackRingbufMtx);
-         pthread_mutex_unlock(&jackRingbufMtx);
-         continue;
+         rotate = (int) s7_number_to_integer(sc, s7_car(rest));
+         if (s7_is_pair(s7_cdr(rest)))
+            note = s7_number_to_real(sc, s7_cadr(rest));
       }
 
-      // fill the buffer with zeros
-      memset((void*) writeBuf, 0, nframes * sizeof(jack_default_audio_sample_t));
-
-      for (unique_ptr<UnitLoader> &u : jack->getSynths())
-         u->getUnit()->process(nframes, writeBuf, t);
+      Pattern p = Pattern::euclid((unsigned) s7_number_to_integer(sc, s7_caddr(args)),
+                                  (unsigned) s7_number_to_integer(sc, s7_cadddr(args)), rotate, note);
+      unsigned track = (unsigned) s7_number_to_integer(sc, s7_car(args)) - 1;
+      string node = s7_string(s7_cadr(args));
+      scmPending.push_back([=]() { scmJack->setSequence(track, node, p); });
+   }
+   catch (Exception &e)
+   {
+      error = s7_make_string(sc, e.text.c_str());
+   }
 
-      t += nframes;
+   return error == NULL ? s7_t(sc) : scmSeqError(sc, error);
+}
 
-      jack_ringbuffer_write(jack->ringbuffer, (const char*) writeBuf, nframes * sizeof(jack_default_audio_sample_t));
-   }
+// (seq-rate track beats-per-step [swing])
+static s7_pointer scmSeqRate(s7_scheme *sc, s7_pointer args)
+{
+   unsigned track = (unsigned) s7_number_to_integer(sc, s7_car(args)) - 1;
+   double stepBeats = s7_number_to_real(sc, s7_cadr(args));
+   bool hasSwing = s7_is_pair(s7_cddr(args));
+   double swing = hasSwing ? s7_number_to_real(sc, s7_caddr(args)) : 0.5;
 
-   return NULL;
+   scmPending.push_back([=]()
+   {
+      double s = swing;
+      if (!hasSwing)
+         for (const SequenceSpec &q : scmJack->getSequences())
+            if (q.track == track)
+               s = q.pattern.swing;
+      scmJack->setSeqTiming(track, stepBeats, s);
+   });
+   return s7_t(sc);
 }
 
-//=================================================================================
-// Callback for the buffer size change event.
-int jack_buffsize_cb(jack_nframes_t nframes, void *arg)
+// (seq-off track)
+static s7_pointer scmSeqOff(s7_scheme *sc, s7_pointer args)
 {
-   return 0;
+   unsigned track = (unsigned) s7_number_to_integer(sc, s7_car(args)) - 1;
+
+   scmPending.push_back([=]() { scmJack->clearSequence(track); });
+   return s7_t(sc);
 }
 
-//=================================================================================
-// Callback for Jack shutdown.
-void jack_shutdown_cb(void *arg)
+static void defineScmSequencer(s7_scheme *sc, JackEngine *jack)
 {
-   JackEngine *jack = (JackEngine*) arg;
-   jack->shutdown();
+   scmJack = jack;
+   s7_define_function(sc, "seq", scmSeq, 3, 0, false, "(seq track node steps) play a pattern on a node");
+   s7_define_function(sc, "seq-euclid", scmSeqEuclid, 4, 2, false,
+                      "(seq-euclid track node pulses steps [rotate [note]]) play a euclidean rhythm");
+   s7_define_function(sc, "seq-rate", scmSeqRate, 2, 1, false, "(seq-rate track beats [swing]) set the step length");
+   s7_define_function(sc, "seq-off", scmSeqOff, 1, 0, false, "(seq-off track) silence a track");
 }
 
 //=================================================================================
@@ -271,17 +1246,19 @@ int processCommand(JackEngine *jack, char *s, bool quiet = false)
    /* command: load; load a shared object */
    if (cmd == "+" || cmd == "l" || cmd == "load")
    {
-      string arg;
+      string arg, name;
 
       try
       {
-         iss >> arg;
+         iss >> arg >> name;
 
-         jack->addSynth(loadUnit(arg));
-         cout << jack->getSynthCount() << ": " << arg << endl;
+         size_t id = jack->addSynth(loadUnit(arg), name);
+         cout << id << ": " << jack->nthSynth(id - 1)->getNodeName() << endl;
+         runScmPending(true, quiet);
       }
       catch (Exception &err)
       {
+         runScmPending(false, quiet);
          if (!quiet)
             cout << err.text << endl;
       }
@@ -331,9 +1308,11 @@ int processCommand(JackEngine *jack, char *s, bool quiet = false)
          {
             jack->replaceNthSynth(n - 1, loadUnit(fileName));
             cout << n << ". " << fileName << endl;
+            runScmPending(true, quiet);
          }
          catch (Exception &err)
          {
+            runScmPending(false, quiet);
             if (!quiet)
                cout << "Cannot load the module: " << err.text << endl
                   << "errno: " << err.code << " (" << strerror(err.code) << ")" << endl;
@@ -387,15 +1366,16 @@ int processCommand(JackEngine *jack, char *s, bool quiet = false)
          if (iss.fail())
          {
             // list all controls for the given unit
+            unsigned h = 0;
             for (controlIter_t it = jack->nthSynth(n - 1)->getUnit()->ctlListIter();
                  it != jack->nthSynth(n - 1)->getUnit()->ctlListEnd();
                  it ++)
             {
-               cout << it->first << " = ";
-               if (it->second == NULL)
+               cout << "[" << h ++ << "] " << it->name << " = ";
+               if (it->ptr == NULL)
                   cout << "NULL";
                else
-                  cout << *it->second;
+                  cout << *it->ptr;
                cout << endl;
             }
             return true;
@@ -403,11 +1383,139 @@ int processCommand(JackEngine *jack, char *s, bool quiet = false)
 
          iss >> v;
          if (iss.fail())
+         {
             // display the control's value
             cout << jack->nthSynth(n - 1)->getUnit()->getCtl(c) << endl;
-         else
-            // set the new value
-            jack->nthSynth(n - 1)->getUnit()->setCtl(c, v);
+            return true;
+         }
+
+         // set the new value, optionally gliding to it
+         double ramp = 0;
+         string shape;
+         iss >> ramp >> shape;
+         if (ramp < 0)
+         {
+            cout << "control: wrong data" << endl;
+            return true;
+         }
+
+         AudioUnit *unit = jack->nthSynth(n - 1)->getUnit().get();
+         unit->setCtl(unit->ctlHandle(c), v, 0, ramp * jack->sampleRate,
+                      shape == "exp" ? RAMP_EXP : RAMP_LINEAR);
+      }
+      catch (Exception &e)
+      {
+         cout << e.text << endl;
+      }
+   }
+
+   /* command: set a control at a later time */
+   else if (cmd == "@" || cmd == "at")
+   {
+      double seconds, v;
+      unsigned n;
+      string c;
+
+      iss >> seconds >> n >> c >> v;
+      if (iss.fail() || seconds < 0 || n <= 0 || n > jack->getSynthCount())
+      {
+         if (!quiet)
+            cout << "at: wrong data" << endl;
+         return true;
+      }
+
+      try
+      {
+         jack->scheduleCtl(jack->getFrameTime() + (uint64_t) (seconds * jack->sampleRate), n - 1, c, v);
+      }
+      catch (Exception &e)
+      {
+         cout << e.text << endl;
+      }
+   }
+
+   /* command: transport */
+   else if (cmd == "tr" || cmd == "transport")
+   {
+      string sub;
+      iss >> sub;
+
+      try
+      {
+         if (sub == "play")
+            jack->transportStart();
+         else if (sub == "stop")
+            jack->transportStop();
+         else if (sub == "locate" || sub == "tempo" || sub == "meter")
+         {
+            double v;
+            iss >> v;
+            if (iss.fail())
+            {
+               cout << "transport: wrong data" << endl;
+               return true;
+            }
+
+            if (sub == "locate")
+               jack->transportLocate(max(v - 1, 0.0) * jack->getTransport().beatsPerBar);
+            else if (sub == "tempo")
+               jack->setTempo(v);
+            else
+               jack->setMeter((unsigned) v);
+         }
+         else if (sub == "jack")
+         {
+            string on;
+            iss >> on;
+            if (on != "on" && on != "off")
+            {
+               cout << "transport: wrong data" << endl;
+               return true;
+            }
+            jack->setJackSync(on == "on");
+         }
+         else if (sub != "")
+         {
+            cout << "transport: wrong data" << endl;
+            return true;
+         }
+      }
+      catch (Exception &e)
+      {
+         cout << e.text << endl;
+         return true;
+      }
+
+      if (sub == "" && !quiet)
+      {
+         TransportState s = jack->getTransport();
+         BarBeatTick p = s.position(jack->getFrameTime(), jack->sampleRate);
+         cout << (p.bar + 1) << "." << (p.beat + 1) << "." << p.tick
+              << "  " << s.bpm << " bpm  " << s.beatsPerBar << " beats/bar  "
+              << (s.rolling ? "rolling" : "stopped")
+              << (jack->getJackSync() ? "  [jack]" : "") << endl;
+      }
+   }
+
+   /* command: set a control on the next bar */
+   else if (cmd == "launch")
+   {
+      unsigned n, bars = 1;
+      string c;
+      double v;
+
+      iss >> n >> c >> v;
+      if (iss.fail() || n <= 0 || n > jack->getSynthCount())
+      {
+         if (!quiet)
+            cout << "launch: wrong data" << endl;
+         return true;
+      }
+      iss >> bars;
+
+      try
+      {
+         jack->launchCtl(n - 1, c, v, max(bars, 1u));
       }
       catch (Exception &e)
       {
@@ -415,13 +1523,271 @@ int processCommand(JackEngine *jack, char *s, bool quiet = false)
       }
    }
 
+   /* command: pattern sequencer */
+   else if (cmd == "seq" || cmd == "sequence")
+   {
+      unsigned track;
+      string what;
+
+      if (!(iss >> track))
+      {
+         for (const SequenceSpec &q : jack->getSequences())
+            cout << (q.track + 1) << ": " << q.node << "  " << q.pattern.steps.size() << " steps of "
+                 << q.pattern.stepBeats << " beats, swing " << q.pattern.swing << endl;
+         return true;
+      }
+      iss >> what;
+
+      try
+      {
+         if (what == "off")
+            jack->clearSequence(track - 1);
+         else if (what == "rate")
+         {
+            double beats, swing = 0.5;
+            iss >> beats;
+            if (iss.fail())
+            {
+               if (!quiet)
+                  cout << "seq: wrong data" << endl;
+               return true;
+            }
+
+            for (const SequenceSpec &q : jack->getSequences())
+               if (q.track == track - 1)
+                  swing = q.pattern.swing;
+            iss >> swing;
+
+            jack->setSeqTiming(track - 1, beats, swing);
+         }
+         else
+         {
+            string steps, rest;
+            iss >> steps;
+            getline(iss, rest);
+
+            if (steps == "euclid")
+            {
+               istringstream args(rest);
+               unsigned pulses, count;
+               int rotate = 0;
+               string note = "60";
+
+               args >> pulses >> count;
+               if (args.fail())
+               {
+                  if (!quiet)
+                     cout << "seq: wrong data" << endl;
+                  return true;
+               }
+               args >> rotate >> note;
+
+               jack->setSequence(track - 1, what, Pattern::euclid(pulses, count, rotate, parseNote(note)));
+            }
+            else
+               jack->setSequence(track - 1, what, Pattern::parse(steps + rest));
+         }
+      }
+      catch (Exception &e)
+      {
+         if (!quiet)
+            cout << "seq: " << e.text << endl;
+      }
+   }
+
+   /* command: set controls by handle */
+   else if (cmd == "cs" || cmd == "ctlset")
+   {
+      unsigned n;
+      CtlValue values[64];
+      size_t count = 0;
+
+      iss >> n;
+      if (iss.fail() || n <= 0 || n > jack->getSynthCount())
+      {
+         if (!quiet)
+            cout << "ctlset: wrong data" << endl;
+         return true;
+      }
+
+      while (count < 64 && iss >> values[count].handle >> values[count].value)
+         count ++;
+
+      jack->nthSynth(n - 1)->getUnit()->setCtls(values, count);
+   }
+
    /* command: list */
    else if (cmd == "." || cmd == "ls" || cmd == "list")
    {
       Synthesizers &ss = jack->getSynths();
       unsigned i = 0;
       for (unique_ptr<UnitLoader> &u : ss)
-         cout << ++i << ": " << u->getName() << endl;
+      {
+         uint64_t skipped;
+         bool idle = jack->getNodeIdle(i, skipped);
+
+         cout << ++i << ": " << u->getNodeName() << " (" << u->getName() << ") ->";
+         for (string &o : jack->getOutputs(u->getNodeName()))
+            cout << " " << o;
+         if (idle)
+            cout << " [idle]";
+         cout << endl;
+      }
+   }
+
+   /* command: connect */
+   else if (cmd == ">" || cmd == "connect")
+   {
+      vector<string> chain;
+      string node;
+
+      while (iss >> node)
+         chain.push_back(node);
+
+      if (chain.size() < 2)
+      {
+         if (!quiet)
+            cout << "connect: expected at least two nodes" << endl;
+         return true;
+      }
+
+      try
+      {
+         jack->connect(chain);
+      }
+      catch (Exception &e)
+      {
+         if (!quiet)
+            cout << "connect: " << e.text << endl;
+      }
+   }
+
+   /* command: modulate */
+   else if (cmd == "~" || cmd == "mod" || cmd == "modulate")
+   {
+      ModulationSpec m;
+      string rate;
+
+      iss >> m.from >> m.to >> m.control;
+      if (iss.fail())
+      {
+         if (!quiet)
+            cout << "modulate: wrong input" << endl;
+         return true;
+      }
+
+      if (!(iss >> m.depth))
+         m.depth = 1;
+      iss >> rate;
+      m.audioRate = rate != "control";
+
+      try
+      {
+         jack->modulate(m);
+      }
+      catch (Exception &e)
+      {
+         if (!quiet)
+            cout << "modulate: " << e.text << endl;
+      }
+   }
+
+   /* command: unmodulate */
+   else if (cmd == "unmod" || cmd == "unmodulate")
+   {
+      string to, control;
+      iss >> to >> control;
+
+      try
+      {
+         jack->unmodulate(to, control);
+      }
+      catch (Exception &e)
+      {
+         if (!quiet)
+            cout << "unmodulate: " << e.text << endl;
+      }
+   }
+
+   /* command: graph */
+   else if (cmd == "g" || cmd == "graph")
+   {
+      size_t nodes, buffers, bytes;
+      jack->getGraphInfo(nodes, buffers, bytes);
+
+      cout << "nodes:   " << nodes << endl
+         << "buffers: " << buffers << " (" << bytes << " bytes)" << endl;
+
+      for (size_t i = 0; i < nodes; i ++)
+      {
+         uint64_t skipped;
+         bool idle = jack->getNodeIdle(i, skipped);
+         if (idle || skipped > 0)
+            cout << "  " << jack->nthSynth(i)->getNodeName() << ": " << (idle ? "idle" : "awake")
+               << ", " << skipped << " blocks skipped" << endl;
+      }
+   }
+
+   /* command: disconnect */
+   else if (cmd == "<" || cmd == "disconnect")
+   {
+      string from, to;
+      iss >> from >> to;
+
+      if (iss.fail())
+      {
+         if (!quiet)
+            cout << "disconnect: wrong input" << endl;
+         return true;
+      }
+
+      try
+      {
+         jack->disconnect(from, to);
+      }
+      catch (Exception &e)
+      {
+         if (!quiet)
+            cout << "disconnect: " << e.text << endl;
+      }
+   }
+
+   /* command: mode */
+   else if (cmd == "mode")
+   {
+      string m;
+      iss >> m;
+
+      if (m == "direct")
+         jack->setRenderMode(RENDER_DIRECT);
+      else if (m == "ahead")
+         jack->setRenderMode(RENDER_AHEAD);
+      else if (m != "")
+      {
+         if (!quiet)
+            cout << "mode: expected direct or ahead" << endl;
+         return true;
+      }
+
+      cout << "render mode: " << (jack->getRenderMode() == RENDER_DIRECT ? "direct" : "ahead") << endl;
+   }
+
+   /* command: xruns */
+   else if (cmd == "x" || cmd == "xruns")
+   {
+      string arg;
+      iss >> arg;
+
+      XrunStats &x = jack->xruns;
+      cout << "periods:        " << x.periods << endl
+         << "underruns:      " << x.underruns << endl
+         << "missing frames: " << x.missingFrames << endl
+         << "worst lateness: " << x.worstMissing << " frames ("
+         << 1000.0 * x.worstMissing / jack->sampleRate << " ms)" << endl
+         << "jack xruns:     " << x.jackXruns << endl;
+
+      if (arg == "reset")
+         x.reset();
    }
 
    /* command: quit */
@@ -434,12 +1800,35 @@ int processCommand(JackEngine *jack, char *s, bool quiet = false)
    {
       if (!quiet)
          cout << "Available commands:" << endl
-            << "(+ | l | load) <fileName>     -- load the module (file name without .so extension)" << endl
+            << "(+ | l | load) <fileName> [<node>]" << endl
+            << "                              -- load the module (file name without .so extension)" << endl
             << "(- | u | unload) <id>         -- unload the module by index (see list for index)" << endl
             << "(= | replace) <id> <fileName> -- replace the module with another one" << endl
-            << "(c | ctl | control) <id> [<control> [<value>]]" << endl
+            << "(c | ctl | control) <id> [<control> [<value> [<ramp seconds> [lin | exp]]]]" << endl
             << "                              -- list, display or update control value for the unit id" << endl
+            << "(@ | at) <seconds> <id> <control> <value>" << endl
+            << "                              -- set a control that many seconds of rendering from now" << endl
+            << "launch <id> <control> <value> [<bars>]" << endl
+            << "                              -- set a control on the next bar, or multiple of bars" << endl
+            << "(tr | transport) [play | stop | locate <bar> | tempo <bpm> | meter <beats> | jack on|off]" << endl
+            << "                              -- show or drive the tempo clock" << endl
+            << "seq [<track> (<node> <steps...> | <node> euclid <pulses> <steps> [<rotate> [<note>]]"
+            << " | rate <beats> [<swing>] | off)]" << endl
+            << "                              -- play patterns on the gate and freq controls of nodes;" << endl
+            << "                                 a step is . or a note (60, C4, F#3) with :velocity ?chance *length" << endl
+            << "(cs | ctlset) <id> <handle> <value> [<handle> <value>...]" << endl
+            << "                              -- set controls by the handles shown by ctl" << endl
             << "(. | ls | list)               -- list loaded modules" << endl
+            << "(> | connect) <node> <node>... [dac]" << endl
+            << "                              -- chain the nodes; unconnected nodes play to dac" << endl
+            << "(< | disconnect) <node> <node> -- remove a connection" << endl
+            << "(~ | mod | modulate) <from> <to> <control> [<depth> [audio | control]]" << endl
+            << "                              -- drive a control of a node by another node" << endl
+            << "(unmod | unmodulate) <to> <control>" << endl
+            << "                              -- stop modulating a control" << endl
+            << "(g | graph)                   -- show the graph size and the buffers in use" << endl
+            << "mode [direct | ahead]         -- render in the Jack callback or ahead in a thread" << endl
+            << "(x | xruns) [reset]           -- show (and reset) the underrun counters" << endl
             << "(? | help)                    -- this help message" << endl
             << "(q | quit)                    -- exit the programm" << endl;
    }
@@ -487,9 +1876,37 @@ void* commandPipeThread(void *arg)
 int main(int argc, char *argv[])
 {
    pthread_t cmdThread, procThread;
+   RenderMode mode = RENDER_AHEAD;
+   unsigned threads = 1;
+   vector<int> cpus;
+   int opt;
+
+   // Parse the command line options
+   while ((opt = getopt(argc, argv, "m:j:a:")) != -1)
+   {
+      if (opt == 'm' && string(optarg) == "direct")
+         mode = RENDER_DIRECT;
+      else if (opt == 'm' && string(optarg) == "ahead")
+         mode = RENDER_AHEAD;
+      else if (opt == 'j' && atoi(optarg) > 0)
+         threads = atoi(optarg);
+      else if (opt == 'a')
+      {
+         // comma separated list of CPUs for the helper render threads
+         istringstream iss (optarg);
+         string cpu;
+         while (getline(iss, cpu, ','))
+            cpus.push_back(atoi(cpu.c_str()));
+      }
+      else
+      {
+         cout << "Usage: " << argv[0] << " [-m direct|ahead] [-j threads] [-a cpu,cpu,...]" << endl;
+         exit(1);
+      }
+   }
 
    // Initialize Jack
-   JackEngine jack;
+   JackEngine jack(mode, threads, cpus);
    try
    {
       jack.init();
@@ -500,6 +1917,9 @@ int main(int argc, char *argv[])
       exit(1);
    }
 
+   // Scheme files may define patterns.
+   defineScmSequencer(SchemeEngine::getInstance().get(), &jack);
+
    // Start parallel processing for user input and for the ringbuffer.
    pthread_create(&cmdThread, NULL, commandPipeThread, &jack);
    pthread_create(&procThread, NULL, jack_thread_func, &jack);
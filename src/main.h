@@ -3,14 +3,26 @@
 
 #include <iostream>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <vector>
 #include <sys/types.h>
 
 #include <jack/jack.h>
 #include <jack/ringbuffer.h>
+#include <jack/transport.h>
 
 #include "s7/s7.h"
 
 #include "unitlib.h"
+#include "scmlib.h"
+#include "reclaimer.h"
+#include "workerpool.h"
+#include "graph.h"
+#include "scheduler.h"
+#include "transport.h"
+#include "sequencer.h"
 
 class JackEngine;
 class UnitLoader;
@@ -19,11 +31,20 @@ typedef jack_default_audio_sample_t sample_t;
 typedef AudioUnit* (*externalInit_t) ();
 typedef std::vector<std::unique_ptr<UnitLoader>> Synthesizers;
 
+// Where the unit list is rendered.
+enum RenderMode
+{
+   RENDER_DIRECT,    // inside the Jack process callback, straight into the port buffer
+   RENDER_AHEAD      // in a separate thread, handed over through the ringbuffer
+};
+
 // Purely virtual class/interface for a unit loader.
 class UnitLoader
 {
    private:
       std::string mName;
+      std::string mNodeName;
+      uint64_t mSerial;
       std::unique_ptr<AudioUnit> mAudioUnit;
 
    protected:
@@ -31,8 +52,14 @@ class UnitLoader
       void setUnit(std::unique_ptr<AudioUnit> &&unit) { mAudioUnit = std::move(unit); }
 
    public:
+      UnitLoader() : mSerial(0) {}
       virtual ~UnitLoader() {} 
       std::string getName() { return mName; }
+      std::string getNodeName() { return mNodeName; }
+      void setNodeName(std::string name) { mNodeName = name; }
+      // Set by the engine, unique for the life of the engine.
+      uint64_t getSerial() { return mSerial; }
+      void setSerial(uint64_t serial) { mSerial = serial; }
       std::unique_ptr<AudioUnit>& getUnit() { return mAudioUnit; }
 };
 
@@ -51,8 +78,9 @@ class CppLoader : public UnitLoader
 class SchemeEngine
 {
    private:
-      SchemeEngine() { s7 = s7_init(); }
+      SchemeEngine() { s7 = s7_init(); scmDefineUnitlib(s7); }
       s7_scheme *s7;
+      std::atomic_flag mBusy = ATOMIC_FLAG_INIT;
 
    public:
       ~SchemeEngine() { s7_quit(s7); s7 = NULL; }
@@ -72,20 +100,56 @@ class SchemeEngine
       {
          return s7_load(s7, fname.c_str());
       }
+
+      // The interpreter is not reentrant: units sharing it must not render in parallel.
+      void lock() { while (mBusy.test_and_set(std::memory_order_acquire)) ; }
+      void unlock() { mBusy.clear(std::memory_order_release); }
 };
 
-/* AudioUnit for a scheme file */
+/* AudioUnit for a scheme file. Its freq and gate controls are the note of the
+ * file's voice, see ScmVoice. */
 class ScmAudioUnit : public AudioUnit
 {
    private:
       SchemeEngine &mEngine;
       s7_pointer mFunction;
+      s7_pointer mNoise;               // this unit's generator, bound to noise while it runs
+      unsigned mNoiseLoc;
+      ScmVoice mVoice;
+
+      void bindNoise() { s7_symbol_set_value(mEngine.get(), s7_make_symbol(mEngine.get(), "noise"), mNoise); }
 
    public:
       ScmAudioUnit(SchemeEngine &eng, std::string name)
          : mEngine(eng)
       {
+         addCtl("freq", &mVoice.freq);
+         addCtl("gate", &mVoice.gate);
+
+         mEngine.lock();
+         mNoise = scmMakeNoise(mEngine.get());
+         mNoiseLoc = s7_gc_protect(mEngine.get(), mNoise);
+         bindNoise();
+         mVoice.define(mEngine.get());
          mFunction = mEngine.loadFile((name + ".scm").c_str());
+         mEngine.unlock();
+      }
+
+      ~ScmAudioUnit()
+      {
+         mEngine.lock();
+         s7_gc_unprotect_at(mEngine.get(), mNoiseLoc);
+         mEngine.unlock();
+      }
+
+      virtual int process(jack_nframes_t nframes, sample_t *out, uint64_t t)
+      {
+         mEngine.lock();
+         bindNoise();
+         mVoice.bind(mEngine.get(), t);
+         int r = AudioUnit::process(nframes, out, t);
+         mEngine.unlock();
+         return r;
       }
 
       virtual double operator() (uint64_t smp, double in = 0)
@@ -127,23 +191,90 @@ std::unique_ptr<UnitLoader> loadUnit(std::string name)
    throw Exception("File not found");
 }
 
+// Underrun accounting, updated lock-free by the Jack callbacks.
+struct XrunStats
+{
+   std::atomic<uint64_t> periods;         // process callbacks run
+   std::atomic<uint64_t> underruns;       // periods the ringbuffer could not fill
+   std::atomic<uint64_t> missingFrames;   // frames replaced by silence
+   std::atomic<uint64_t> worstMissing;    // most frames missing in a single period
+   std::atomic<uint64_t> jackXruns;       // xruns reported by the Jack server
+
+   XrunStats() { reset(); }
+   void reset();
+   void addUnderrun(uint64_t missing);
+};
+
+// A node driving a control of another node, by name.
+struct ModulationSpec
+{
+   std::string from, to, control;
+   double depth;
+   bool audioRate;
+};
+
+// A pattern played on a node, by name.
+struct SequenceSpec
+{
+   unsigned track;
+   std::string node;
+   Pattern pattern;
+};
+
 class JackEngine
 {
    private:
       Synthesizers mUnitLoaders;
 
+      std::mutex mEditMtx;                               // serializes the editing threads
+      uint64_t mGeneration;                              // generation of the last snapshot
+      uint64_t mSerial;                                  // of the last unit added
+      std::set<std::pair<std::string, std::string>> mEdges;    // connections by node name
+      std::vector<ModulationSpec> mModulations;
+      std::vector<SequenceSpec> mSequences;
+      std::atomic<ProcessGraph*> mGraph;                 // what the render code renders
+      std::atomic<SeqTracks*> mSeqTracks;                // patterns, published with the graph
+      Reclaimer mReclaimer;                              // frees what the render code let go of
+      WorkerPool mPool;                                  // threads rendering the graph
+
+      void publish();
+      UnitLoader* findNode(std::string nodeName);
+      void retire(std::unique_ptr<UnitLoader> &&synth);
+
+      std::atomic<int> mRenderMode;
+      std::atomic_flag mRenderLock = ATOMIC_FLAG_INIT;   // held by whoever renders the units
+      std::atomic<uint64_t> mFrameTime;                  // frames rendered so far
+      Scheduler mScheduler;                              // events run between blocks
+      Transport mTransport;                              // tempo clock, changed between blocks
+      std::atomic<bool> mJackSync;                       // the clock follows the Jack transport
+      Sequencer mSequencer;                              // plays mSeqTracks, render side
+      sample_t mLastSample;                              // last sample sent to the output port
+
+      void render(sample_t *buf, jack_nframes_t nframes);
+      void resizeRingbuffer(jack_nframes_t period);
+      void followJack(uint64_t now);
+      void post(EventFn fn, double value = 0);
+
    public:
+      JackEngine(RenderMode mode = RENDER_AHEAD, unsigned threads = 1,
+                 const std::vector<int> &cpus = std::vector<int>());
+      ~JackEngine();
+
       jack_port_t *input_port;
       jack_port_t *output_port;
       jack_client_t *client;
       jack_ringbuffer_t *ringbuffer;
 
       jack_nframes_t sampleRate;
+      XrunStats xruns;
 
       void init();
       void shutdown();
 
-      size_t addSynth(std::unique_ptr<UnitLoader> &&synth);
+      void setRenderMode(RenderMode mode);
+      RenderMode getRenderMode();
+
+      size_t addSynth(std::unique_ptr<UnitLoader> &&synth, std::string nodeName = "");
       void delNthSynth(size_t n);
       void replaceNthSynth(size_t n, std::unique_ptr<UnitLoader> &&synth);
       void swapSynths(size_t n1, size_t n2);
@@ -151,8 +282,41 @@ class JackEngine
       std::unique_ptr<UnitLoader>& nthSynth(size_t n);
       size_t getSynthCount();
 
+      void connect(const std::vector<std::string> &chain);
+      void disconnect(std::string from, std::string to);
+      void modulate(const ModulationSpec &m);
+      void unmodulate(std::string to, std::string control);
+      std::vector<std::string> getOutputs(std::string nodeName);
+      void getGraphInfo(size_t &nodes, size_t &buffers, size_t &bytes);
+      bool getNodeIdle(size_t n, uint64_t &skipped);
+
+      uint64_t getFrameTime() { return mFrameTime.load(std::memory_order_relaxed); }
+      void scheduleCtl(uint64_t time, size_t n, std::string control, double value);
+      uint64_t scheduleCtlAtBeat(double beat, size_t n, std::string control, double value);
+      uint64_t launchCtl(size_t n, std::string control, double value, unsigned bars = 1);
+      bool schedule(uint64_t time, EventFn fn, void *target = NULL, ctlHandle_t control = 0, double value = 0,
+                    uint64_t serial = 0, double beat = 0)
+      {
+         return mScheduler.schedule(time, fn, target, control, value, serial, beat);
+      }
+
+      TransportState getTransport() { return mTransport.state(); }
+      void transportStart();
+      void transportStop();
+      void transportLocate(double beat);
+      void setTempo(double bpm);
+      void setMeter(unsigned beatsPerBar);
+      void setJackSync(bool on);
+      bool getJackSync() { return mJackSync; }
+
+      void setSequence(unsigned track, std::string node, const Pattern &pattern);
+      void setSeqTiming(unsigned track, double stepBeats, double swing);
+      void clearSequence(unsigned track);
+      std::vector<SequenceSpec> getSequences();
+
       friend int jack_process_cb(jack_nframes_t nframes, void *arg);
       friend int jack_buffsize_cb(jack_nframes_t nframes, void *arg);
+      friend int jack_xrun_cb(void *arg);
       friend void jack_shutdown_cb(void *arg);
       friend void* jack_thread_func(void *arg);
 };
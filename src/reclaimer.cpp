@@ -0,0 +1,101 @@
+#include <time.h>
+
+#include "reclaimer.h"
+
+// How often the reclamation thread looks at the render code while it has work.
+static const long reclaimPollNs = 2000000;
+
+//=================================================================================
+// < Reclaimer >
+// Constructor. Starts the reclamation thread.
+Reclaimer::Reclaimer()
+{
+   mReader = readerIdle;
+   mStop = false;
+
+   pthread_mutex_init(&mMtx, NULL);
+   pthread_cond_init(&mCond, NULL);
+   pthread_create(&mThread, NULL, threadFunc, this);
+}
+
+//=================================================================================
+// < Reclaimer >
+// Destructor. The render code must be stopped by now, so whatever is still
+// queued is destroyed right away.
+Reclaimer::~Reclaimer()
+{
+   pthread_mutex_lock(&mMtx);
+   mStop = true;
+   pthread_cond_signal(&mCond);
+   pthread_mutex_unlock(&mMtx);
+
+   pthread_join(mThread, NULL);
+   mRetired.clear();
+
+   pthread_cond_destroy(&mCond);
+   pthread_mutex_destroy(&mMtx);
+}
+
+//=================================================================================
+// < Reclaimer >
+// Whether the render code has moved on to generation or newer.
+bool Reclaimer::passed(uint64_t generation)
+{
+   uint64_t g = mReader.load();
+   return g == readerIdle || (g != readerPending && g >= generation);
+}
+
+//=================================================================================
+// < Reclaimer >
+// Queue an object for destruction.
+void Reclaimer::retire(uint64_t generation, std::shared_ptr<void> object)
+{
+   pthread_mutex_lock(&mMtx);
+   mRetired.push_back(Retired { generation, std::move(object) });
+   pthread_cond_signal(&mCond);
+   pthread_mutex_unlock(&mMtx);
+}
+
+//=================================================================================
+// < Reclaimer >
+// Thread function: destroy the retired objects the render code is done with.
+void* Reclaimer::threadFunc(void *arg)
+{
+   Reclaimer *r = (Reclaimer*) arg;
+
+   pthread_mutex_lock(&r->mMtx);
+   while (!r->mStop)
+   {
+      if (r->mRetired.empty())
+      {
+         pthread_cond_wait(&r->mCond, &r->mMtx);
+         continue;
+      }
+
+      // Objects are retired in generation order, so only the front matters.
+      if (!r->passed(r->mRetired.front().generation))
+      {
+         struct timespec ts;
+         clock_gettime(CLOCK_REALTIME, &ts);
+         ts.tv_nsec += reclaimPollNs;
+         if (ts.tv_nsec >= 1000000000)
+         {
+            ts.tv_sec ++;
+            ts.tv_nsec -= 1000000000;
+         }
+         pthread_cond_timedwait(&r->mCond, &r->mMtx, &ts);
+         continue;
+      }
+
+      // Run the destructor (and dlclose) outside the lock.
+      std::shared_ptr<void> object = std::move(r->mRetired.front().object);
+      r->mRetired.pop_front();
+
+      pthread_mutex_unlock(&r->mMtx);
+      object.reset();
+      pthread_mutex_lock(&r->mMtx);
+   }
+   pthread_mutex_unlock(&r->mMtx);
+
+   return NULL;
+}
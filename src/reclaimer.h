@@ -0,0 +1,60 @@
+#ifndef _RECLAIMER_H_
+#define _RECLAIMER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <atomic>
+#include <deque>
+#include <memory>
+
+/* Destroys objects retired from the render code in a background thread.
+ *
+ * Whatever the render code can see is published under a generation number.
+ * The render code brackets its use of a published object with enter() and
+ * leave(); an object retired at generation g is destroyed only once the
+ * render code is idle or reads generation g or newer. */
+class Reclaimer
+{
+   private:
+      struct Retired
+      {
+         uint64_t generation;
+         std::shared_ptr<void> object;
+      };
+
+      static const uint64_t readerIdle = 0;
+      static const uint64_t readerPending = UINT64_MAX;
+
+      std::atomic<uint64_t> mReader;      // generation in use by the render code
+      std::deque<Retired> mRetired;       // waiting for the render code to move on
+      bool mStop;
+
+      pthread_t mThread;
+      pthread_mutex_t mMtx;
+      pthread_cond_t mCond;
+
+      bool passed(uint64_t generation);
+      static void* threadFunc(void *arg);
+
+   public:
+      Reclaimer();
+      ~Reclaimer();
+
+      // Render side: load a published object and pin its generation.
+      template <class T> T* enter(const std::atomic<T*> &published)
+      {
+         mReader = readerPending;
+         T *p = published.load();
+         mReader = p->generation;
+         return p;
+      }
+
+      // Render side: done with whatever enter() returned.
+      void leave() { mReader.store(readerIdle, std::memory_order_release); }
+
+      // Editing side: destroy the object once the render code reads generation or newer.
+      void retire(uint64_t generation, std::shared_ptr<void> object);
+};
+
+#endif
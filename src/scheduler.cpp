@@ -0,0 +1,142 @@
+#include <algorithm>
+
+#include "scheduler.h"
+
+// The free list head packs a slot index with a counter bumped on every change,
+// so that a pop racing with a pop and a push of the same slot fails its CAS.
+static inline uint64_t packHead(uint32_t slot, uint64_t tag) { return (tag << 32) | slot; }
+static inline uint32_t headSlot(uint64_t head) { return (uint32_t) head; }
+static inline uint64_t headTag(uint64_t head) { return head >> 32; }
+
+// Heap order of the pool slots: the earliest event on top, first come first.
+struct EventLater
+{
+   const Event *pool;
+
+   bool operator()(uint32_t a, uint32_t b) const
+   {
+      return pool[a].time > pool[b].time
+         || (pool[a].time == pool[b].time && pool[a].sequence > pool[b].sequence);
+   }
+};
+
+const uint32_t Scheduler::none;
+
+//=================================================================================
+// < Scheduler >
+// Constructor. Makes the event pool; nothing is allocated after this.
+Scheduler::Scheduler(uint32_t capacity)
+   : mPool(new Event[capacity]), mLinks(new std::atomic<uint32_t>[capacity]), mCapacity(capacity)
+{
+   for (uint32_t i = 0; i < capacity; i ++)
+      mLinks[i].store(i + 1 < capacity ? i + 1 : none, std::memory_order_relaxed);
+
+   mFree = packHead(capacity > 0 ? 0 : none, 0);
+   mInbox = none;
+   mSequence = 0;
+   mDropped = 0;
+   mHeap.reserve(capacity);
+}
+
+//=================================================================================
+// < Scheduler >
+// Take a slot off the free list, or none.
+uint32_t Scheduler::alloc()
+{
+   uint64_t head = mFree.load(std::memory_order_acquire);
+
+   while (headSlot(head) != none)
+   {
+      uint32_t next = mLinks[headSlot(head)].load(std::memory_order_relaxed);
+      if (mFree.compare_exchange_weak(head, packHead(next, headTag(head) + 1),
+                                      std::memory_order_acquire, std::memory_order_acquire))
+         return headSlot(head);
+   }
+
+   return none;
+}
+
+//=================================================================================
+// < Scheduler >
+// Render side: put a slot back on the free list.
+void Scheduler::release(uint32_t slot)
+{
+   uint64_t head = mFree.load(std::memory_order_relaxed);
+   do
+      mLinks[slot].store(headSlot(head), std::memory_order_relaxed);
+   while (!mFree.compare_exchange_weak(head, packHead(slot, headTag(head) + 1),
+                                       std::memory_order_release, std::memory_order_relaxed));
+}
+
+//=================================================================================
+// < Scheduler >
+// Queue an event from any thread.
+bool Scheduler::schedule(uint64_t time, EventFn fn, void *target, ctlHandle_t control, double value,
+                         uint64_t serial, double beat)
+{
+   uint32_t slot = alloc();
+   if (slot == none)
+   {
+      mDropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+   }
+
+   uint64_t sequence = mSequence.fetch_add(1, std::memory_order_relaxed);
+   mPool[slot] = Event { time, fn, target, control, value, serial, beat, sequence };
+
+   uint32_t head = mInbox.load(std::memory_order_relaxed);
+   do
+      mLinks[slot].store(head, std::memory_order_relaxed);
+   while (!mInbox.compare_exchange_weak(head, slot, std::memory_order_release, std::memory_order_relaxed));
+
+   return true;
+}
+
+//=================================================================================
+// < Scheduler >
+// Render side: move the inbox into the heap.
+void Scheduler::collect()
+{
+   EventLater later { mPool.get() };
+
+   for (uint32_t slot = mInbox.exchange(none, std::memory_order_acquire); slot != none; )
+   {
+      uint32_t next = mLinks[slot].load(std::memory_order_relaxed);
+      mHeap.push_back(slot);
+      std::push_heap(mHeap.begin(), mHeap.end(), later);
+      slot = next;
+   }
+}
+
+//=================================================================================
+// < Scheduler >
+// Render side: run the due events and return the frames to the next one.
+// Events scheduled by the events themselves run on the next call; they are
+// taken in before returning so that the block stops short of them.
+jack_nframes_t Scheduler::dispatch(uint64_t now, jack_nframes_t len, void *context)
+{
+   const Event *pool = mPool.get();
+   EventLater later { pool };
+
+   collect();
+
+   while (!mHeap.empty() && pool[mHeap.front()].time <= now)
+   {
+      uint32_t slot = mHeap.front();
+      std::pop_heap(mHeap.begin(), mHeap.end(), later);
+      mHeap.pop_back();
+
+      // Free the slot first: fn may schedule again.
+      Event e = pool[slot];
+      e.time = now;
+      release(slot);
+      if (e.fn != NULL)
+         e.fn(e, context);
+   }
+   collect();
+
+   if (!mHeap.empty())
+      len = (jack_nframes_t) std::min((uint64_t) len, pool[mHeap.front()].time - now);
+
+   return len;
+}
@@ -0,0 +1,77 @@
+#ifndef _SCHEDULER_H_
+#define _SCHEDULER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "audiounit.h"
+
+struct Event;
+
+// Runs on the render thread between blocks. context is what the render code
+// passed to dispatch(), such as the graph being rendered.
+typedef void (*EventFn)(const Event &event, void *context);
+
+// Something to do at a sample time. fn sees the time it runs at, later than
+// asked if the event came late. Apart from fn the fields are the caller's.
+struct Event
+{
+   uint64_t time;
+   EventFn fn;
+   void *target;
+   ctlHandle_t control;
+   double value;
+   uint64_t serial;        // tells target from an object made later at its address
+   double beat;            // for an event due on a beat of the transport, that beat
+   uint64_t sequence;      // keeps the order of events due on the same sample
+};
+
+/* Events for the render thread, timestamped in samples.
+ *
+ * Any thread may schedule without locking or allocating: events live in a pool
+ * made up front, taken from a lock-free free list and pushed onto a lock-free
+ * inbox; schedule() fails when the pool runs dry. The render thread moves the
+ * inbox into a heap ordered by time, runs what is due and ends its block where
+ * the next event falls, so every event runs on its exact sample. */
+class Scheduler
+{
+   private:
+      static const uint32_t none = UINT32_MAX;
+
+      std::unique_ptr<Event[]> mPool;
+      std::unique_ptr<std::atomic<uint32_t>[]> mLinks;   // free list and inbox links
+      uint32_t mCapacity;
+
+      std::atomic<uint64_t> mFree;          // free list head: index and ABA tag
+      std::atomic<uint32_t> mInbox;         // scheduled, not seen by the render thread yet
+      std::atomic<uint64_t> mSequence;
+      std::atomic<uint64_t> mDropped;
+
+      std::vector<uint32_t> mHeap;          // render side, earliest on top
+
+      uint32_t alloc();
+      void release(uint32_t slot);
+      void collect();
+
+   public:
+      Scheduler(uint32_t capacity = 4096);
+
+      // Any thread. An event due before the render thread gets to it runs at
+      // the start of its next block. Returns false when the pool is exhausted.
+      bool schedule(uint64_t time, EventFn fn, void *target = NULL,
+                    ctlHandle_t control = 0, double value = 0, uint64_t serial = 0,
+                    double beat = 0);
+
+      // Render side: run the events due at now and return how much of len
+      // frames can render before the next one is due. Events the events
+      // schedule run on the next call, but the block still ends where they do.
+      jack_nframes_t dispatch(uint64_t now, jack_nframes_t len, void *context);
+
+      uint32_t capacity() { return mCapacity; }
+      uint64_t dropped() { return mDropped.load(std::memory_order_relaxed); }
+};
+
+#endif
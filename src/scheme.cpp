@@ -1,14 +1,23 @@
 #include <iostream>
+#include <algorithm>
+#include <atomic>
 
 #include <stdio.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include "script.h"
 #include "unitlib.h"
+#include "scmlib.h"
 
-#include "s7/s7.h"
-
+/* Plays the function f of scheme.scm, the note of its voice set by the freq and
+ * gate controls (see ScmVoice). Setting reload to anything but 0 reloads the
+ * file. The reload reads the disk and evaluates Scheme, so it runs on a thread
+ * of its own; the render code plays silence rather than wait while it does. */
 class MySynth : public AudioUnit
 {
    private:
@@ -16,14 +25,74 @@ class MySynth : public AudioUnit
       s7_pointer  f;
       std::string filename;
       double      dummyCtl;
+      ScmVoice    mVoice;
+
+      std::atomic_flag mBusy = ATOMIC_FLAG_INIT;      // held by whoever uses s7
+      std::atomic<bool> mReload;
+      bool mStop;
+      sem_t mWake;
+      pthread_t mLoader;
+
+      static void* loaderFunc(void *arg)
+      {
+         MySynth *self = (MySynth*) arg;
+
+         while (true)
+         {
+            sem_wait(&self->mWake);
+            if (self->mStop)
+               break;
+            if (!self->mReload.exchange(false))
+               continue;
+
+            while (self->mBusy.test_and_set(std::memory_order_acquire))
+               usleep(100);
+            self->loadFile("scheme.scm");
+            self->mBusy.clear(std::memory_order_release);
+         }
+
+         return NULL;
+      }
 
    public:
       MySynth()
       {
          s7 = s7_init();
+         scmDefineUnitlib(s7);
+         mVoice.define(s7);
          loadFile("scheme.scm");
 
+         dummyCtl = 0;
          addCtl("reload", &dummyCtl);
+         addCtl("freq", &mVoice.freq);
+         addCtl("gate", &mVoice.gate);
+
+         mReload = false;
+         mStop = false;
+         sem_init(&mWake, 0, 0);
+         pthread_create(&mLoader, NULL, loaderFunc, this);
+      }
+
+      ~MySynth()
+      {
+         mStop = true;
+         sem_post(&mWake);
+         pthread_join(mLoader, NULL);
+         sem_destroy(&mWake);
+      }
+
+      int process(jack_nframes_t nframes, sample_t *out, uint64_t t)
+      {
+         if (mBusy.test_and_set(std::memory_order_acquire))
+         {
+            memset(out, 0, nframes * sizeof(sample_t));
+            return 0;
+         }
+
+         mVoice.bind(s7, t);
+         AudioUnit::process(nframes, out, t);
+         mBusy.clear(std::memory_order_release);
+         return 0;
       }
 
       double operator()(uint64_t sampleNum, double in)
@@ -43,9 +112,15 @@ class MySynth : public AudioUnit
          f = s7_eval_c_string(s7, "f");
       }
 
+      // Render side: hand the reload over to the loader thread.
       void onControlUpdate()
       {
-         loadFile("scheme.scm");
+         if (dummyCtl == 0)
+            return;
+
+         dummyCtl = 0;
+         mReload = true;
+         sem_post(&mWake);
       }
 };
 
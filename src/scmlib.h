@@ -0,0 +1,101 @@
+#ifndef _SCMLIB_H_
+#define _SCMLIB_H_
+
+#include <math.h>
+
+#include <algorithm>
+
+#include "unitlib.h"
+
+#include "s7/s7.h"
+
+/* Built-ins of the Scheme sound files, from the unit library. Both the
+ * engine's interpreter and scheme.so define them, so a file plays the same
+ * loaded either way. */
+
+// (sqr freq t): a band-limited square wave at t seconds.
+static s7_pointer scmSqr(s7_scheme *sc, s7_pointer args)
+{
+   double freq = s7_number_to_real(sc, s7_car(args));
+   double c = freq * s7_number_to_real(sc, s7_cadr(args));
+
+   return s7_make_real(sc, polyBlepPulse(c - floor(c), std::min(fabs(freq) / SampleRate, 0.5), 0.5));
+}
+
+// (noise): white noise in [-1, 1). noise is an object owning a generator, so
+// that each unit draws from its own.
+static s7_pointer scmNoiseApply(s7_scheme *sc, s7_pointer obj, s7_pointer args)
+{
+   sample_t x;
+   ((NoiseRng*) s7_object_value(obj))->fill(&x, 1);
+   return s7_make_real(sc, x);
+}
+
+static void scmNoiseFree(void *value)
+{
+   delete (NoiseRng*) value;
+}
+
+// s7 keeps the object types of all its interpreters in one table: register
+// the noise type once.
+static int scmNoiseType(s7_scheme *sc)
+{
+   static const int type = s7_new_type_x(sc, "noise", NULL, scmNoiseFree, NULL, NULL, scmNoiseApply,
+                                         NULL, NULL, NULL, NULL, NULL);
+   return type;
+}
+
+// A noise object with a generator of its own, seeded as a noise unit is.
+static inline s7_pointer scmMakeNoise(s7_scheme *sc)
+{
+   return s7_make_object(sc, scmNoiseType(sc), new NoiseRng(nextNoiseSeed()));
+}
+
+/* The note a Scheme voice function plays, from the freq and gate controls of
+ * its unit, which is what the sequencer sets. Before each block the unit sets
+ * the Scheme variables freq, gate and note-time: the time in seconds the gate
+ * last went up, or -1 before the first note. */
+class ScmVoice
+{
+   private:
+      double mLastGate;
+      uint64_t mOnTime;
+      bool mPlayed;
+
+   public:
+      double freq;
+      double gate;
+
+      ScmVoice() : mLastGate(0), mOnTime(0), mPlayed(false), freq(440), gate(0) {}
+
+      void define(s7_scheme *sc)
+      {
+         s7_define_variable(sc, "freq", s7_make_real(sc, freq));
+         s7_define_variable(sc, "gate", s7_make_real(sc, gate));
+         s7_define_variable(sc, "note-time", s7_make_real(sc, -1));
+      }
+
+      // Render side, holding the interpreter, for a block from sample time t.
+      // Control changes start blocks, so a gate going up does so at t.
+      void bind(s7_scheme *sc, uint64_t t)
+      {
+         if (gate > 0 && mLastGate <= 0)
+         {
+            mOnTime = t;
+            mPlayed = true;
+         }
+         mLastGate = gate;
+
+         s7_symbol_set_value(sc, s7_make_symbol(sc, "freq"), s7_make_real(sc, freq));
+         s7_symbol_set_value(sc, s7_make_symbol(sc, "gate"), s7_make_real(sc, gate));
+         s7_symbol_set_value(sc, s7_make_symbol(sc, "note-time"), s7_make_real(sc, mPlayed ? T(mOnTime) : -1));
+      }
+};
+
+static inline void scmDefineUnitlib(s7_scheme *sc)
+{
+   s7_define_function(sc, "sqr", scmSqr, 2, 0, false, "(sqr freq t) band-limited square wave");
+   s7_define_variable(sc, "noise", scmMakeNoise(sc));
+}
+
+#endif
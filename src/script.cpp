@@ -10,10 +10,10 @@
 #include "script.h"
 #include "unitlib.h"
 
-class MySynth : public AudioUnit
+class MySynth final : public StaticUnit<MySynth>
 {
    public:
-      MySynth() { this->setup(); }
+      MySynth() {}
       JJ_MODULE_SOURCE
 };
 
@@ -0,0 +1,226 @@
+#include <math.h>
+#include <stdlib.h>
+#include <ctype.h>
+
+#include <algorithm>
+#include <sstream>
+
+#include "exception.h"
+#include "sequencer.h"
+
+//=================================================================================
+// MIDI note number of a note name or number.
+double parseNote(const std::string &name)
+{
+   static const int semitones[] = { 9, 11, 0, 2, 4, 5, 7 };    // A to G
+   const char *s = name.c_str();
+   char *end;
+
+   if (isdigit((unsigned char) s[0]))
+   {
+      double note = strtod(s, &end);
+      if (*end != '\0')
+         throw Exception("bad note: " + name);
+      return note;
+   }
+
+   char letter = toupper((unsigned char) s[0]);
+   if (letter < 'A' || letter > 'G')
+      throw Exception("bad note: " + name);
+
+   int note = semitones[letter - 'A'];
+   for (s ++; *s == '#' || *s == 'b'; s ++)
+      note += *s == '#' ? 1 : -1;
+
+   long octave = strtol(s, &end, 10);
+   if (end == s || *end != '\0')
+      throw Exception("bad note: " + name);
+
+   return note + 12 * (octave + 1);
+}
+
+//=================================================================================
+// Frequency of a MIDI note number.
+double noteToFreq(double note)
+{
+   return 440 * exp2((note - 69) / 12);
+}
+
+//=================================================================================
+// < Pattern >
+// Steps from text.
+Pattern Pattern::parse(const std::string &text)
+{
+   std::istringstream iss(text);
+   std::string token;
+   Pattern p;
+
+   while (iss >> token)
+   {
+      Step step { restNote, 1, 1, 1 };
+
+      if (token != "." && token != "-")
+      {
+         size_t mark = token.find_first_of(":?*");
+         step.note = parseNote(token.substr(0, mark));
+
+         while (mark != std::string::npos)
+         {
+            const char *s = token.c_str() + mark + 1;
+            char *end;
+            double v = strtod(s, &end);
+            if (end == s)
+               throw Exception("bad step: " + token);
+
+            if (token[mark] == ':')
+               step.velocity = v;
+            else if (token[mark] == '?')
+               step.probability = v;
+            else if (v > 0)
+               step.length = v;
+            else
+               throw Exception("bad step: " + token);
+
+            mark = end - token.c_str();
+            if (mark == token.size())
+               break;
+            if (token.find_first_of(":?*", mark) != mark)
+               throw Exception("bad step: " + token);
+         }
+      }
+
+      p.steps.push_back(step);
+   }
+
+   if (p.steps.empty())
+      throw Exception("a pattern needs a step");
+
+   return p;
+}
+
+//=================================================================================
+// < Pattern >
+// Euclidean rhythm, spread as a Bresenham line: step i plays when
+// i * pulses mod steps is under pulses.
+Pattern Pattern::euclid(unsigned pulses, unsigned steps, int rotate, double note)
+{
+   if (steps == 0)
+      throw Exception("a pattern needs a step");
+   if (pulses > steps)
+      pulses = steps;
+
+   unsigned r = ((rotate % (int) steps) + steps) % steps;
+   Pattern p;
+
+   for (unsigned i = 0; i < steps; i ++)
+   {
+      unsigned k = (i + r) % steps;
+      bool pulse = (k * pulses) % steps < pulses;
+      p.steps.push_back(Step { pulse ? note : restNote, 1, 1, 1 });
+   }
+
+   return p;
+}
+
+//=================================================================================
+// < Pattern >
+// Beat of a step of the song. Swing delays the odd steps.
+double Pattern::beatOf(int64_t k) const
+{
+   double beat = k * stepBeats;
+   if (k & 1)
+      beat += (2 * swing - 1) * stepBeats;
+   return beat;
+}
+
+//=================================================================================
+// < Pattern >
+// The beat a note ends on, between the swung steps around its end.
+double Pattern::endOf(int64_t k, double length) const
+{
+   double whole = floor(length);
+   int64_t end = k + (int64_t) whole;
+   return beatOf(end) + (length - whole) * (beatOf(end + 1) - beatOf(end));
+}
+
+//=================================================================================
+// < Sequencer >
+// Constructor. Every track waits for the transport to roll.
+Sequencer::Sequencer()
+{
+   for (unsigned i = 0; i < maxSeqTracks; i ++)
+      mCursors[i] = Cursor { 0, 0, false, 0x9e3779b9u * (i + 1) };
+}
+
+//=================================================================================
+// < Sequencer >
+// Whether a step with the probability plays this time round.
+bool Sequencer::chance(Cursor &c, double probability)
+{
+   if (probability >= 1)
+      return true;
+
+   // xorshift32
+   c.random ^= c.random << 13;
+   c.random ^= c.random >> 17;
+   c.random ^= c.random << 5;
+   return (c.random >> 8) * (1.0 / (1 << 24)) < probability;
+}
+
+//=================================================================================
+// < Sequencer >
+// Render side: queue the steps due in the block.
+void Sequencer::run(const SeqTracks &tracks, const TransportState &state, double rate,
+                    uint64_t now, jack_nframes_t len, Scheduler &scheduler, EventFn fn)
+{
+   uint64_t end = now + len;
+
+   for (size_t i = 0; i < tracks.size() && i < maxSeqTracks; i ++)
+   {
+      const SeqTrack &track = tracks[i];
+      const Pattern &p = track.pattern;
+      Cursor &c = mCursors[i];
+      uint64_t at;
+
+      if (track.unit == NULL || p.steps.empty() || !state.rolling)
+      {
+         c.playing = false;
+         continue;
+      }
+
+      // After a start, a jump of the transport or a change of the grid, go on
+      // from the first step that is still to come. The steps up to c.until
+      // may be queued already: the last block may have ended short of it.
+      uint64_t from = c.playing ? std::max(now, c.until) : now;
+      if (!c.playing || !state.timeOfBeat(p.beatOf(c.step), rate, at) || at < from
+          || (state.timeOfBeat(p.beatOf(c.step - 1), rate, at) && at >= from))
+      {
+         c.step = (int64_t) floor(state.beatAt(from, rate) / p.stepBeats) - 1;
+         while (!state.timeOfBeat(p.beatOf(c.step), rate, at) || at < from)
+            c.step ++;
+         c.playing = true;
+      }
+      c.until = std::max(end, from);
+
+      int64_t count = p.steps.size();
+      for (; state.timeOfBeat(p.beatOf(c.step), rate, at) && at < end; c.step ++)
+      {
+         const Step &s = p.steps[((c.step % count) + count) % count];
+         if (s.note < 0 || !chance(c, s.probability))
+            continue;
+
+         if (track.hasFreq)
+            scheduler.schedule(at, fn, track.unit, track.freq, noteToFreq(s.note), track.serial);
+
+         if (track.hasGate)
+         {
+            uint64_t off;
+            if (!state.timeOfBeat(p.endOf(c.step, s.length), rate, off) || off <= at)
+               off = at + 1;
+
+            scheduler.schedule(at, fn, track.unit, track.gate, s.velocity, track.serial);
+            scheduler.schedule(off, fn, track.unit, track.gate, 0, track.serial);
+         }
+      }
+   }
+}
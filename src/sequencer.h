@@ -0,0 +1,104 @@
+#ifndef _SEQUENCER_H_
+#define _SEQUENCER_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "audiounit.h"
+#include "scheduler.h"
+#include "transport.h"
+
+// Tracks the sequencer plays at once.
+static const unsigned maxSeqTracks = 16;
+
+// The note of a step that plays nothing.
+static const double restNote = -1;
+
+// MIDI note number from a name such as C4, F#3 or Bb2 (C4 is 60), or from a
+// number. Throws for anything else.
+double parseNote(const std::string &name);
+
+// Frequency of a MIDI note number, A4 (69) being 440 Hz.
+double noteToFreq(double note);
+
+// One step of a pattern.
+struct Step
+{
+   double note;            // MIDI note number, or restNote
+   double velocity;        // the value the gate is set to, 0 to 1
+   double probability;     // chance that the step plays, 0 to 1
+   double length;          // how long the gate stays up, in steps
+};
+
+/* A loop of steps laid on the beat grid of the transport. Step k of the song
+ * plays steps[k % steps.size()], so every pattern stays aligned to the bars
+ * whenever it is started or swapped. */
+struct Pattern
+{
+   std::vector<Step> steps;
+   double stepBeats;       // beats per step
+   double swing;           // share of each pair of steps taken by the first: 0.5 is straight
+
+   Pattern() : stepBeats(0.25), swing(0.5) {}
+
+   // Steps from text separated by spaces: "." or "-" for a rest, else a note
+   // followed by optional ":velocity", "?probability" and "*length".
+   static Pattern parse(const std::string &text);
+
+   // pulses spread as evenly as possible over steps, rotated left, all playing note.
+   static Pattern euclid(unsigned pulses, unsigned steps, int rotate = 0, double note = 60);
+
+   // The beat that step k of the song falls on, swing included.
+   double beatOf(int64_t k) const;
+
+   // The beat that a note of length steps from step k ends on, on the same
+   // swung grid: a note of one step ends where the next one starts.
+   double endOf(int64_t k, double length) const;
+};
+
+// A pattern playing the controls of a unit, as published to the render code.
+struct SeqTrack
+{
+   AudioUnit *unit;        // NULL for an unused track
+   uint64_t serial;        // the engine's number of the unit
+   ctlHandle_t freq;       // set to the frequency of the note
+   ctlHandle_t gate;       // set to the velocity, and back to 0 after the length
+   bool hasFreq;
+   bool hasGate;
+   Pattern pattern;
+};
+
+// One entry per track, maxSeqTracks of them.
+typedef std::vector<SeqTrack> SeqTracks;
+
+/* Render side of the pattern sequencer. Once per block it turns the steps of
+ * the tracks that fall in the block into control events on the scheduler, so
+ * they land on their exact sample like any other scheduled event. The tracks
+ * themselves are immutable and swapped as a whole by the editing threads. */
+class Sequencer
+{
+   private:
+      struct Cursor
+      {
+         int64_t step;        // the next step to queue
+         uint64_t until;      // steps before this sample time are queued
+         bool playing;        // step is in line with the transport
+         uint32_t random;     // for the step probabilities
+      };
+
+      Cursor mCursors[maxSeqTracks];
+
+      bool chance(Cursor &c, double probability);
+
+   public:
+      Sequencer();
+
+      // Render side: queue as fn events the steps that fall in len frames from
+      // sample time now.
+      void run(const SeqTracks &tracks, const TransportState &state, double rate,
+               uint64_t now, jack_nframes_t len, Scheduler &scheduler, EventFn fn);
+};
+
+#endif
@@ -1,19 +1,1312 @@
 #include <iostream>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <memory>
+#include <algorithm>
 
+#include <math.h>
+#include <stdio.h>
+
+#include "exception.h"
+#include "graph.h"
+#include "scheduler.h"
+#include "transport.h"
+#include "sequencer.h"
 #include "unitlib.h"
 
 using namespace std;
 
-void test1() { cout << "Hello" << endl; }
-void test2() { cout << "World" << endl; }
+static int failures = 0;
+
+// Report a failed check and carry on with the rest.
+#define CHECK(cond, ...) \
+   do { if (!(cond)) { failures ++; printf("FAIL %s:%d: ", __FILE__, __LINE__); printf(__VA_ARGS__); printf("\n"); } } while (0)
+
+//=================================================================================
+// Events run in time order on their sample, same-time events in the order
+// they came, and the block ends where the next event is due.
+static void logEvent(const Event &e, void *context)
+{
+   vector<uint64_t> *log = (vector<uint64_t>*) context;
+   log->push_back(e.time * 10 + e.control);
+}
+
+static void serialEvent(const Event &e, void *context)
+{
+   *(uint64_t*) context = e.serial;
+}
+
+static void requeueEvent(const Event &e, void *context)
+{
+   ((Scheduler*) context)->schedule(e.time + 10, NULL);
+}
+
+void testScheduler()
+{
+   Scheduler s(4);
+   vector<uint64_t> log;
+
+   CHECK(s.schedule(300, logEvent, NULL, 0), "event refused");
+   CHECK(s.schedule(100, logEvent, NULL, 1), "event refused");
+   CHECK(s.schedule(100, logEvent, NULL, 2), "event refused");
+   CHECK(s.schedule(0, logEvent, NULL, 3), "event refused");
+   CHECK(!s.schedule(0, logEvent) && s.dropped() == 1, "a full pool takes an event");
+
+   jack_nframes_t n = s.dispatch(0, 256, &log);
+   CHECK(n == 100 && log.size() == 1 && log[0] == 3, "first block %u frames, %zu events", n, log.size());
+
+   n = s.dispatch(100, 256, &log);
+   CHECK(n == 200 && log.size() == 3 && log[1] == 1001 && log[2] == 1002,
+         "second block %u frames, %zu events", n, log.size());
+
+   // slots are reused once run
+   CHECK(s.schedule(310, logEvent, NULL, 4), "freed slot not reused");
+   n = s.dispatch(300, 256, &log);
+   CHECK(n == 10 && log.size() == 4 && log[3] == 3000, "third block %u frames", n);
+   n = s.dispatch(310, 256, &log);
+   CHECK(n == 256 && log.size() == 5 && log[4] == 3104, "last block %u frames", n);
+
+   // the serial of the target comes back with the event
+   CHECK(s.schedule(400, serialEvent, NULL, 0, 0, 77), "event refused");
+   uint64_t serial = 0;
+   s.dispatch(400, 256, &serial);
+   CHECK(serial == 77, "event serial %llu", (unsigned long long) serial);
+
+   // an event queued by an event ends the block too
+   CHECK(s.schedule(500, requeueEvent), "event refused");
+   n = s.dispatch(500, 256, &s);
+   CHECK(n == 10, "block of %u frames runs past a requeued event", n);
+   s.dispatch(510, 256, &s);
+
+   // threads scheduling at once while the render side runs them
+   Scheduler shared(64);
+   const size_t threads = 4, each = 20000;
+   atomic<bool> stop(false);
+   vector<thread> producers;
+   for (size_t p = 0; p < threads; p ++)
+      producers.emplace_back([&shared, &stop, p]()
+      {
+         for (size_t i = 0; i < each; i ++)
+            while (!shared.schedule(i, logEvent, NULL, p))
+            {
+               if (stop)
+                  return;
+               this_thread::yield();
+            }
+      });
+
+   vector<uint64_t> ran;
+   ran.reserve(threads * each);
+   auto deadline = chrono::steady_clock::now() + chrono::seconds(20);
+   while (ran.size() < threads * each && chrono::steady_clock::now() < deadline)
+   {
+      size_t before = ran.size();
+      shared.dispatch(each, 1, &ran);
+      if (ran.size() == before)
+         this_thread::yield();
+   }
+   stop = true;
+   for (thread &p : producers)
+      p.join();
+   CHECK(ran.size() == threads * each, "%zu of %zu events ran", ran.size(), threads * each);
+}
+
+//=================================================================================
+// A graph node for the graph tests: half its input, plus a bias control that
+// takes modulation, plus a signal of its own so that the nodes tell apart.
+class GraphNode : public AudioUnit
+{
+   private:
+      CtlInput biasIn;
+
+   public:
+      const unsigned id;
+      double bias;
+
+      GraphNode(unsigned i) : id(i), bias(0) { addCtl("bias", &bias, &biasIn); }
+
+      static double own(unsigned id, uint64_t t) { return (double) ((t + 5 * id) % 16) / 8 - 1; }
+
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+      {
+         for (size_t i = 0; i < n; i ++)
+            out[i] = in[i] * 0.5 + biasIn.at(i) + own(id, t + i);
+      }
+};
+
+// Render blocks of a graph on a pool into out, one block after the other.
+static void renderGraph(ProcessGraph &graph, WorkerPool &pool, vector<sample_t> &out, jack_nframes_t block)
+{
+   for (uint64_t t = 0; t < out.size(); t += block)
+   {
+      graph.prepare(block, t);
+      pool.run(graph);
+      graph.mix(out.data() + t, block);
+   }
+}
+
+// A graph node that logs when and on which thread it runs, and takes its time.
+class LoggedNode : public GraphNode
+{
+   public:
+      atomic<unsigned> &clock;
+      unsigned start, end;
+      thread::id runner;
+      unsigned work;       // microseconds
+
+      LoggedNode(unsigned i, atomic<unsigned> &c, unsigned w = 0)
+         : GraphNode(i), clock(c), start(0), end(0), work(w) {}
+
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+      {
+         start = clock ++;
+         runner = this_thread::get_id();
+         if (work > 0)
+            this_thread::sleep_for(chrono::microseconds(work));
+         GraphNode::processBlock(in, out, n, t);
+         end = clock ++;
+      }
+};
+
+// A cycle through edges or modulations is refused; a node runs only after all
+// of its sources are done; the nodes a worker releases are stolen by the rest.
+void testGraph()
+{
+   atomic<unsigned> clock(0);
+   vector<unique_ptr<LoggedNode>> owned;
+   for (unsigned k = 0; k < 3; k ++)
+      owned.emplace_back(new LoggedNode(k, clock));
+
+   GraphSpec ring;
+   for (unsigned k = 0; k < 3; k ++)
+      ring.units.push_back(owned[k].get());
+   ring.edges = { { 0, 1 }, { 1, 2 } };
+   ring.outputs = { 2 };
+   GraphSpec modRing = ring, self = ring;
+   ring.edges.push_back(make_pair(2, 0));
+   modRing.modulations.push_back(Modulation { 2, 0, owned[0]->ctlHandle("bias"), 1, true });
+   self.edges.push_back(make_pair(1, 1));
+
+   for (const GraphSpec *spec : { &ring, &modRing, &self })
+   {
+      bool thrown = false;
+      try { ProcessGraph g(1, *spec, 1); } catch (Exception &e) { thrown = true; }
+      CHECK(thrown, "a graph with a cycle through %zu edges and %zu modulations is built",
+            spec->edges.size(), spec->modulations.size());
+   }
+
+   // random DAGs on 3 threads: every edge and modulation orders its nodes
+   WorkerPool pool(2, vector<int>());
+   vector<sample_t> out(64);
+   srand(17);
+   for (unsigned trial = 0; trial < 20; trial ++)
+   {
+      size_t n = 2 + rand() % 30;
+      GraphSpec spec;
+      owned.clear();
+      for (size_t k = 0; k < n; k ++)
+      {
+         owned.emplace_back(new LoggedNode(k, clock, rand() % 50));
+         spec.units.push_back(owned.back().get());
+      }
+
+      // nodes are numbered backwards against the edges, so that the order of
+      // the spec is of no help
+      for (size_t v = 1; v < n; v ++)
+         for (size_t u = 0; u < v; u ++)
+            if (rand() % 4 == 0)
+               spec.edges.push_back(make_pair(n - 1 - u, n - 1 - v));
+            else if (rand() % 8 == 0)
+               spec.modulations.push_back(Modulation { n - 1 - u, n - 1 - v,
+                                                       owned[n - 1 - v]->ctlHandle("bias"), 1, false });
+      spec.outputs = { 0 };
+
+      ProcessGraph graph(1, spec, pool.size());
+      renderGraph(graph, pool, out, out.size());
+
+      unsigned late = 0;
+      for (const pair<size_t, size_t> &e : spec.edges)
+         late += owned[e.first]->end > owned[e.second]->start;
+      for (const Modulation &m : spec.modulations)
+         late += owned[m.from]->end > owned[m.to]->start;
+      CHECK(late == 0, "graph of %zu nodes: %u nodes ran before a source", n, late);
+   }
+
+   // one root releasing many: the root's worker keeps them, the others steal
+   owned.clear();
+   GraphSpec fan;
+   for (unsigned k = 0; k < 25; k ++)
+   {
+      owned.emplace_back(new LoggedNode(k, clock, k == 0 ? 0 : 500));
+      fan.units.push_back(owned.back().get());
+      if (k > 0)
+      {
+         fan.edges.push_back(make_pair(0, k));
+         fan.outputs.push_back(k);
+      }
+   }
+
+   ProcessGraph graph(1, fan, pool.size());
+   size_t most = 0;
+   for (unsigned b = 0; b < 10; b ++)
+   {
+      renderGraph(graph, pool, out, out.size());
+      vector<thread::id> runners;
+      for (unsigned k = 1; k < 25; k ++)
+         if (find(runners.begin(), runners.end(), owned[k]->runner) == runners.end())
+            runners.push_back(owned[k]->runner);
+      most = max(most, runners.size());
+   }
+   CHECK(most >= 2, "the nodes released by one worker ran on %zu threads", most);
+}
+
+// Random DAGs with edges and modulations render what the nodes compute one by
+// one, on 1 to 3 threads, however the nodes share buffers; a chain renders in
+// place in a single buffer.
+void testGraphBuffers()
+{
+   const jack_nframes_t block = 64;
+   const size_t frames = 4 * block;
+   srand(13);
+
+   for (unsigned trial = 0; trial < 60; trial ++)
+   {
+      size_t n = 2 + rand() % 40;
+      vector<unique_ptr<GraphNode>> owned;
+      GraphSpec spec;
+
+      // node k in order of creation is node at[k] of the graph
+      vector<size_t> at(n);
+      for (size_t k = 0; k < n; k ++)
+         at[k] = k;
+      random_shuffle(at.begin(), at.end(), [](int m) { return rand() % m; });
+
+      spec.units.resize(n);
+      for (size_t k = 0; k < n; k ++)
+      {
+         owned.emplace_back(new GraphNode(k));
+         spec.units[at[k]] = owned.back().get();
+      }
+
+      // each node directly, in order of creation
+      vector<vector<double>> ref(n, vector<double>(frames, 0));
+      vector<double> expect(frames, 0);
+      for (size_t v = 0; v < n; v ++)
+      {
+         vector<double> in(frames, 0), mod(frames, 0);
+         for (size_t u = 0; u < v; u ++)
+            if (rand() % 4 == 0)
+            {
+               spec.edges.push_back(make_pair(at[u], at[v]));
+               for (size_t i = 0; i < frames; i ++)
+                  in[i] += ref[u][i];
+            }
+
+         if (v > 0 && rand() % 3 == 0)
+         {
+            size_t u = rand() % v;
+            spec.modulations.push_back(Modulation { at[u], at[v], owned[v]->ctlHandle("bias"), 0.25, true });
+            for (size_t i = 0; i < frames; i ++)
+               mod[i] = 0.25 * ref[u][i];
+         }
+
+         for (size_t i = 0; i < frames; i ++)
+            ref[v][i] = in[i] * 0.5 + mod[i] + GraphNode::own(v, i);
 
+         if (v == n - 1 || rand() % 4 == 0)
+         {
+            spec.outputs.push_back(at[v]);
+            for (size_t i = 0; i < frames; i ++)
+               expect[i] += ref[v][i];
+         }
+      }
+
+      WorkerPool pool(trial % 3, vector<int>());
+      ProcessGraph graph(1, spec, pool.size());
+      vector<sample_t> out(frames);
+      renderGraph(graph, pool, out, block);
+
+      double err = 0;
+      for (size_t i = 0; i < frames; i ++)
+         err = max(err, fabs(out[i] - expect[i]) / max(1.0, fabs(expect[i])));
+      CHECK(err < 1e-5, "graph of %zu nodes, %zu buffers, on %u threads: error %g",
+            n, graph.bufferCount(), pool.size(), err);
+      CHECK(graph.bufferCount() >= 1 && graph.bufferCount() <= n, "%zu buffers for %zu nodes", graph.bufferCount(), n);
+   }
+
+   // a chain hands its one buffer down
+   vector<unique_ptr<GraphNode>> owned;
+   GraphSpec spec;
+   vector<double> expect(frames, 0);
+   for (size_t k = 0; k < 100; k ++)
+   {
+      owned.emplace_back(new GraphNode(k));
+      spec.units.push_back(owned.back().get());
+      if (k > 0)
+         spec.edges.push_back(make_pair(k - 1, k));
+      for (size_t i = 0; i < frames; i ++)
+         expect[i] = expect[i] * 0.5 + GraphNode::own(k, i);
+   }
+   spec.outputs.push_back(99);
+
+   WorkerPool pool(2, vector<int>());
+   ProcessGraph chain(1, spec, pool.size());
+   vector<sample_t> out(frames);
+   renderGraph(chain, pool, out, block);
+
+   double err = 0;
+   for (size_t i = 0; i < frames; i ++)
+      err = max(err, fabs(out[i] - expect[i]));
+   CHECK(chain.bufferCount() == 1, "a chain of 100 nodes takes %zu buffers", chain.bufferCount());
+   CHECK(err < 1e-5, "chain of 100 nodes: error %g", err);
+}
+
+// A source playing its level control, silent at 0.
+class Level : public AudioUnit
+{
+   public:
+      double level;
+
+      Level() : level(0) { addCtl("level", &level); }
+
+      bool isSilent() { return level == 0; }
+      double operator()(uint64_t t, double in) { return level; }
+};
+
+// A silent node is skipped; a delay behind it is held awake for its tail and
+// then skipped; a control change or a sounding input wakes a node.
+void testGraphSleep()
+{
+   const jack_nframes_t block = 64;
+   Level source;
+   Delay echo(0.01, 0, 1);
+   echo.setup();
+
+   GraphSpec spec;
+   spec.units = { &source, &echo };
+   spec.edges = { { 0, 1 } };
+   spec.outputs = { 1 };
+   WorkerPool pool(0, vector<int>());
+   ProcessGraph graph(1, spec, pool.size());
+
+   vector<sample_t> out(block);
+   uint64_t t = 0;
+   auto step = [&]()
+   {
+      graph.prepare(block, t);
+      pool.run(graph);
+      graph.mix(out.data(), block);
+      t += block;
+
+      double peak = 0;
+      for (sample_t x : out)
+         peak = max(peak, (double) fabs(x));
+      return peak;
+   };
+
+   // blocks the delay runs on once its input is quiet
+   const uint64_t held = (echo.tailFrames() + block - 1) / block;
+
+   double peak = 0;
+   for (unsigned b = 0; b < 20; b ++)
+      peak = max(peak, step());
+   CHECK(graph.isAsleep(0) && graph.skippedBlocks(0) == 20, "silent source ran %llu of 20 blocks",
+         (unsigned long long) (20 - graph.skippedBlocks(0)));
+   CHECK(graph.isAsleep(1) && graph.skippedBlocks(1) == 20 - held, "delay skipped %llu of 20 blocks, tail of %llu",
+         (unsigned long long) graph.skippedBlocks(1), (unsigned long long) held);
+   CHECK(peak == 0, "sleeping graph played %f", peak);
+
+   // a control change wakes the delay for its block, the source sleeps on
+   echo.setCtl(echo.ctlHandle("mix"), 1, t + 10);
+   step();
+   CHECK(!graph.isAsleep(1) && graph.isAsleep(0), "a control change does not wake the delay alone");
+   step();
+   CHECK(graph.isAsleep(1), "the delay stays awake after its control change");
+
+   // the source wakes on its level, and wakes the delay with it
+   source.setCtl(source.ctlHandle("level"), 1, t);
+   step();
+   CHECK(!graph.isAsleep(0) && !graph.isAsleep(1), "a sounding source does not wake the graph");
+   for (unsigned b = 0; b < 10; b ++)
+      peak = step();
+   CHECK(fabs(peak - 1) < 1e-3, "echo of the source at %f", peak);
+
+   // the echo of the source rings for the tail, then the delay sleeps
+   source.setCtl(source.ctlHandle("level"), 0, t);
+   step();
+   unsigned awake = 0;
+   double heard = 0;
+   for (unsigned b = 0; b < held + 5; b ++)
+   {
+      double p = step();
+      CHECK(graph.isAsleep(0), "the source is awake at 0");
+      if (!graph.isAsleep(1))
+      {
+         awake ++;
+         heard = max(heard, p);
+      }
+      else
+         CHECK(p == 0, "sleeping delay played %f", p);
+   }
+   CHECK(awake == held, "the delay ran %u blocks of its %llu block tail", awake, (unsigned long long) held);
+   CHECK(heard > 0.5, "the tail of the delay played %f", heard);
+}
+
+//=================================================================================
+// onControlUpdate() runs once a block for a glide and once for a batch of
+// values, which land together.
+class CtlCounter : public AudioUnit
+{
+   public:
+      double a, b;
+      unsigned updates, torn;
+
+      CtlCounter() : a(0), b(0), updates(0), torn(0)
+      {
+         addCtl("a", &a);
+         addCtl("b", &b);
+      }
+
+      void onControlUpdate()
+      {
+         updates ++;
+         if (a != b)
+            torn ++;
+      }
+};
+
+void testCtlUpdates()
+{
+   CtlCounter u;
+   vector<sample_t> buf(256);
+
+   u.setCtl(u.ctlHandle("a"), 1, 0, 4096);
+   u.setCtl(u.ctlHandle("b"), 1, 0, 4096);
+   for (uint64_t t = 0; t < 4096; t += 256)
+      u.render(256, buf.data(), t);
+   CHECK(u.updates == 4096 / 256, "%u updates in %d blocks of a glide", u.updates, 4096 / 256);
+
+   u.updates = u.torn = 0;
+   atomic<bool> stop(false);
+   thread producer([&u, &stop]()
+   {
+      for (int i = 2; !stop; i ++)
+      {
+         CtlValue values[] = { { u.ctlHandle("a"), (double) i }, { u.ctlHandle("b"), (double) i } };
+         try
+         {
+            u.setCtls(values, 2);
+         }
+         catch (Exception &e)
+         {
+            this_thread::yield();
+         }
+      }
+   });
+   for (uint64_t t = 4096; t < 4096 + 256 * 20000; t += 256)
+      u.render(256, buf.data(), t);
+   stop = true;
+   producer.join();
+   CHECK(u.updates > 0 && u.torn == 0, "%u of %u batches split", u.torn, u.updates);
+}
+
+//=================================================================================
+// The phase of a 440.3 Hz oscillator after 24 hours and 12345 samples of block
+// rendering, against the phase worked out exactly in integers. Neither the
+// time nor the phase is a whole number of cycles there.
+void testOscDrift()
+{
+   // 4403 t / (10 SampleRate) cycles, the fraction taken in integers
+   const double freq = 440.3;
+   const uint64_t end = 24 * 3600 * SampleRate + 12345;
+   const uint64_t cycle = 10 * SampleRate;
+   const double expect = (double) ((4403 * end) % cycle) / cycle;
+   const size_t block = 4096;
+
+   SawOsc saw(freq);
+   vector<sample_t> buf(block);
+   for (uint64_t t = 0; t < end; t += block)
+      saw.process(min((uint64_t) block, end - t), buf.data(), t);
+
+   double got = saw(end) / 2;
+   if (got < 0)
+      got += 1;
+
+   double drift = fabs(got - expect);
+   drift = min(drift, 1 - drift);
+   printf("saw after %lu samples: %.12f cycles, expected %.12f\n", (unsigned long) end, got, expect);
+   CHECK(drift < 1e-6, "saw drifted %g cycles in 24 hours", drift);
+
+   // The per sample API lands on the same phase jumping straight there.
+   SinOsc sine(freq);
+   sine(0);
+   double s = sine(end);
+   double e = sin(2 * M_PI * expect);
+   CHECK(fabs(s - e) < 1e-6, "sin after 24 hours: %f, expected %f", s, e);
+}
+
+//=================================================================================
+// Frequency changes between and within blocks keep the waveform continuous.
+void testOscFreqChange()
+{
+   const size_t block = 64;
+   SinOsc sine(100.0);
+   sample_t buf[block];
+   double prev = 0, maxStep = 0;
+
+   for (uint64_t t = 0; t < 100 * block; t += block)
+   {
+      sine.freq = (t / block) % 2 ? 1000 : 100;
+      sine.process(block, buf, t);
+      for (size_t i = 0; i < block; i ++)
+      {
+         maxStep = max(maxStep, fabs(buf[i] - prev));
+         prev = buf[i];
+      }
+   }
+
+   // a 1000 Hz sine moves at most 2 pi 1000 / SampleRate per sample
+   double limit = 2 * M_PI * 1000 / SampleRate * 1.01;
+   CHECK(maxStep <= limit, "sin jumped by %f, limit %f", maxStep, limit);
+}
+
+//=================================================================================
+// The block sine kernel against libm over several cycles and in radians.
+void testBlockSin()
+{
+   const size_t n = 1 << 16;
+   vector<sample_t> x(n), y(n);
+   double errCycles = 0, errSin = 0, errCos = 0;
+
+   for (size_t i = 0; i < n; i ++)
+      x[i] = -4 + 8.0 * i / n;
+   blockSinCycles(x.data(), y.data(), n);
+   for (size_t i = 0; i < n; i ++)
+      errCycles = max(errCycles, fabs(y[i] - sin(2 * M_PI * x[i])));
+
+   for (size_t i = 0; i < n; i ++)
+      x[i] = -M_PI + 2 * M_PI * i / n;
+   blockSin(x.data(), y.data(), n);
+   for (size_t i = 0; i < n; i ++)
+      errSin = max(errSin, fabs(y[i] - sin((double) x[i])));
+   blockCos(x.data(), y.data(), n);
+   for (size_t i = 0; i < n; i ++)
+      errCos = max(errCos, fabs(y[i] - cos((double) x[i])));
+
+   CHECK(errCycles < 2e-7, "blockSinCycles error %g", errCycles);
+   CHECK(errSin < 3e-7, "blockSin error %g", errSin);
+   CHECK(errCos < 3e-7, "blockCos error %g", errCos);
+}
+
+//=================================================================================
+// Wavetable levels stay below Nyquist without dropping the top octave, and
+// hold the waveform.
+void testWavetable()
+{
+   const Wavetable &sqr = Wavetable::square();
+
+   for (double f = 20; f < SampleRate / 2; f *= 1.1)
+   {
+      size_t k = sqr.levelFor(f / SampleRate * 18446744073709551616.0);
+      double top = ((Wavetable::size / 2) >> k) * f;
+      CHECK(top <= SampleRate / 2 || k == Wavetable::levels - 1,
+            "level %lu at %.0f Hz reaches %.0f Hz", (unsigned long) k, f, top);
+      // and the level keeps the octave below Nyquist
+      CHECK(top >= SampleRate / 4 || k == 0,
+            "level %lu at %.0f Hz stops at %.0f Hz", (unsigned long) k, f, top);
+   }
+
+   // away from the edges the band-limited square is close to +-1
+   double plateau = sqr.level(0)[Wavetable::size / 4];
+   CHECK(fabs(plateau - 1) < 1e-2, "square level 0 at 1/4 cycle: %f", plateau);
+
+   // the block read against one voice of the per-sample API
+   WaveOsc osc(Wavetable::triangle(), 1000.0);
+   WaveOsc ref(Wavetable::triangle(), 1000.0);
+   vector<sample_t> buf(1000);
+   osc.process(buf.size(), buf.data(), 0);
+   double err = 0;
+   for (size_t i = 0; i < buf.size(); i ++)
+      err = max(err, fabs(buf[i] - ref(i)));
+   CHECK(err < 1e-5, "WaveOsc block and per sample differ by %g", err);
+}
+
+//=================================================================================
+// Energy of x outside the harmonics of f, relative to all of it, in dB.
+double aliasDb(const vector<sample_t> &x, double f)
+{
+   double total = 0, harmonics = 0;
+   for (sample_t v : x)
+      total += v * v;
+
+   for (int h = 1; h * f < SampleRate / 2; h ++)
+   {
+      double w = 2 * M_PI * h * f / SampleRate, re = 0, im = 0;
+      for (size_t i = 0; i < x.size(); i ++)
+      {
+         re += x[i] * cos(w * i);
+         im += x[i] * sin(w * i);
+      }
+      harmonics += 2 * (re * re + im * im) / x.size();
+   }
+
+   return 10 * log10(max(total - harmonics, 1e-12) / total);
+}
+
+// PolyBLEP oscillators alias far less than the naive waveform, and as little
+// when hard synced.
+void testBlepOsc()
+{
+   const double f = 1234;
+   vector<sample_t> blep(SampleRate), naive(SampleRate);
+
+   SawOsc saw(f);
+   saw.process(blep.size(), blep.data(), 0);
+   for (size_t i = 0; i < naive.size(); i ++)
+   {
+      double u = fmod(f * i / SampleRate + 0.5, 1);
+      naive[i] = 2 * u - 1;
+   }
+
+   double a = aliasDb(blep, f), b = aliasDb(naive, f);
+   printf("saw at %.0f Hz aliasing: PolyBLEP %.1f dB, naive %.1f dB\n", f, a, b);
+   CHECK(a < b - 12, "PolyBLEP saw aliasing %.1f dB, naive %.1f dB", a, b);
+
+   // the per sample API renders the same
+   PulseOsc pulse(f, 0.25), ref(f, 0.25);
+   pulse.process(1000, blep.data(), 0);
+   double err = 0;
+   for (size_t i = 0; i < 1000; i ++)
+      err = max(err, fabs(blep[i] - ref(i)));
+   CHECK(err < 1e-5, "PulseOsc block and per sample differ by %g", err);
+
+   // hard sync to a master of 443 Hz: right after each rising edge of the
+   // master the slave is back at the start of its cycle
+   const double fm = 443;
+   const size_t block = 256;
+   SinOsc master(fm);
+   SawOsc slave(f);
+   vector<sample_t> synced(SampleRate), edges(block);
+   CtlMod mod = { slave.ctlHandle("sync"), edges.data(), 1, true };
+   for (size_t t = 0; t < synced.size(); t += block)
+   {
+      size_t n = min(block, synced.size() - t);
+      master.process(n, edges.data(), t);
+      slave.render(n, synced.data() + t, t, &mod, 1);
+   }
+
+   err = 0;
+   for (int k = 1; k < fm - 1; k ++)
+   {
+      double edge = k * SampleRate / fm;
+      size_t i = (size_t) ceil(edge) + 1;
+      double expect = 2 * fmod((i - edge) * f / SampleRate + 0.5, 1) - 1;
+      err = max(err, fabs(synced[i] - expect));
+   }
+   CHECK(err < 1e-3, "synced saw is off the restarts by %g", err);
+
+   // it has a DC offset, which is no alias
+   double mean = 0;
+   for (sample_t x : synced)
+      mean += x / synced.size();
+   for (sample_t &x : synced)
+      x -= mean;
+   double c = aliasDb(synced, fm);
+   printf("saw synced to %.0f Hz aliasing: %.1f dB\n", fm, c);
+   CHECK(c < a + 6, "synced saw aliasing %.1f dB, free running %.1f dB", c, a);
+}
+
+//=================================================================================
+// RMS of the last half of a filtered sine: the gain at f once settled.
+double sineGain(AudioUnit &filter, double f)
+{
+   const size_t n = SampleRate / 10;
+   vector<sample_t> x(n);
+   for (size_t i = 0; i < n; i ++)
+      x[i] = sin(2 * M_PI * f * i / SampleRate);
+   filter.process(n, x.data(), 0);
+
+   double sum = 0;
+   for (size_t i = n / 2; i < n; i ++)
+      sum += x[i] * x[i];
+   return sqrt(sum / (n - n / 2)) * M_SQRT2;
+}
+
+// Biquad responses, and the lanes of a bank against separate biquads.
+void testBiquad()
+{
+   Biquad lp(LOWPASS, 1000), hp(HIGHPASS, 1000);
+   double pass = sineGain(lp, 100), stop = sineGain(hp, 100);
+   CHECK(fabs(pass - 1) < 0.01, "lowpass at 1/10 of the cutoff: %f", pass);
+   CHECK(stop < 0.012, "highpass at 1/10 of the cutoff: %f", stop);
+
+   Biquad peak(PEAK, 2000, 1, 6);
+   double boost = sineGain(peak, 2000);
+   CHECK(fabs(boost - pow(10, 6 / 20.0)) < 0.01, "6 dB peak: %f", boost);
+
+   const size_t L = BiquadBank<8>::lanes, n = 1000;
+   BiquadBank<8> bank;
+   vector<unique_ptr<Biquad>> ref;
+   vector<sample_t> frames(n * L);
+   for (size_t l = 0; l < L; l ++)
+   {
+      bank.set(l, BANDPASS, 200 * (l + 1), 2);
+      ref.emplace_back(new Biquad(BANDPASS, 200 * (l + 1), 2));
+   }
+   // the first set() is glided to from pass-through; settle before comparing
+   bank.process(frames.data(), filterSmoothFrames);
+
+   for (size_t i = 0; i < frames.size(); i ++)
+      frames[i] = sin(i * 0.01 + i % L);
+   vector<sample_t> x(frames);
+   bank.process(frames.data(), n);
+
+   double err = 0;
+   for (size_t l = 0; l < L; l ++)
+      for (size_t i = 0; i < n; i ++)
+         err = max(err, fabs(frames[i * L + l] - (*ref[l])(i, x[i * L + l])));
+   CHECK(err < 1e-4, "bank lanes differ from Biquad by %g", err);
+}
+
+//=================================================================================
+// The trapezoidal SVF has the response of the RBJ biquad; audio-rate cutoff
+// modulation is followed per sample; the ladder rolls off at 24 dB/octave and
+// self-oscillates.
+void testZdf()
+{
+   for (double f : { 300.0, 1000.0, 5000.0 })
+   {
+      SVF svf(LOWPASS, 1000, 2);
+      Biquad ref(LOWPASS, 1000, 2);
+      double a = sineGain(svf, f), b = sineGain(ref, f);
+      CHECK(fabs(a - b) < 1e-3, "SVF lowpass at %.0f Hz: %f, biquad %f", f, a, b);
+   }
+   SVF peak(PEAK, 2000, 1, 6);
+   double boost = sineGain(peak, 2000);
+   CHECK(fabs(boost - pow(10, 6 / 20.0)) < 0.01, "SVF 6 dB peak: %f", boost);
+
+   const size_t n = 4800;
+   vector<sample_t> lfo(n), x(n), y(n);
+   for (size_t i = 0; i < n; i ++)
+   {
+      lfo[i] = sin(2 * M_PI * 200 * i / SampleRate);
+      x[i] = sin(i * 0.37) + 0.5 * sin(i * 1.3);
+   }
+   SVF mod(BANDPASS, 1000, 4), ref(BANDPASS, 1000, 4);
+   CtlMod cm = { mod.ctlHandle("freq"), lfo.data(), 900, true };
+   y = x;
+   mod.render(n, y.data(), 0, &cm, 1);
+   double err = 0;
+   for (size_t i = 0; i < n; i ++)
+   {
+      ref.freq = 1000 + 900 * lfo[i];
+      err = max(err, fabs(y[i] - ref(i, x[i])));
+   }
+   CHECK(err < 1e-5, "SVF with audio-rate cutoff differs from per sample by %g", err);
+
+   // small signals, where the saturator is linear
+   Ladder pass(1000, 0, 0.01), stop(1000, 0, 0.01);
+   double p = sineGain(pass, 100) / 0.01, s = sineGain(stop, 8000) / 0.01;
+   CHECK(fabs(p - 1 / 1.01 / 1.01) < 1e-3, "ladder at 1/10 of the cutoff: %f", p);
+   CHECK(s < 1e-3, "ladder three octaves above the cutoff: %f", s);
+
+   Ladder osc(1000, 1.1);
+   vector<sample_t> ring(SampleRate);
+   ring[0] = 1;
+   osc.process(ring.size(), ring.data(), 0);
+   double sum = 0, peakLevel = 0;
+   for (size_t i = ring.size() - 4800; i < ring.size(); i ++)
+   {
+      sum += ring[i] * ring[i];
+      peakLevel = max(peakLevel, (double) fabs(ring[i]));
+   }
+   double rms = sqrt(sum / 4800);
+   CHECK(rms > 0.05 && peakLevel < 2, "self-oscillating ladder: rms %f, peak %f", rms, peakLevel);
+}
+
+// Passes its input through.
+struct Through : public AudioUnit
+{
+   double operator()(uint64_t t, double in) { return in; }
+};
+
+// The oversampling filters are flat in the audio band, a wrapped unit runs at
+// the higher rate, and a nonlinear one aliases less.
+void testOversampler()
+{
+   for (unsigned factor : { 2u, 4u })
+   {
+      Oversampler through(unique_ptr<AudioUnit>(new Through), factor);
+      for (double f : { 1000.0, 18000.0 })
+      {
+         double g = sineGain(through, f);
+         CHECK(fabs(g - 1) < 0.01, "%ux oversampling gain at %.0f Hz: %f", factor, f, g);
+      }
+
+      Oversampler sine(unique_ptr<AudioUnit>(new SinOsc(1000.0)), factor);
+      vector<sample_t> y(SampleRate / 10);
+      sine.process(y.size(), y.data(), 0);
+      y.erase(y.begin(), y.begin() + 240);
+      double a = aliasDb(y, 1000);
+      CHECK(a < -60, "%ux oversampled 1 kHz sine: %.1f dB off 1 kHz", factor, a);
+   }
+
+   // The odd harmonics of 7 kHz above Nyquist fold into the audio band; the
+   // ones the 4x filters pass fold above 20 kHz.
+   const double f = 7000;
+   vector<sample_t> x(SampleRate / 2), plain, over;
+   for (size_t i = 0; i < x.size(); i ++)
+      x[i] = sin(2 * M_PI * f * i / SampleRate);
+   plain = over = x;
+
+   Ladder ladder(20000, 0, 4);
+   ladder.process(plain.size(), plain.data(), 0);
+   Oversampler wrapped(unique_ptr<AudioUnit>(new Ladder(20000, 0, 4)), 4);
+   wrapped.process(over.size(), over.data(), 0);
+   plain.erase(plain.begin(), plain.begin() + 2400);     // the onsets
+   over.erase(over.begin(), over.begin() + 2400);
+
+   double a = aliasDb(over, f), b = aliasDb(plain, f);
+   printf("driven ladder at %.0f Hz aliasing: 4x %.1f dB, 1x %.1f dB\n", f, a, b);
+   CHECK(a < b - 20, "4x oversampled ladder aliasing %.1f dB, plain %.1f dB", a, b);
+}
+
+//=================================================================================
+// Envelope segments land on their levels on time, curves follow their closed
+// form, the gate control starts the envelope on its sample, and the block and
+// per sample renders agree.
+void testEnvelope()
+{
+   const size_t n = SampleRate;
+   vector<sample_t> y(n);
+
+   ADSR adsr(0.01, 0.1, 0.5, 0.2);
+   adsr.start();
+   adsr.process(n / 2, y.data(), 0);
+   CHECK(y[479] == 1, "attack ends at %f", y[479]);
+   CHECK(fabs(y[239] - 0.5) < 1e-6, "attack halfway at %f", y[239]);
+   CHECK(y[n / 2 - 1] == 0.5, "sustain at %f", y[n / 2 - 1]);
+   adsr.stop();
+   adsr.process(n / 2, y.data(), n / 2);
+   CHECK(y[9599] == 0 && adsr.isSilent(), "release ends at %f", y[9599]);
+
+   Envelope curve;
+   EnvSegment seg[] = { { 1, 0.1, -4 } };
+   curve.setSegments(seg, 1, Envelope::noSustain);
+   curve.start();
+   curve.process(4800, y.data(), 0);
+   double err = 0;
+   for (size_t i = 0; i < 4800; i ++)
+      err = max(err, fabs(y[i] - (1 - exp(-4.0 * (i + 1) / 4800)) / (1 - exp(-4.0))));
+   CHECK(err < 1e-6, "exponential segment off its curve by %g", err);
+
+   Envelope block("pad"), ref("pad");
+   block.start();
+   ref.start();
+   block.process(n, y.data(), 0);
+   err = 0;
+   for (size_t i = 0; i < n; i ++)
+      err = max(err, fabs(y[i] - ref(i)));
+   CHECK(err < 1e-6, "envelope block and per sample differ by %g", err);
+
+   Envelope gated("organ");
+   gated.setCtl(gated.ctlHandle("gate"), 1, 100);
+   fill(y.begin(), y.end(), 1);
+   gated.render(256, y.data(), 0);
+   CHECK(y[99] == 0 && y[100] > 0, "gate opened at %f, %f", y[99], y[100]);
+
+   bool thrown = false;
+   try { Envelope bad("no such preset"); } catch (Exception &e) { thrown = true; }
+   CHECK(thrown, "an unknown preset is accepted");
+}
+
+//=================================================================================
+// Bars launched on the transport land on the exact sample of the bar, whatever
+// the block sizes, across a start and tempo changes either way. Simulates the
+// render loop of JackEngine offline.
+struct TransportRun
+{
+   Transport *transport;
+   Scheduler *scheduler;
+   vector<uint64_t> launched;
+};
+
+static void transportStart(const Event &e, void *context) { ((TransportRun*) context)->transport->start(e.time); }
+static void transportTempo(const Event &e, void *context) { ((TransportRun*) context)->transport->setTempo(e.value, e.time); }
+
+static void launchEvent(const Event &e, void *context)
+{
+   TransportRun *run = (TransportRun*) context;
+   if (!run->transport->onBeat(e, *run->scheduler, 1024))
+      return;
+   run->launched.push_back(e.time);
+
+   // queue the next bar, as a pattern relaunching itself would
+   double beat = e.beat + run->transport->state().beatsPerBar;
+   run->scheduler->schedule(e.time, launchEvent, NULL, 0, 0, 0, beat);
+}
+
+void testTransport()
+{
+   const double rate = 48000;
+   Transport transport;
+   Scheduler scheduler(16);
+   TransportRun run { &transport, &scheduler, vector<uint64_t>() };
+   transport.setRate(rate);
+
+   // stopped: nothing to launch on
+   uint64_t at;
+   CHECK(!transport.state().nextBar(0, rate, 1, at), "a stopped transport has a next bar");
+
+   // start at 1000, 120 bpm in 4/4: a bar is 96000 samples; 90 bpm from
+   // 500000, 150 bpm from 1000000
+   const double changes[][2] = { { 1000, 120 }, { 500000, 90 }, { 1000000, 150 } };
+   const size_t nChanges = sizeof(changes) / sizeof(changes[0]);
+   scheduler.schedule(1000, transportStart);
+   scheduler.schedule(1001, launchEvent, NULL, 0, 0, 0, 4);
+   for (size_t i = 1; i < nChanges; i ++)
+      scheduler.schedule((uint64_t) changes[i][0], transportTempo, NULL, 0, changes[i][1]);
+
+   srand(7);
+   uint64_t t = 0;
+   while (t < 1500000)
+   {
+      jack_nframes_t len = 1 + rand() % 1024;
+      while (len > 0)
+      {
+         jack_nframes_t n = scheduler.dispatch(t, len, &run);
+         t += n;
+         len -= n;
+      }
+   }
+
+   // the exact bars, walking the tempo changes
+   vector<double> expected;
+   for (int bar = 1; ; bar ++)
+   {
+      double beat = bar * 4.0, from = 0, time = 0;
+      for (size_t i = 0; i < nChanges; i ++)
+      {
+         double to = i + 1 < nChanges ? from + (changes[i + 1][0] - changes[i][0]) * changes[i][1] / (60 * rate) : beat;
+         if (beat <= to)
+         {
+            time = changes[i][0] + (beat - from) * 60 * rate / changes[i][1];
+            break;
+         }
+         from = to;
+      }
+      if (time >= t)
+         break;
+      expected.push_back(time);
+   }
+
+   CHECK(run.launched.size() == expected.size(), "%zu launches for %zu bars",
+         run.launched.size(), expected.size());
+
+   double jitter = 0;
+   for (size_t i = 0; i < run.launched.size() && i < expected.size(); i ++)
+      jitter = max(jitter, fabs((double) run.launched[i] - expected[i]));
+   printf("transport: %zu bars launched, jitter %.2f samples\n", expected.size(), jitter);
+   CHECK(jitter <= 1, "launch jitter %.2f samples", jitter);
+
+   // position and the published state
+   TransportState s = transport.state();
+   CHECK(s.rolling && s.bpm == 150 && s.beatsPerBar == 4, "published state %d %g %u",
+         s.rolling, s.bpm, s.beatsPerBar);
+   double beatAtSpeedUp = (500000 - 1000) / 24000.0 + 500000 / 32000.0;
+   BarBeatTick p = s.position(1000000 + 19200 * 5 / 2, rate);
+   CHECK(p.bar == 9 && p.beat == 2 && p.tick == (unsigned) llround((beatAtSpeedUp + 2.5 - 38) * ticksPerBeat),
+         "position %lld.%u.%u", (long long) p.bar, p.beat, p.tick);
+
+   // following Jack: drift within a sample is left alone, a jump is taken
+   uint64_t anchor = s.anchorTime;
+   transport.follow(true, s.beatAt(t, rate) + 0.5 * 150 / (60 * rate), 150, 4, t);
+   CHECK(transport.state().anchorTime == anchor, "re-anchored on sub-sample drift");
+   transport.follow(true, s.beatAt(t, rate) + 0.9 / ticksPerBeat, 150, 4, t, 1.0 / ticksPerBeat);
+   CHECK(transport.state().anchorTime == anchor, "re-anchored on a beat rounded to ticks");
+   transport.follow(true, s.beatAt(t, rate) + 2.0 / ticksPerBeat, 150, 4, t, 1.0 / ticksPerBeat);
+   CHECK(transport.state().anchorTime == t, "did not follow a jump of two ticks");
+   transport.follow(true, 100, 150, 4, t);
+   CHECK(transport.state().anchorTime == t && transport.state().beatAt(t, rate) == 100,
+         "did not follow a jump");
+   transport.follow(false, 100, 0, 3, t + 10);
+   s = transport.state();
+   CHECK(!s.rolling && s.bpm == 150 && s.beatsPerBar == 3 && s.beatAt(t + 5000, rate) == 100,
+         "did not follow a stop");
+}
+
+//=================================================================================
+// Pattern steps land on their exact sample, swing included, whatever the block
+// sizes; rests and steps that never play stay silent.
+static void logStep(const Event &e, void *context)
+{
+   ((vector<Event>*) context)->push_back(e);
+}
+
+void testSequencer()
+{
+   CHECK(parseNote("C4") == 60 && parseNote("A4") == 69 && parseNote("F#3") == 54
+         && parseNote("Bb2") == 46 && parseNote("61") == 61, "note names");
+   bool thrown = false;
+   try { parseNote("H2"); } catch (Exception &e) { thrown = true; }
+   CHECK(thrown, "a bad note name is accepted");
+
+   Pattern p = Pattern::parse("C4 . E4:0.5?0*2 -");
+   CHECK(p.steps.size() == 4 && p.steps[0].note == 60 && p.steps[1].note == restNote
+         && p.steps[2].velocity == 0.5 && p.steps[2].probability == 0 && p.steps[2].length == 2
+         && p.steps[3].note == restNote, "parsed pattern");
+
+   string rhythm;
+   for (const Step &step : Pattern::euclid(3, 8).steps)
+      rhythm += step.note == restNote ? '.' : 'x';
+   CHECK(rhythm == "x..x..x.", "euclid(3, 8) is %s", rhythm.c_str());
+
+   // 120 bpm: a sixteenth is 6000 samples, the odd ones swung by a third of a step
+   const double rate = 48000;
+   Transport transport;
+   Scheduler scheduler(256);
+   Sequencer sequencer;
+   AudioUnit unit;
+   vector<Event> log;
+
+   transport.setRate(rate);
+   transport.start(0);
+
+   SeqTracks tracks(maxSeqTracks);
+   tracks[3] = SeqTrack { &unit, 0, 0, 1, true, true, Pattern::parse("60 62 . 64 67?0") };
+   tracks[3].pattern.swing = 2.0 / 3;
+
+   srand(11);
+   uint64_t t = 0;
+   while (t < 480000)
+   {
+      jack_nframes_t len = 1 + rand() % 700;
+      while (len > 0)
+      {
+         jack_nframes_t n = scheduler.dispatch(t, len, &log);
+         sequencer.run(tracks, transport.state(), rate, t, n, scheduler, logStep);
+         n = scheduler.dispatch(t, n, &log);
+         t += n;
+         len -= n;
+      }
+   }
+
+   // every note ends before the next starts, on the swung grid too: the
+   // gate goes up and down in turn
+   size_t cut = 0;
+   double gate = 0;
+   for (const Event &e : log)
+      if (e.control == 1)
+      {
+         cut += (e.value != 0) == (gate != 0);
+         gate = e.value;
+      }
+   CHECK(cut == 0, "%zu notes cut short by the end of the note before", cut);
+
+   size_t ons = 0, wrong = 0;
+   for (const Event &e : log)
+   {
+      if (e.control != 1 || e.value == 0)
+         continue;
+
+      int64_t k = llround((e.time - (e.time / 6000 % 2 ? 2000 : 0)) / 6000.0);
+      uint64_t exact = k * 6000 + (k & 1 ? 2000 : 0);
+      int step = k % 5;
+      if (e.time != exact || step == 2 || step == 4)
+         wrong ++;
+      ons ++;
+   }
+
+   // 3 of each 5 steps play
+   size_t due = 0;
+   for (int64_t k = 0; k * 6000 + (k & 1 ? 2000 : 0) < (int64_t) t; k ++)
+      due += k % 5 != 2 && k % 5 != 4;
+   CHECK(ons == due && wrong == 0, "%zu of %zu notes played, %zu off the grid or not due", ons, due, wrong);
+   CHECK(!log.empty() && log[0].control == 0 && fabs(log[0].value - 261.6256) < 1e-3,
+         "first note at %g Hz", log.empty() ? 0 : log[0].value);
+
+   // a jump of the transport picks the pattern up from there
+   log.clear();
+   transport.locate(1.5, t);
+   sequencer.run(tracks, transport.state(), rate, t, 1, scheduler, logStep);
+   scheduler.dispatch(t, 1, &log);
+   CHECK(log.size() == 2 && log[1].time == t && log[1].control == 1 && log[0].value == noteToFreq(62),
+         "%zu events after the jump", log.size());
+}
+
+//=================================================================================
+// Power of the noise around f, through a bandpass an octave wide.
+static double bandPower(Noise &noise, double f, size_t n)
+{
+   Biquad band(BANDPASS, f, 1.41);
+   vector<sample_t> x(n);
+   noise.process(n, x.data(), 0);
+
+   double sum = 0;
+   for (size_t i = 0; i < n; i ++)
+   {
+      double y = band(i, x[i]);
+      if (i >= 4800)
+         sum += y * y;
+   }
+   return sum / (n - 4800);
+}
+
+// Noise repeats with its seed whatever the block sizes, the white noise is
+// uniform, and pink and brown noise fall by 3 and 6 dB an octave.
+void testNoise()
+{
+   const size_t n = 1 << 16;
+   vector<sample_t> a(n), b(n), c(n);
+
+   WhiteNoise w1(42), w2(42), w3(43);
+   w1.process(n, a.data(), 0);
+   for (size_t done = 0, len = 1; done < n; done += len, len = len % 37 + 1)
+      w2.process(min(len, n - done), b.data() + done, done);
+   w3.process(n, c.data(), 0);
+   CHECK(a == b, "white noise depends on the block sizes");
+   CHECK(a != c, "white noise ignores its seed");
+
+   double mean = 0, power = 0, lo = 0, hi = 0;
+   for (sample_t x : a)
+   {
+      mean += x;
+      power += x * x;
+      lo = min(lo, (double) x);
+      hi = max(hi, (double) x);
+   }
+   mean /= n;
+   power /= n;
+   CHECK(fabs(mean) < 0.01 && fabs(power - 1 / 3.0) < 0.01 && lo >= -1 && hi < 1,
+         "white noise mean %f, power %f, range [%f, %f]", mean, power, lo, hi);
+
+   // the seed control starts the stream over
+   w3.setCtl("seed", 42);
+   w3.render(n, c.data(), 0);
+   CHECK(a == c, "reseeded noise differs");
+
+   const size_t m = 10 * 48000;
+   double slope[3];
+   for (int color = WHITE; color <= BROWN; color ++)
+   {
+      Noise low((NoiseColor) color, 7), high((NoiseColor) color, 7);
+      slope[color] = 10 * log10(bandPower(high, 4000, m) / bandPower(low, 500, m)) / 3;
+   }
+   // the bands are measured against the white noise, which is flat
+   double pink = slope[PINK] - slope[WHITE], brown = slope[BROWN] - slope[WHITE];
+   printf("noise: pink %.2f, brown %.2f dB per octave\n", pink, brown);
+   CHECK(fabs(pink + 3) < 0.5 && fabs(brown + 6) < 0.5, "noise slopes %.2f and %.2f dB per octave", pink, brown);
+}
+
+//=================================================================================
+// Reads of the delay line at fractional delays, the echoes of Delay, the peaks
+// and notches of Comb, and the modulated delays staying sane.
+void testDelay()
+{
+   const double f = 1000, w = 2 * M_PI * f / SampleRate;
+   DelayLine line;
+   line.setup(64);
+
+   double errCubic = 0, errAllpass = 0;
+   float state = 0;
+   for (int i = 0; i < 4800; i ++)
+   {
+      line.write(sin(w * i));
+      // read first, then write: the sample just written is at delay 1
+      double cubic = line.readCubic(10.37 + 1), allpass = line.readAllpass(10.37 + 1, state);
+      CHECK(line.read(1) == (float) sin(w * i), "integer read");
+      if (i > 100)
+      {
+         errCubic = max(errCubic, fabs(cubic - sin(w * (i - 10.37))));
+         errAllpass = max(errAllpass, fabs(allpass - sin(w * (i - 10.37))));
+      }
+   }
+   // the allpass is exact in phase only near DC: allow its phase error at 1 kHz
+   CHECK(errCubic < 1e-3 && errAllpass < 0.01, "fractional reads off by %g and %g", errCubic, errAllpass);
+
+   const size_t n = SampleRate;
+   vector<sample_t> x(n, 0);
+   x[0] = 1;
+   Delay delay(0.1, 0.5, 0.25);
+   delay.setup();
+   delay.process(n, x.data(), 0);
+   size_t echo = 0.1 * SampleRate;
+   CHECK(fabs(x[0] - 0.75) < 1e-6 && fabs(x[echo] - 0.25) < 1e-6 && fabs(x[2 * echo] - 0.125) < 1e-6
+         && fabs(x[echo / 2]) < 1e-6, "delay echoes %f %f %f", x[0], x[echo], x[2 * echo]);
+
+   Comb comb(440, 0.7);
+   comb.setup();
+   double peak = sineGain(comb, 440);
+   comb.reset();
+   double notch = sineGain(comb, 660);
+   CHECK(fabs(peak - 1 / 0.3) < 0.1 && fabs(notch - 1 / 1.7) < 0.05, "comb gains %f and %f", peak, notch);
+
+   // a dry chorus passes its input through
+   Chorus chorus(0.8, 0.003, 0);
+   chorus.setup();
+   CHECK(fabs(sineGain(chorus, 300) - 1) < 1e-4, "dry chorus changes its input");
+
+   // the flanger stays bounded with feedback on noise
+   WhiteNoise noise(5);
+   Flanger flanger(0.5, 0.002, 0.9, 1);
+   flanger.setup();
+   noise.process(n, x.data(), 0);
+   flanger.process(n, x.data(), 0);
+   double peakOut = 0;
+   for (sample_t v : x)
+      peakOut = max(peakOut, fabs((double) v));
+   CHECK(peakOut < 20 && isfinite(peakOut), "flanger peaks at %f", peakOut);
+
+   // oversampled, the line is sized at the higher rate: a 1.5 s echo of the
+   // 2 s line is not clamped
+   Oversampler slow(make_unique<Delay>(1.5, 0, 1), 2);
+   slow.setup();
+   x.assign(2 * n, 0);
+   x[0] = 1;
+   slow.process(2 * n, x.data(), 0);
+   size_t loudest = max_element(x.begin(), x.end(), [](sample_t a, sample_t b) { return fabs(a) < fabs(b); })
+                    - x.begin();
+   CHECK(loudest >= 1.5 * SampleRate && loudest < 1.5 * SampleRate + 64, "oversampled echo at %zu", loudest);
+
+   // no rate, no line
+   uint64_t rate = SampleRate;
+   SampleRate = 0;
+   bool thrown = false;
+   try { Delay early; early.setup(); } catch (Exception &e) { thrown = true; }
+   SampleRate = rate;
+   CHECK(thrown, "a delay line is set up without a sample rate");
+}
+
+//=================================================================================
 int main(int argc, char **argv)
 {
-   Scheduler s;
-   s.schedule(1, test2);
-   s.schedule(0, test1);
-   s.run(0);
-   s.run(1);
+   SampleRate = 48000;
+
+   testScheduler();
+   testGraph();
+   testGraphBuffers();
+   testGraphSleep();
+   testCtlUpdates();
+   testTransport();
+   testSequencer();
+   testOscDrift();
+   testOscFreqChange();
+   testBlockSin();
+   testWavetable();
+   testBlepOsc();
+   testBiquad();
+   testZdf();
+   testOversampler();
+   testEnvelope();
+   testNoise();
+   testDelay();
+
+   if (failures > 0)
+      printf("%d checks failed\n", failures);
+   else
+      printf("all checks passed\n");
 
-   return 0;
+   return failures > 0;
 }
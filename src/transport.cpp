@@ -0,0 +1,219 @@
+#include <math.h>
+
+#include <algorithm>
+
+#include "transport.h"
+
+//=================================================================================
+// < TransportState >
+// The beat playing at sample time t.
+double TransportState::beatAt(uint64_t t, double rate) const
+{
+   if (!rolling)
+      return anchorBeat;
+   return anchorBeat + ((double) t - (double) anchorTime) * bpm / (60 * rate);
+}
+
+//=================================================================================
+// < TransportState >
+// Bar, beat and tick at sample time t.
+BarBeatTick TransportState::position(uint64_t t, double rate) const
+{
+   double ticks = floor(beatAt(t, rate) * ticksPerBeat + 0.5);
+   int64_t beats = (int64_t) floor(ticks / ticksPerBeat);
+   int64_t bar = (int64_t) floor((double) beats / beatsPerBar);
+
+   return BarBeatTick { bar, (unsigned) (beats - bar * beatsPerBar),
+                        (unsigned) (ticks - (double) beats * ticksPerBeat) };
+}
+
+//=================================================================================
+// < TransportState >
+// Sample time of a beat, rounded to the nearest sample.
+bool TransportState::timeOfBeat(double beat, double rate, uint64_t &t) const
+{
+   if (!rolling || bpm <= 0)
+      return false;
+
+   double at = (double) anchorTime + (beat - anchorBeat) * 60 * rate / bpm;
+   if (at < 0)
+      return false;
+
+   t = (uint64_t) llround(at);
+   return true;
+}
+
+//=================================================================================
+// < TransportState >
+// The next bar whose number is a multiple of bars.
+double TransportState::barAfter(uint64_t t, double rate, unsigned bars) const
+{
+   if (bars == 0)
+      bars = 1;
+
+   double span = (double) bars * beatsPerBar;
+   return (floor(beatAt(t, rate) / span) + 1) * span;
+}
+
+//=================================================================================
+// < TransportState >
+// Sample time of the next bar whose number is a multiple of bars.
+bool TransportState::nextBar(uint64_t t, double rate, unsigned bars, uint64_t &at) const
+{
+   return timeOfBeat(barAfter(t, rate, bars), rate, at);
+}
+
+//=================================================================================
+// < Transport >
+// Constructor. Stopped at the start of the song, 120 bpm in 4/4.
+Transport::Transport()
+{
+   mState = TransportState { false, 120, 4, 0, 0 };
+   mRate = 48000;
+   mSeq = 0;
+   publish();
+}
+
+//=================================================================================
+// < Transport >
+// Render side: copy mState out for the other threads.
+void Transport::publish()
+{
+   uint32_t seq = mSeq.load(std::memory_order_relaxed);
+   mSeq.store(seq + 1, std::memory_order_relaxed);
+   std::atomic_thread_fence(std::memory_order_release);
+
+   mRolling.store(mState.rolling, std::memory_order_relaxed);
+   mBpm.store(mState.bpm, std::memory_order_relaxed);
+   mBeatsPerBar.store(mState.beatsPerBar, std::memory_order_relaxed);
+   mAnchorTime.store(mState.anchorTime, std::memory_order_relaxed);
+   mAnchorBeat.store(mState.anchorBeat, std::memory_order_relaxed);
+
+   mSeq.store(seq + 2, std::memory_order_release);
+}
+
+//=================================================================================
+// < Transport >
+// Any thread: the state as last published. Retries while it is being written.
+TransportState Transport::state()
+{
+   TransportState s;
+   uint32_t seq;
+
+   do
+   {
+      seq = mSeq.load(std::memory_order_acquire);
+      s.rolling = mRolling.load(std::memory_order_relaxed);
+      s.bpm = mBpm.load(std::memory_order_relaxed);
+      s.beatsPerBar = mBeatsPerBar.load(std::memory_order_relaxed);
+      s.anchorTime = mAnchorTime.load(std::memory_order_relaxed);
+      s.anchorBeat = mAnchorBeat.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+   }
+   while ((seq & 1) || seq != mSeq.load(std::memory_order_relaxed));
+
+   return s;
+}
+
+//=================================================================================
+// < Transport >
+// Render side: start rolling from where the transport stands.
+void Transport::start(uint64_t now)
+{
+   if (mState.rolling)
+      return;
+
+   mState.anchorTime = now;
+   mState.rolling = true;
+   publish();
+}
+
+//=================================================================================
+// < Transport >
+// Render side: stop, keeping the position.
+void Transport::stop(uint64_t now)
+{
+   if (!mState.rolling)
+      return;
+
+   mState.anchorBeat = mState.beatAt(now, mRate);
+   mState.anchorTime = now;
+   mState.rolling = false;
+   publish();
+}
+
+//=================================================================================
+// < Transport >
+// Render side: jump to a beat.
+void Transport::locate(double beat, uint64_t now)
+{
+   mState.anchorBeat = beat;
+   mState.anchorTime = now;
+   publish();
+}
+
+//=================================================================================
+// < Transport >
+// Render side: change the tempo from now on.
+void Transport::setTempo(double bpm, uint64_t now)
+{
+   if (bpm <= 0 || bpm == mState.bpm)
+      return;
+
+   mState.anchorBeat = mState.beatAt(now, mRate);
+   mState.anchorTime = now;
+   mState.bpm = bpm;
+   publish();
+}
+
+//=================================================================================
+// < Transport >
+// Render side: change the beats in a bar.
+void Transport::setMeter(unsigned beatsPerBar)
+{
+   if (beatsPerBar == 0 || beatsPerBar == mState.beatsPerBar)
+      return;
+
+   mState.beatsPerBar = beatsPerBar;
+   publish();
+}
+
+//=================================================================================
+// < Transport >
+// Render side: the Jack transport is at beat at sample time now.
+void Transport::follow(bool rolling, double beat, double bpm, unsigned beatsPerBar, uint64_t now,
+                       double tolerance)
+{
+   if (bpm <= 0)
+      bpm = mState.bpm;
+   if (beatsPerBar == 0)
+      beatsPerBar = mState.beatsPerBar;
+
+   double oneSample = bpm / (60 * mRate);
+   if (rolling == mState.rolling && bpm == mState.bpm && beatsPerBar == mState.beatsPerBar
+       && fabs(mState.beatAt(now, mRate) - beat) <= std::max(tolerance, oneSample))
+      return;
+
+   mState = TransportState { rolling, bpm, beatsPerBar, now, beat };
+   publish();
+}
+
+//=================================================================================
+// < Transport >
+// Render side: whether an event due on a beat is due now, else queue it again.
+bool Transport::onBeat(const Event &e, Scheduler &scheduler, uint64_t lookahead)
+{
+   uint64_t at = e.time + lookahead;
+
+   if (mState.rolling)
+   {
+      uint64_t beatTime;
+      if (!mState.timeOfBeat(e.beat, mRate, beatTime) || beatTime <= e.time)
+         return true;
+      at = std::min(at, beatTime);
+   }
+
+   // The event just gave its slot back, so this only fails if other threads
+   // took the whole pool meanwhile: run it now rather than lose it.
+   return !scheduler.schedule(at, e.fn, e.target, e.control, e.value, e.serial, e.beat);
+}
@@ -0,0 +1,94 @@
+#ifndef _TRANSPORT_H_
+#define _TRANSPORT_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "scheduler.h"
+
+// Ticks of a beat in bar/beat/tick positions, as most sequencers count them.
+static const unsigned ticksPerBeat = 1920;
+
+// A position in bars, beats and ticks, all counted from 0.
+struct BarBeatTick
+{
+   int64_t bar;
+   unsigned beat;
+   unsigned tick;
+};
+
+/* Where the music is: the tempo, and the beat (counted from the start of the
+ * song) that plays at an engine sample time. While rolling the beat moves on
+ * from there at the tempo; while stopped it stays. */
+struct TransportState
+{
+   bool rolling;
+   double bpm;
+   unsigned beatsPerBar;
+   uint64_t anchorTime;       // engine sample time
+   double anchorBeat;         // the beat at anchorTime
+
+   double beatAt(uint64_t t, double rate) const;
+   BarBeatTick position(uint64_t t, double rate) const;
+
+   // The sample time the beat plays at. False while stopped, or for a beat
+   // before sample time 0; whether it has gone by is for the caller to say.
+   bool timeOfBeat(double beat, double rate, uint64_t &t) const;
+
+   // The beat of the first boundary of a multiple of bars after sample time t,
+   // and the sample time it plays at as the tempo stands.
+   double barAfter(uint64_t t, double rate, unsigned bars) const;
+   bool nextBar(uint64_t t, double rate, unsigned bars, uint64_t &at) const;
+};
+
+/* The tempo clock of the engine. Only the render thread changes it, between
+ * blocks: the editing threads post the changes as scheduled events. Any thread
+ * reads a consistent copy through state(). */
+class Transport
+{
+   private:
+      TransportState mState;                  // render side
+
+      // mState as published, under a sequence lock
+      std::atomic<uint32_t> mSeq;
+      std::atomic<bool> mRolling;
+      std::atomic<double> mBpm;
+      std::atomic<unsigned> mBeatsPerBar;
+      std::atomic<uint64_t> mAnchorTime;
+      std::atomic<double> mAnchorBeat;
+
+      double mRate;
+
+      void publish();
+
+   public:
+      Transport();
+
+      void setRate(double rate) { mRate = rate; }
+      double rate() { return mRate; }
+
+      TransportState state();
+
+      // Render side: changes taking effect at sample time now.
+      void start(uint64_t now);
+      void stop(uint64_t now);
+      void locate(double beat, uint64_t now);
+      void setTempo(double bpm, uint64_t now);
+      void setMeter(unsigned beatsPerBar);
+
+      // Render side: take over a state reported by the Jack transport; bpm and
+      // beatsPerBar are 0 when it has none. The clock is moved only when it is
+      // off by more than tolerance beats, or a sample if that is more: the
+      // beat Jack reports is only as fine as its ticks.
+      void follow(bool rolling, double beat, double bpm, unsigned beatsPerBar, uint64_t now,
+                  double tolerance = 0);
+
+      // Render side, for an event due on beat e.beat: whether the beat plays
+      // by e.time. If not, e is queued again for when it now does, but at most
+      // lookahead samples on, as the tempo may change before then; so queue
+      // such an event for now to begin with. While stopped the beat waits.
+      bool onBeat(const Event &e, Scheduler &scheduler, uint64_t lookahead);
+};
+
+#endif
@@ -1,17 +1,29 @@
-/*
- * To Implement:
- * > Saw -- oscillators
- * > Frequency filters
- */
-
 #include <math.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
 
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "exception.h"
 #include "unitlib.h"
 
 uint64_t SampleRate;
 uint64_t N;
 double T;
 
+// Factor of the Oversampler rendering on this thread, 1 outside of one.
+static thread_local unsigned rateFactor = 1;
+
+double unitRate()
+{
+   return (double) SampleRate * rateFactor;
+}
+
 /*=================================================================================*/
 /// general arythmetic functions
 
@@ -22,32 +34,142 @@ inline double signum(double x)
    else return 0;
 }
 
-inline double line(uint64_t t0, uint64_t t1, uint64_t t, double a, double b)
+/*=================================================================================*/
+/// Vector math -- block sine and cosine
+
+// Each loop is compiled for every instruction set listed and the best one the
+// CPU supports is picked when the library loads.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define VECTOR_CLONES __attribute__((target_clones("arch=x86-64-v4", "arch=x86-64-v3", "default")))
+#else
+#define VECTOR_CLONES
+#endif
+
+// sin(2 pi c). The phase is wrapped to [-1/2, 1/2] and folded to [-1/4, 1/4],
+// where an odd minimax polynomial of degree 9 is within 3.4e-9 of the sine.
+// Branch free so that the loops vectorize.
+static inline float sinCycle(float c)
+{
+   // round to nearest without SSE4.1, good for |c| < 2^22
+   const float magic = 12582912.0f;     // 1.5 * 2^23
+   float r = c - ((c + magic) - magic);
+   float y = copysignf(0.25f - fabsf(0.25f - fabsf(r)), r);
+   float y2 = y * y;
+
+   return y * (6.28318516e+0f + y2 * (-4.13416551e+1f + y2 * (8.16010069e+1f
+      + y2 * (-7.65498497e+1f + y2 * 3.95372400e+1f))));
+}
+
+VECTOR_CLONES
+void blockSinCycles(const sample_t *c, sample_t *out, size_t n)
 {
-   return a + (b - a) * ((double)(t - t0)) / (t1 - t0);
+   for (size_t i = 0; i < n; i ++)
+      out[i] = sinCycle(c[i]);
 }
 
-/*=================================================================================*/
-/// Scheduler
+VECTOR_CLONES
+void blockSin(const sample_t *x, sample_t *out, size_t n)
+{
+   for (size_t i = 0; i < n; i ++)
+      out[i] = sinCycle(x[i] * (float) (0.5 / M_PI));
+}
+
+VECTOR_CLONES
+void blockCos(const sample_t *x, sample_t *out, size_t n)
+{
+   for (size_t i = 0; i < n; i ++)
+      out[i] = sinCycle(x[i] * (float) (0.5 / M_PI) + 0.25f);
+}
+
+// Linear interpolation in a table level at a 32-bit phase.
+static inline float tableRead(const float *level, uint32_t phase)
+{
+   const unsigned fracBits = 32 - Wavetable::sizeBits;
+   // signed ints, which the vector gathers and conversions take
+   int i = phase >> fracBits;
+   float frac = (int) (phase & ((1u << fracBits) - 1)) * (1.0f / (1u << fracBits));
+
+   return level[i] + frac * (level[i + 1] - level[i]);
+}
 
-bool SchedulePtrLess::operator() (Schedule *a, Schedule *b)
+static void tableReadScalar(const float *level, const uint32_t *phase, float gain, sample_t *out, size_t n)
 {
-   return a->startTime > b->startTime;
+   for (size_t i = 0; i < n; i ++)
+      out[i] += gain * tableRead(level, phase[i]);
 }
 
-void Scheduler::schedule(double startTime, ScheduleFn fn)
+// GCC does not vectorize the table reads into gathers by itself, so the
+// gathers are written out for the CPUs that have them.
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define TABLE_READ_GATHER
+
+static const unsigned tableFracBits = 32 - Wavetable::sizeBits;
+
+__attribute__((target("avx2,fma")))
+static void tableReadAvx2(const float *level, const uint32_t *phase, float gain, sample_t *out, size_t n)
 {
-   mQueue.push(new Schedule(startTime, fn));
+   const __m256i mask = _mm256_set1_epi32((1 << tableFracBits) - 1);
+   const __m256 scale = _mm256_set1_ps(1.0f / (1 << tableFracBits));
+   const __m256 g = _mm256_set1_ps(gain);
+
+   size_t i = 0;
+   for (; i + 8 <= n; i += 8)
+   {
+      __m256i p = _mm256_loadu_si256((const __m256i *) (phase + i));
+      __m256i idx = _mm256_srli_epi32(p, tableFracBits);
+      __m256 frac = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(p, mask)), scale);
+      __m256 a = _mm256_i32gather_ps(level, idx, 4);
+      __m256 b = _mm256_i32gather_ps(level + 1, idx, 4);
+      __m256 v = _mm256_fmadd_ps(frac, _mm256_sub_ps(b, a), a);
+      _mm256_storeu_ps(out + i, _mm256_fmadd_ps(g, v, _mm256_loadu_ps(out + i)));
+   }
+   tableReadScalar(level, phase + i, gain, out + i, n - i);
 }
 
-void Scheduler::run(double t)
+// The masked forms keep GCC 12 from warning about the undefined pass-through
+// operand of the plain ones.
+__attribute__((target("avx512f")))
+static void tableReadAvx512(const float *level, const uint32_t *phase, float gain, sample_t *out, size_t n)
 {
-   while (!mQueue.empty() && t >= mQueue.top()->startTime)
+   const __m512i mask = _mm512_set1_epi32((1 << tableFracBits) - 1);
+   const __m512 scale = _mm512_set1_ps(1.0f / (1 << tableFracBits));
+   const __m512 g = _mm512_set1_ps(gain);
+
+   size_t i = 0;
+   for (; i + 16 <= n; i += 16)
    {
-      mQueue.top()->fn();
-      delete mQueue.top();
-      mQueue.pop();
+      __m512i p = _mm512_loadu_si512(phase + i);
+      __m512i idx = _mm512_maskz_srli_epi32(0xffff, p, tableFracBits);
+      __m512 frac = _mm512_mul_ps(_mm512_maskz_cvtepi32_ps(0xffff, _mm512_and_si512(p, mask)), scale);
+      __m512 a = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xffff, idx, level, 4);
+      __m512 b = _mm512_mask_i32gather_ps(_mm512_setzero_ps(), 0xffff, idx, level + 1, 4);
+      __m512 v = _mm512_fmadd_ps(frac, _mm512_sub_ps(b, a), a);
+      _mm512_storeu_ps(out + i, _mm512_fmadd_ps(g, v, _mm512_loadu_ps(out + i)));
    }
+   tableReadScalar(level, phase + i, gain, out + i, n - i);
+}
+#endif
+
+typedef void (*TableReadFn)(const float *, const uint32_t *, float, sample_t *, size_t);
+
+static TableReadFn chooseTableRead()
+{
+#ifdef TABLE_READ_GATHER
+   __builtin_cpu_init();
+   if (__builtin_cpu_supports("avx512f"))
+      return tableReadAvx512;
+   if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return tableReadAvx2;
+#endif
+   return tableReadScalar;
+}
+
+// picked when the library loads
+static const TableReadFn tableReadImpl = chooseTableRead();
+
+void blockTableRead(const float *level, const uint32_t *phase, float gain, sample_t *out, size_t n)
+{
+   tableReadImpl(level, phase, gain, out, n);
 }
 
 /*=================================================================================*/
@@ -55,99 +177,597 @@ void Scheduler::run(double t)
 
 Generator::Generator()
 {
-   t0 = t = 0;
+   t = 0;
 }
 
-Generator::Generator(uint64_t t1)
+Generator::Generator(uint64_t t1) : AudioUnit(t1)
 {
-   t0 = t = t1;
+   t = t1;
 }
 
 /*=================================================================================*/
-/// ADSR - simple envelope generator
+/// Envelope -- segments rendered by recurrence
 
-ADSR::ADSR()
+static const EnvelopePreset envelopePresets[] =
+{
+   // name        segments {level, seconds, curve}                            count  sustain
+   { "adsr",    { {1, 0.01, 0}, {0.7, 0.1, -4}, {0, 0.3, -4} },                   3, 2 },
+   { "pluck",   { {1, 0.002, 0}, {0, 0.8, -6} },                                  2, Envelope::noSustain },
+   { "perc",    { {1, 0.001, 0}, {0.3, 0.05, -4}, {0, 0.25, -4} },                3, Envelope::noSustain },
+   { "organ",   { {1, 0.005, 0}, {0, 0.02, 0} },                                  2, 1 },
+   { "pad",     { {1, 0.8, 2}, {0.8, 1, -3}, {0, 2, -4} },                        3, 2 },
+   { "brass",   { {1, 0.05, -2}, {0.75, 0.2, -3}, {0, 0.15, -4} },                3, 2 },
+   { "strings", { {1, 0.3, -1}, {0.9, 0.4, -2}, {0, 0.6, -4} },                   3, 2 },
+   { "swell",   { {1, 2, 3}, {0, 1, -4} },                                        2, 1 },
+};
+
+const size_t Envelope::maxSegments;
+const int Envelope::noSustain;
+
+const EnvelopePreset *envelopePreset(const std::string &name)
+{
+   for (const EnvelopePreset &p : envelopePresets)
+      if (name == p.name)
+         return &p;
+   return NULL;
+}
+
+Envelope::Envelope()
+{
+   mCount = 0;
+   mSustain = noSustain;
+   mStage = IDLE;
+   mSegment = 0;
+   mLeft = 0;
+   mLevel = 0;
+   mMul = 1;
+   mAdd = 0;
+   mGateOn = false;
+   gate = 0;
+
+   addCtl("gate", &gate);
+}
+
+Envelope::Envelope(const std::string &preset) : Envelope()
+{
+   const EnvelopePreset *p = envelopePreset(preset);
+   if (p == NULL)
+      throw Exception("Unknown envelope preset " + preset);
+   setPreset(*p);
+}
+
+void Envelope::setSegments(const EnvSegment *segments, size_t count, int sustain)
+{
+   mCount = std::min(count, maxSegments);
+   std::copy(segments, segments + mCount, mSegments);
+   mSustain = sustain >= 0 && (size_t) sustain <= mCount ? sustain : noSustain;
+}
+
+void Envelope::setPreset(const EnvelopePreset &preset)
+{
+   setSegments(preset.segments, preset.count, preset.sustain);
+}
+
+void Envelope::adsr(double a, double d, double s, double r, double curve)
+{
+   EnvSegment seg[] = { {1, a, 0}, {s, d, curve}, {0, r, curve} };
+   setSegments(seg, 3, 2);
+}
+
+void Envelope::ahdsr(double a, double h, double d, double s, double r, double curve)
+{
+   EnvSegment seg[] = { {1, a, 0}, {1, h, 0}, {s, d, curve}, {0, r, curve} };
+   setSegments(seg, 4, 3);
+}
+
+// Set up the recurrence y = y * mMul + mAdd that takes the level to the end
+// of the segment in its length. A curve k follows
+// from + (to - from) (1 - e^(k i / len)) / (1 - e^k).
+void Envelope::enter(size_t segment)
+{
+   const EnvSegment &s = mSegments[segment];
+   double len = std::max(1.0, round(s.seconds * unitRate()));
+   double from = mLevel, to = s.level;
+
+   mStage = RUNNING;
+   mSegment = segment;
+   mLeft = len;
+
+   if (from == to)
+   {
+      mMul = 1;
+      mAdd = 0;
+   }
+   else if (fabs(s.curve) < 1e-3)
+   {
+      mMul = 1;
+      mAdd = (to - from) / len;
+   }
+   else
+   {
+      double b = (to - from) / (exp(s.curve) - 1);
+      mMul = exp(s.curve / len);
+      mAdd = (from - b) * (1 - mMul);
+   }
+}
+
+// The segment is done: land on its level exactly and go on.
+void Envelope::next()
+{
+   mLevel = mSegments[mSegment].level;
+   size_t following = mSegment + 1;
+
+   if ((int) following == mSustain)
+      mStage = HOLDING;
+   else if (following >= mCount)
+      mStage = IDLE;
+   else
+      enter(following);
+}
+
+void Envelope::start()
 {
-   state = INACTIVE;
+   mGateOn = true;
+   if (mCount == 0 || mSustain == 0)
+      mStage = mCount == 0 ? IDLE : HOLDING;
+   else
+      enter(0);
+}
+
+void Envelope::stop()
+{
+   mGateOn = false;
+   if (mSustain == noSustain || mStage == IDLE)
+      return;
+   if ((size_t) mSustain < mCount)
+      enter(mSustain);
+   else
+      mStage = IDLE;
+}
+
+void Envelope::onControlUpdate()
+{
+   if (gate > 0 && !mGateOn)
+      start();
+   else if (gate <= 0 && mGateOn)
+      stop();
+}
+
+double Envelope::operator()(uint64_t t, double in)
+{
+   if (mStage != RUNNING)
+      return mLevel;
+
+   mLevel = mLevel * mMul + mAdd;
+   if (-- mLeft == 0)
+      next();
+   return mLevel;
+}
+
+void Envelope::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   size_t i = 0;
+
+   while (i < n && mStage == RUNNING)
+   {
+      size_t len = std::min<uint64_t>(n - i, mLeft);
+      double y = mLevel;
+
+      if (mMul == 1 && mAdd == 0)
+         std::fill(out + i, out + i + len, y);
+      else
+         for (size_t k = i; k < i + len; k ++)
+         {
+            y = y * mMul + mAdd;
+            out[k] = y;
+         }
+
+      mLevel = y;
+      mLeft -= len;
+      i += len;
+      if (mLeft == 0)
+      {
+         next();
+         out[i - 1] = mLevel;
+      }
+   }
+
+   std::fill(out + i, out + n, mLevel);
 }
 
-ADSR::ADSR(uint64_t t1) : AudioUnit(t1)
+/*=================================================================================*/
+/// ADSR
+
+ADSR::ADSR()
 {
-   state = INACTIVE;
+   adsr(0, 0, 1, 0);
 }
 
 ADSR::ADSR(double a, double d, double s, double r)
 {
-   set(a, d, s, r);
-   state = INACTIVE;
+   adsr(a, d, s, r);
 }
 
 ADSR* ADSR::set(double a, double d, double s, double r)
 {
-   A = a * SampleRate;
-   D = d * SampleRate;
-   S = s;
-   R = r * SampleRate;
+   adsr(a, d, s, r);
    return this;
 }
 
-double ADSR::operator()(uint64_t t, double in)
+/*=================================================================================*/
+/// Oscillator -- phase accumulator of the periodic oscillators
+
+// A full cycle of the accumulator.
+static const double phaseCycle = 18446744073709551616.0;    // 2^64
+
+// The accumulator value of a fraction of a cycle; whole cycles wrap away.
+inline uint64_t cyclePhase(double c)
+{
+   double x = (c - floor(c)) * phaseCycle;
+   return x < phaseCycle ? (uint64_t) x : 0;
+}
+
+Oscillator::Oscillator()
+{
+   init(0);
+}
+
+Oscillator::Oscillator(uint64_t t1) : Generator(t1)
 {
-   if (state == ON)
+   init(0);
+}
+
+void Oscillator::init(double f)
+{
+   freq = f;
+   phase = 0;
+
+   mAcc = 0;
+   mInc = 0;
+   mIncCycles = NAN;    // SampleRate may not be known yet
+   mOffset = 0;
+   mOffsetPhase = 0;
+   mLast = t;
+
+   addCtl("freq", &freq, &freqIn);
+   addCtl("phase", &phase);
+}
+
+// Per sample increment of frequency f, cached for the last frequency seen.
+uint64_t Oscillator::increment(double f)
+{
+   double c = f / unitRate();
+   if (c != mIncCycles)
    {
-      if (t <= A)
-         return line(0, A, t, 0, 1);
-      if (t > A && t <= D)
-         return line(A, D, t, 1, S);
-      return S;
+      mIncCycles = c;
+      mInc = cyclePhase(c);
    }
+   return mInc;
+}
 
-   if (state == OFF)
+uint64_t Oscillator::offset()
+{
+   if (phase != mOffsetPhase)
    {
-      if (t < R)
-         return line(0, R, t, S, 0);
-      else
-         state = INACTIVE;
+      mOffsetPhase = phase;
+      mOffset = cyclePhase(phase / (2 * M_PI));
    }
-
-   return 0;
+   return mOffset;
 }
 
-void ADSR::start()
+// Per sample API: the phase at t. The frequency in effect since the last
+// call carries the accumulator there, so t may also jump or go back.
+uint64_t Oscillator::step(uint64_t t)
 {
-   state = ON;
-   t = 0;
+   mAcc += mInc * (t - mLast);
+   mLast = t;
+   increment(freq);
+
+   return mAcc + offset();
 }
 
-void ADSR::stop()
+// Oscillators that work on a block of phases render them a chunk at a time.
+static const size_t renderChunk = 256;
+
+template <typename T, typename Wave>
+void Oscillator::renderWave(T *out, size_t n, uint64_t t, Wave wave)
 {
-   state = OFF;
-   t = 0;
+   uint64_t p = mAcc + mInc * (t - mLast);
+   uint64_t ofs = offset();
+
+   if (freqIn.stride == 0)
+   {
+      // Unmodulated or modulated at control rate: one increment for the block.
+      uint64_t inc = increment(freqIn.at(0));
+      for (size_t i = 0; i < n; i ++)
+      {
+         out[i] = wave(p + ofs);
+         p += inc;
+      }
+   }
+   else
+   {
+      double period = 1.0 / unitRate();
+      uint64_t inc = mInc;
+      for (size_t i = 0; i < n; i ++)
+      {
+         out[i] = wave(p + ofs);
+         inc = cyclePhase(freqIn.at(i) * period);
+         p += inc;
+      }
+      mInc = inc;
+      mIncCycles = NAN;
+   }
+
+   mAcc = p;
+   mLast = t + n;
 }
 
+// The phase as a fraction of a cycle in [-1/2, 1/2), for blockSinCycles().
+struct CycleWave
+{
+   double operator()(uint64_t p) const { return (int64_t) p * (1 / phaseCycle); }
+};
+
+// The top 32 bits of the phase, for blockTableRead().
+struct PhaseWave
+{
+   uint32_t operator()(uint64_t p) const { return p >> 32; }
+};
+
+struct SinWave
+{
+   double operator()(uint64_t p) const { return sin((int64_t) p * (2 * M_PI / phaseCycle)); }
+};
+
 /*=================================================================================*/
 /// SinOsc -- sin wave oscillator class
 
 SinOsc::SinOsc()
 {
-   phase = 0;
 }
 
 SinOsc::SinOsc(double f)
 {
-   phase = 0;
    freq = f;
 }
 
-SinOsc::SinOsc(uint64_t t) : Generator(t)
+SinOsc::SinOsc(uint64_t t1) : Oscillator(t1)
 {
-   phase = 0;
-   freq = 0;
 }
 
 double SinOsc::operator()(uint64_t t, double in)
 {
-   return sin(T(t - t0) * freq * 2 * M_PI + phase);
+   return SinWave()(step(t));
+}
+
+void SinOsc::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   renderWave(out, n, t, CycleWave());
+   blockSinCycles(out, out, n);
+}
+
+/*=================================================================================*/
+/// BlepOsc -- band-limited analytic oscillators
+
+// The phase past a point e of the cycle, in [0, 1].
+static inline float since(float t, float e)
+{
+   float s = t - e;
+   return s < 0 ? s + 1 : s;
+}
+
+// Residual of a unit step at phase 0, spread over the sample before and the
+// sample after it. s is the phase past the step, dt the phase step a sample.
+static inline float blep(float s, float dt)
+{
+   float a = s / dt, b = (s - 1) / dt;
+   return a < 1 ? -0.5f * (1 - a) * (1 - a) : b > -1 ? 0.5f * (1 + b) * (1 + b) : 0;
+}
+
+// The same for a unit change of slope a sample.
+static inline float blamp(float s, float dt)
+{
+   float a = s / dt, b = (s - 1) / dt;
+   return a < 1 ? (1 - a) * (1 - a) * (1 - a) * (1.0f / 6) : b > -1 ? (1 + b) * (1 + b) * (1 + b) * (1.0f / 6) : 0;
+}
+
+// The waveforms start at zero or a rising edge, like SinOsc.
+static inline float sawAt(float t, float dt)
+{
+   float u = since(t, 0.5f);
+   return 2 * u - 1 - 2 * blep(u, dt);
+}
+
+static inline float pulseAt(float t, float dt, float w)
+{
+   return (t < w ? 1 : -1) + 2 * blep(t, dt) - 2 * blep(since(t, w), dt);
+}
+
+static inline float triAt(float t, float dt)
+{
+   return 1 - 4 * fabsf(since(t, 0.75f) - 0.5f)
+      + 8 * dt * (blamp(since(t, 0.75f), dt) - blamp(since(t, 0.25f), dt));
+}
+
+float polyBlepSaw(float t, float dt) { return sawAt(t, dt); }
+float polyBlepPulse(float t, float dt, float width) { return pulseAt(t, dt, width); }
+float polyBlepTri(float t, float dt) { return triAt(t, dt); }
+
+VECTOR_CLONES
+static void sawBlock(const float *t, const float *dt, sample_t *out, size_t n)
+{
+   for (size_t i = 0; i < n; i ++)
+      out[i] = sawAt(t[i], dt[i]);
+}
+
+VECTOR_CLONES
+static void pulseBlock(const float *t, const float *dt, const float *w, sample_t *out, size_t n)
+{
+   for (size_t i = 0; i < n; i ++)
+      out[i] = pulseAt(t[i], dt[i], w[i]);
+}
+
+VECTOR_CLONES
+static void triBlock(const float *t, const float *dt, sample_t *out, size_t n)
+{
+   for (size_t i = 0; i < n; i ++)
+      out[i] = triAt(t[i], dt[i]);
+}
+
+// A 32-bit phase in cycles, exact in a float and below 1.
+static inline float phaseCycles(uint32_t p)
+{
+   return (int) (p >> 8) * (1.0f / (1 << 24));
+}
+
+// A restart of the cycle by the sync input.
+struct SyncReset
+{
+   size_t i;            // the first sample after it
+   float d;             // samples from the restart to i
+   float jump;          // of the naive waveform
+};
+
+BlepOsc::BlepOsc(Shape shape, uint64_t t1) : Oscillator(t1), mShape(shape)
+{
+   sync = 0;
+   width = 0.5;
+   mSyncLast = 0;
+
+   addCtl("sync", &sync, &syncIn);
+}
+
+// The waveform without band limiting.
+float BlepOsc::naive(float t, float w)
+{
+   switch (mShape)
+   {
+      case SAW:      return 2 * since(t, 0.5f) - 1;
+      case PULSE:    return t < w ? 1 : -1;
+      default:       return 1 - 4 * fabsf(since(t, 0.75f) - 0.5f);
+   }
+}
+
+double BlepOsc::operator()(uint64_t t, double in)
+{
+   float p = phaseCycles(step(t) >> 32);
+   float dt = std::min(fabs((double) (int64_t) mInc) / phaseCycle, 0.5);
+
+   switch (mShape)
+   {
+      case SAW:      return sawAt(p, dt);
+      case PULSE:    return pulseAt(p, dt, std::min(std::max(width, 0.0), 1.0));
+      default:       return triAt(p, dt);
+   }
+}
+
+void BlepOsc::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   uint32_t phase[renderChunk];
+   float p[renderChunk], dt[renderChunk], w[renderChunk];
+   SyncReset resets[renderChunk];
+   double period = 1.0 / unitRate();
+
+   for (size_t done = 0; done < n; done += renderChunk)
+   {
+      size_t len = std::min(renderChunk, n - done);
+      sample_t *o = out + done;
+
+      renderWave(phase, len, t + done, PhaseWave());
+
+      if (freqIn.stride == 0)
+         std::fill(dt, dt + len, std::min(fabs(freqIn.at(0)) * period, 0.5));
+      else
+         for (size_t i = 0; i < len; i ++)
+            dt[i] = std::min(fabs(freqIn.at(done + i)) * period, 0.5);
+      if (mShape == PULSE)
+         for (size_t i = 0; i < len; i ++)
+            w[i] = std::min(std::max(widthIn.at(done + i), 0.0), 1.0);
+      else
+         std::fill(w, w + len, 0.5f);
+
+      // Restart the cycle where the sync input crosses zero going up, moving
+      // the rest of the chunk and the accumulator with it.
+      // A sync input that is not audio rate can only cross at the start.
+      size_t nresets = 0;
+      size_t scan = syncIn.stride == 0 ? 1 : len;
+      uint32_t start = offset() >> 32;
+      for (size_t i = 0; i < scan; i ++)
+      {
+         double s = syncIn.at(done + i);
+         if (mSyncLast <= 0 && s > 0)
+         {
+            float d = s / (s - mSyncLast);
+            uint32_t before = phase[i] - (uint32_t) (d * dt[i] * 4294967296.0);
+            uint32_t shift = before - start;
+
+            for (size_t j = i; j < len; j ++)
+               phase[j] -= shift;
+            mAcc -= (uint64_t) shift << 32;
+
+            float jump = naive(phaseCycles(start), w[i]) - naive(phaseCycles(before), w[i]);
+            resets[nresets ++] = SyncReset { i, d, jump };
+         }
+         mSyncLast = s;
+      }
+
+      for (size_t i = 0; i < len; i ++)
+         p[i] = phaseCycles(phase[i]);
+
+      switch (mShape)
+      {
+         case SAW:      sawBlock(p, dt, o, len); break;
+         case PULSE:    pulseBlock(p, dt, w, o, len); break;
+         case TRIANGLE: triBlock(p, dt, o, len); break;
+      }
+
+      // The sample after a restart is redone, as the kernels take the restart
+      // for an edge of the waveform; the one before gets its half of the step.
+      for (size_t r = 0; r < nresets; r ++)
+      {
+         const SyncReset &e = resets[r];
+         o[e.i] = naive(p[e.i], w[e.i]) - 0.5f * e.jump * (1 - e.d) * (1 - e.d);
+         if (done + e.i > 0)
+            o[(ptrdiff_t) e.i - 1] += 0.5f * e.jump * e.d * e.d;
+      }
+   }
+}
+
+/*=================================================================================*/
+/// SawOsc -- rising saw wave oscillator
+
+SawOsc::SawOsc() : BlepOsc(SAW, 0)
+{
+}
+
+SawOsc::SawOsc(double f) : BlepOsc(SAW, 0)
+{
+   freq = f;
+}
+
+SawOsc::SawOsc(uint64_t t1) : BlepOsc(SAW, t1)
+{
+}
+
+/*=================================================================================*/
+/// PulseOsc -- pulse wave oscillator with pulse width control
+
+PulseOsc::PulseOsc() : BlepOsc(PULSE, 0)
+{
+   addCtl("width", &width, &widthIn);
+}
+
+PulseOsc::PulseOsc(double f, double w) : BlepOsc(PULSE, 0)
+{
+   freq = f;
+   width = w;
+   addCtl("width", &width, &widthIn);
+}
+
+PulseOsc::PulseOsc(uint64_t t1) : BlepOsc(PULSE, t1)
+{
+   addCtl("width", &width, &widthIn);
 }
 
 /*=================================================================================*/
@@ -155,22 +775,1256 @@ double SinOsc::operator()(uint64_t t, double in)
 
 SqrOsc::SqrOsc()
 {
-   phase = 0;
 }
 
-SqrOsc::SqrOsc(double f)
+SqrOsc::SqrOsc(double f) : PulseOsc(f)
+{
+}
+
+SqrOsc::SqrOsc(uint64_t t1) : PulseOsc(t1)
+{
+}
+
+/*=================================================================================*/
+/// TriOsc -- triangle wave oscillator
+
+TriOsc::TriOsc() : BlepOsc(TRIANGLE, 0)
+{
+}
+
+TriOsc::TriOsc(double f) : BlepOsc(TRIANGLE, 0)
 {
    freq = f;
-   phase = 0;
 }
 
-SqrOsc::SqrOsc(uint64_t t) : Generator(t)
+TriOsc::TriOsc(uint64_t t1) : BlepOsc(TRIANGLE, t1)
 {
-   freq = 0;
-   phase = 0;
 }
 
-double SqrOsc::operator()(uint64_t t, double in)
+/*=================================================================================*/
+/// Wavetable -- band-limited single cycle waveforms
+
+Wavetable::Wavetable(const std::vector<double> &harmonics) : mData(levels * (size + 1), 0)
+{
+   std::vector<double> sine(size);
+   for (size_t j = 0; j < size; j ++)
+      sine[j] = sin(2 * M_PI * j / size);
+
+   // From a single harmonic at the top level down, each level adding the
+   // octave of harmonics the one above it leaves out.
+   std::vector<double> acc(size, 0);
+   size_t h = 1;
+   for (size_t k = levels; k -- > 0; )
+   {
+      size_t top = std::min((size / 2) >> k, harmonics.size());
+      for (; h <= top; h ++)
+         for (size_t j = 0; j < size; j ++)
+            acc[j] += harmonics[h - 1] * sine[(h * j) % size];
+
+      float *l = &mData[k * (size + 1)];
+      std::copy(acc.begin(), acc.end(), l);
+      l[size] = l[0];
+   }
+}
+
+size_t Wavetable::levelFor(uint64_t inc) const
+{
+   // The lowest level whose highest harmonic, size / 2^(k+1) times f, stays
+   // below Nyquist: 2^k >= size f / SampleRate.
+   uint64_t x = inc >> (64 - sizeBits);
+   size_t k = x == 0 ? 0 : 64 - __builtin_clzll(x);
+   return std::min(k, levels - 1);
+}
+
+// The shapes of SawOsc, SqrOsc and TriOsc, starting at zero or a rising edge.
+const Wavetable& Wavetable::saw()
+{
+   static const Wavetable table([]
+   {
+      std::vector<double> a(size / 2);
+      for (size_t h = 1; h <= a.size(); h ++)
+         a[h - 1] = (h % 2 ? 2 : -2) / (M_PI * h);
+      return a;
+   }());
+   return table;
+}
+
+const Wavetable& Wavetable::square()
+{
+   static const Wavetable table([]
+   {
+      std::vector<double> a(size / 2, 0);
+      for (size_t h = 1; h <= a.size(); h += 2)
+         a[h - 1] = 4 / (M_PI * h);
+      return a;
+   }());
+   return table;
+}
+
+const Wavetable& Wavetable::triangle()
+{
+   static const Wavetable table([]
+   {
+      std::vector<double> a(size / 2, 0);
+      for (size_t h = 1; h <= a.size(); h += 2)
+         a[h - 1] = (h % 4 == 1 ? 8 : -8) / (M_PI * M_PI * h * h);
+      return a;
+   }());
+   return table;
+}
+
+/*=================================================================================*/
+/// WaveOsc -- wavetable oscillator
+
+WaveOsc::WaveOsc(const Wavetable &table, double f) : mTable(&table)
+{
+   freq = f;
+}
+
+double WaveOsc::operator()(uint64_t t, double in)
+{
+   uint64_t p = step(t);
+   return tableRead(mTable->level(mTable->levelFor(mInc)), p >> 32);
+}
+
+void WaveOsc::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   // The level follows the frequency at the start of the block.
+   const float *level = mTable->level(mTable->levelFor(cyclePhase(fabs(freqIn.at(0)) / unitRate())));
+   uint32_t phase[renderChunk];
+
+   std::fill(out, out + n, 0);
+   for (size_t done = 0; done < n; done += renderChunk)
+   {
+      size_t len = std::min(renderChunk, n - done);
+      renderWave(phase, len, t + done, PhaseWave());
+      blockTableRead(level, phase, 1, out + done, len);
+   }
+}
+
+/*=================================================================================*/
+/// WaveBank -- voices sharing a wavetable
+
+WaveBank::WaveBank(const Wavetable &table, size_t voices) : mTable(&table), mVoices(voices)
+{
+   for (size_t v = 0; v < voices; v ++)
+   {
+      mVoices[v] = Voice { 0, 0, 0 };
+      addCtl("freq" + std::to_string(v), &mVoices[v].freq);
+      addCtl("gain" + std::to_string(v), &mVoices[v].gain);
+   }
+}
+
+void WaveBank::setVoice(size_t v, double freq, double gain)
+{
+   mVoices[v].freq = freq;
+   mVoices[v].gain = gain;
+}
+
+bool WaveBank::isSilent()
+{
+   for (Voice &v : mVoices)
+      if (v.gain != 0)
+         return false;
+   return true;
+}
+
+void WaveBank::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   uint32_t phase[renderChunk];
+   double rate = unitRate();
+
+   std::fill(out, out + n, 0);
+   for (Voice &v : mVoices)
+   {
+      uint64_t inc = cyclePhase(v.freq / rate);
+      const float *level = mTable->level(mTable->levelFor(cyclePhase(fabs(v.freq) / rate)));
+
+      // Within a chunk the phase steps in 32 bits; the accumulator stays exact.
+      uint32_t inc32 = inc >> 32;
+      for (size_t done = 0; done < n; done += renderChunk)
+      {
+         size_t len = std::min(renderChunk, n - done);
+         uint32_t base = v.acc >> 32;
+         for (size_t i = 0; i < len; i ++)
+            phase[i] = base + (uint32_t) i * inc32;
+         v.acc += inc * len;
+
+         if (v.gain != 0)
+            blockTableRead(level, phase, v.gain, out + done, len);
+      }
+   }
+}
+
+/*=================================================================================*/
+/// Noise -- white, pink and brown noise on a SIMD generator
+
+const size_t NoiseRng::lanes;
+const unsigned Noise::pinkRows;
+
+static inline uint32_t rotl32(uint32_t x, int k)
+{
+   return (x << k) | (x >> (32 - k));
+}
+
+// xoshiro128+ in every lane, a group of eight samples at a time. The float is
+// made of the top 24 bits; the weak low bits of xoshiro128+ never reach it.
+VECTOR_CLONES
+static void rngGroups(RngLanes &s, sample_t *out, size_t groups)
+{
+   const size_t L = NoiseRng::lanes;
+
+   for (size_t g = 0; g < groups; g ++)
+      for (size_t l = 0; l < L; l ++)
+      {
+         uint32_t r = s.s0[l] + s.s3[l];
+         uint32_t t = s.s1[l] << 9;
+
+         s.s2[l] ^= s.s0[l];
+         s.s3[l] ^= s.s1[l];
+         s.s1[l] ^= s.s2[l];
+         s.s0[l] ^= s.s3[l];
+         s.s2[l] ^= t;
+         s.s3[l] = rotl32(s.s3[l], 11);
+
+         out[g * L + l] = (int32_t) (r & 0xffffff00u) * (1.0f / 2147483648.0f);
+      }
+}
+
+static inline uint64_t splitMix64(uint64_t &x)
+{
+   uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+   z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+   z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+   return z ^ (z >> 31);
+}
+
+NoiseRng::NoiseRng(uint64_t s)
+{
+   seed(s);
+}
+
+// Each lane starts from its own splitmix64 output, as the xoshiro authors advise.
+void NoiseRng::seed(uint64_t s)
+{
+   for (size_t l = 0; l < lanes; l ++)
+   {
+      uint64_t a = splitMix64(s), b = splitMix64(s);
+      mLanes.s0[l] = a;
+      mLanes.s1[l] = a >> 32;
+      mLanes.s2[l] = b;
+      mLanes.s3[l] = b >> 32;
+      if ((a | b) == 0)
+         mLanes.s0[l] = 1;
+   }
+   mSpareLeft = 0;
+}
+
+void NoiseRng::fill(sample_t *out, size_t n)
+{
+   size_t i = std::min(n, mSpareLeft);
+   std::copy(mSpare + lanes - mSpareLeft, mSpare + lanes - mSpareLeft + i, out);
+   mSpareLeft -= i;
+
+   size_t groups = (n - i) / lanes;
+   rngGroups(mLanes, out + i, groups);
+   i += groups * lanes;
+
+   if (i < n)
+   {
+      rngGroups(mLanes, mSpare, 1);
+      std::copy(mSpare, mSpare + (n - i), out + i);
+      mSpareLeft = lanes - (n - i);
+   }
+}
+
+uint64_t nextNoiseSeed()
+{
+   static std::atomic<uint64_t> units(0);
+   return units.fetch_add(1, std::memory_order_relaxed);
+}
+
+Noise::Noise(NoiseColor color, uint64_t s) : mColor(color)
+{
+   seed = s;
+   mSeed = s;
+   addCtl("seed", &seed);
+   restart();
+}
+
+// Back to the start of the stream of mSeed.
+void Noise::restart()
+{
+   mRng.seed(mSeed);
+   std::fill(mRows, mRows + pinkRows, 0);
+   if (mColor == PINK)
+      mRng.fill(mRows, pinkRows);
+
+   mPinkSum = 0;
+   for (float r : mRows)
+      mPinkSum += r;
+   mCounter = 0;
+   mBrown = 0;
+}
+
+void Noise::onControlUpdate()
+{
+   if ((uint64_t) seed != mSeed)
+   {
+      mSeed = (uint64_t) seed;
+      restart();
+   }
+}
+
+double Noise::operator()(uint64_t t, double in)
+{
+   sample_t y;
+   processBlock(NULL, &y, 1, t);
+   return y;
+}
+
+void Noise::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   if (mColor == WHITE)
+   {
+      mRng.fill(out, n);
+      return;
+   }
+
+   if (mColor == BROWN)
+   {
+      double leak = exp(-2 * M_PI * 10 / unitRate());
+      double k = sqrt(1 - leak * leak);
+      double y = mBrown;
+
+      mRng.fill(out, n);
+      for (size_t i = 0; i < n; i ++)
+         out[i] = y = leak * y + k * out[i];
+      mBrown = y;
+      return;
+   }
+
+   // Pink: row k of the sum takes a new white value every 2^(k+1) samples,
+   // plus a white value of its own every sample.
+   sample_t white[2 * renderChunk];
+   const float scale = 1 / sqrtf(pinkRows + 1);
+
+   for (size_t done = 0; done < n; done += renderChunk)
+   {
+      size_t len = std::min(renderChunk, n - done);
+      mRng.fill(white, 2 * len);
+
+      for (size_t i = 0; i < len; i ++)
+      {
+         uint32_t c = ++ mCounter;
+         unsigned row = c != 0 ? __builtin_ctz(c) : pinkRows;
+         if (row < pinkRows)
+         {
+            mPinkSum += white[2 * i] - mRows[row];
+            mRows[row] = white[2 * i];
+         }
+         out[done + i] = (mPinkSum + white[2 * i + 1]) * scale;
+      }
+   }
+}
+
+/*=================================================================================*/
+/// Biquad -- RBJ cookbook filters in transposed direct form II
+
+BiquadCoefs::BiquadCoefs(FilterType type, double freq, double q, double gain)
+{
+   double w = 2 * M_PI * freq / unitRate();
+   double cw = cos(w);
+   double alpha = sin(w) / (2 * q);
+   double A = pow(10, gain / 40);
+   double sa = 2 * sqrt(A) * alpha;
+   double a0;
+
+   switch (type)
+   {
+      case LOWPASS:
+         b0 = (1 - cw) / 2;   b1 = 1 - cw;      b2 = (1 - cw) / 2;
+         a0 = 1 + alpha;      a1 = -2 * cw;     a2 = 1 - alpha;
+         break;
+      case HIGHPASS:
+         b0 = (1 + cw) / 2;   b1 = -(1 + cw);   b2 = (1 + cw) / 2;
+         a0 = 1 + alpha;      a1 = -2 * cw;     a2 = 1 - alpha;
+         break;
+      case BANDPASS:
+         b0 = alpha;          b1 = 0;           b2 = -alpha;
+         a0 = 1 + alpha;      a1 = -2 * cw;     a2 = 1 - alpha;
+         break;
+      case NOTCH:
+         b0 = 1;              b1 = -2 * cw;     b2 = 1;
+         a0 = 1 + alpha;      a1 = -2 * cw;     a2 = 1 - alpha;
+         break;
+      case PEAK:
+         b0 = 1 + alpha * A;  b1 = -2 * cw;     b2 = 1 - alpha * A;
+         a0 = 1 + alpha / A;  a1 = -2 * cw;     a2 = 1 - alpha / A;
+         break;
+      case LOWSHELF:
+         b0 = A * ((A + 1) - (A - 1) * cw + sa);
+         b1 = 2 * A * ((A - 1) - (A + 1) * cw);
+         b2 = A * ((A + 1) - (A - 1) * cw - sa);
+         a0 = (A + 1) + (A - 1) * cw + sa;
+         a1 = -2 * ((A - 1) + (A + 1) * cw);
+         a2 = (A + 1) + (A - 1) * cw - sa;
+         break;
+      case HIGHSHELF:
+      default:
+         b0 = A * ((A + 1) + (A - 1) * cw + sa);
+         b1 = -2 * A * ((A - 1) + (A + 1) * cw);
+         b2 = A * ((A + 1) + (A - 1) * cw - sa);
+         a0 = (A + 1) - (A - 1) * cw + sa;
+         a1 = 2 * ((A - 1) - (A + 1) * cw);
+         a2 = (A + 1) - (A - 1) * cw - sa;
+         break;
+   }
+
+   b0 /= a0; b1 /= a0; b2 /= a0;
+   a1 /= a0; a2 /= a0;
+}
+
+Biquad::Biquad(FilterType type, double f, double q1, double g) : mType(type)
+{
+   freq = f;
+   q = q1;
+   gain = g;
+
+   mFreq = -1;          // the first coefficients are not glided to
+   mQ = mGain = 0;
+   mRampLeft = 0;
+   z1 = z2 = 0;
+
+   addCtl("freq", &freq, &freqIn);
+   addCtl("q", &q);
+   addCtl("gain", &gain);
+}
+
+// Aim at the coefficients for cutoff f and the other controls.
+void Biquad::update(double f)
+{
+   f = std::min(std::max(f, 1.0), 0.49 * unitRate());
+   double qq = std::max(q, 1e-3);
+   if (f == mFreq && qq == mQ && gain == mGain)
+      return;
+
+   bool glide = mFreq >= 0;
+   mFreq = f;
+   mQ = qq;
+   mGain = gain;
+   mTarget = BiquadCoefs(mType, f, qq, gain);
+
+   if (!glide)
+   {
+      mCoefs = mTarget;
+      return;
+   }
+
+   double k = 1.0 / filterSmoothFrames;
+   mStep.b0 = (mTarget.b0 - mCoefs.b0) * k;
+   mStep.b1 = (mTarget.b1 - mCoefs.b1) * k;
+   mStep.b2 = (mTarget.b2 - mCoefs.b2) * k;
+   mStep.a1 = (mTarget.a1 - mCoefs.a1) * k;
+   mStep.a2 = (mTarget.a2 - mCoefs.a2) * k;
+   mRampLeft = filterSmoothFrames;
+}
+
+double Biquad::tick(double x)
+{
+   if (mRampLeft > 0)
+   {
+      mCoefs.b0 += mStep.b0;
+      mCoefs.b1 += mStep.b1;
+      mCoefs.b2 += mStep.b2;
+      mCoefs.a1 += mStep.a1;
+      mCoefs.a2 += mStep.a2;
+      if (-- mRampLeft == 0)
+         mCoefs = mTarget;
+   }
+
+   double y = mCoefs.b0 * x + z1;
+   z1 = mCoefs.b1 * x - mCoefs.a1 * y + z2;
+   z2 = mCoefs.b2 * x - mCoefs.a2 * y;
+   return y;
+}
+
+double Biquad::operator()(uint64_t t, double in)
+{
+   update(freq);
+   return tick(in);
+}
+
+void Biquad::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   update(freqIn.at(0));
+
+   size_t i = 0;
+   for (; i < n && mRampLeft > 0; i ++)
+      out[i] = tick(in[i]);
+
+   // steady coefficients, state kept in registers
+   const BiquadCoefs c = mCoefs;
+   double s1 = z1, s2 = z2;
+   for (; i < n; i ++)
+   {
+      double x = in[i];
+      double y = c.b0 * x + s1;
+      s1 = c.b1 * x - c.a1 * y + s2;
+      s2 = c.b2 * x - c.a2 * y;
+      out[i] = y;
+   }
+   z1 = s1;
+   z2 = s2;
+}
+
+/*=================================================================================*/
+/// BiquadBank -- biquads in SIMD lanes
+
+// GCC vector types for the lanes, which the clones compile to SSE, AVX or
+// AVX-512 registers.
+typedef float v4sf __attribute__((vector_size(16)));
+typedef float v8sf __attribute__((vector_size(32)));
+
+template <size_t L> struct LaneVector;
+template <> struct LaneVector<4> { typedef v4sf type; };
+template <> struct LaneVector<8> { typedef v8sf type; };
+
+// Run the lanes over n interleaved frames, gliding the coefficients if Ramp.
+template <size_t L, bool Ramp>
+static inline void biquadLanes(BiquadLanes<L> &s, sample_t *x, size_t n)
+{
+   typedef typename LaneVector<L>::type V;
+
+   V b0, b1, b2, a1, a2, z1, z2, d0, d1, d2, e1, e2;
+   memcpy(&b0, s.b0, sizeof(V)); memcpy(&d0, s.d0, sizeof(V));
+   memcpy(&b1, s.b1, sizeof(V)); memcpy(&d1, s.d1, sizeof(V));
+   memcpy(&b2, s.b2, sizeof(V)); memcpy(&d2, s.d2, sizeof(V));
+   memcpy(&a1, s.a1, sizeof(V)); memcpy(&e1, s.e1, sizeof(V));
+   memcpy(&a2, s.a2, sizeof(V)); memcpy(&e2, s.e2, sizeof(V));
+   memcpy(&z1, s.z1, sizeof(V));
+   memcpy(&z2, s.z2, sizeof(V));
+
+   for (size_t i = 0; i < n; i ++, x += L)
+   {
+      if (Ramp)
+      {
+         b0 += d0; b1 += d1; b2 += d2;
+         a1 += e1; a2 += e2;
+      }
+
+      V in;
+      memcpy(&in, x, sizeof(V));
+      V y = b0 * in + z1;
+      z1 = b1 * in - a1 * y + z2;
+      z2 = b2 * in - a2 * y;
+      memcpy(x, &y, sizeof(V));
+   }
+
+   if (Ramp)
+   {
+      memcpy(s.b0, &b0, sizeof(V));
+      memcpy(s.b1, &b1, sizeof(V));
+      memcpy(s.b2, &b2, sizeof(V));
+      memcpy(s.a1, &a1, sizeof(V));
+      memcpy(s.a2, &a2, sizeof(V));
+   }
+   memcpy(s.z1, &z1, sizeof(V));
+   memcpy(s.z2, &z2, sizeof(V));
+}
+
+VECTOR_CLONES
+static void runLanes(BiquadLanes<4> &s, sample_t *x, size_t n, bool ramp)
+{
+   if (ramp)
+      biquadLanes<4, true>(s, x, n);
+   else
+      biquadLanes<4, false>(s, x, n);
+}
+
+VECTOR_CLONES
+static void runLanes(BiquadLanes<8> &s, sample_t *x, size_t n, bool ramp)
+{
+   if (ramp)
+      biquadLanes<8, true>(s, x, n);
+   else
+      biquadLanes<8, false>(s, x, n);
+}
+
+template <size_t L>
+BiquadBank<L>::BiquadBank()
+{
+   BiquadLanes<L> &s = mLanes;
+   for (size_t l = 0; l < L; l ++)
+   {
+      s.b0[l] = 1;
+      s.b1[l] = s.b2[l] = s.a1[l] = s.a2[l] = 0;
+      s.d0[l] = s.d1[l] = s.d2[l] = s.e1[l] = s.e2[l] = 0;
+   }
+   mRampLeft = 0;
+   reset();
+}
+
+template <size_t L>
+void BiquadBank<L>::reset()
+{
+   std::fill(mLanes.z1, mLanes.z1 + L, 0);
+   std::fill(mLanes.z2, mLanes.z2 + L, 0);
+}
+
+template <size_t L>
+void BiquadBank<L>::set(size_t lane, FilterType type, double freq, double q, double gain)
+{
+   freq = std::min(std::max(freq, 1.0), 0.49 * unitRate());
+   mTarget[lane] = BiquadCoefs(type, freq, std::max(q, 1e-3), gain);
+
+   // All the lanes glide together, from wherever they are.
+   BiquadLanes<L> &s = mLanes;
+   float k = 1.0f / filterSmoothFrames;
+   for (size_t l = 0; l < L; l ++)
+   {
+      s.d0[l] = ((float) mTarget[l].b0 - s.b0[l]) * k;
+      s.d1[l] = ((float) mTarget[l].b1 - s.b1[l]) * k;
+      s.d2[l] = ((float) mTarget[l].b2 - s.b2[l]) * k;
+      s.e1[l] = ((float) mTarget[l].a1 - s.a1[l]) * k;
+      s.e2[l] = ((float) mTarget[l].a2 - s.a2[l]) * k;
+   }
+   mRampLeft = filterSmoothFrames;
+}
+
+template <size_t L>
+void BiquadBank<L>::process(sample_t *frames, size_t n)
+{
+   size_t i = 0;
+   if (mRampLeft > 0)
+   {
+      i = std::min(n, mRampLeft);
+      runLanes(mLanes, frames, i, true);
+
+      mRampLeft -= i;
+      if (mRampLeft == 0)
+         for (size_t l = 0; l < L; l ++)
+         {
+            mLanes.b0[l] = mTarget[l].b0;
+            mLanes.b1[l] = mTarget[l].b1;
+            mLanes.b2[l] = mTarget[l].b2;
+            mLanes.a1[l] = mTarget[l].a1;
+            mLanes.a2[l] = mTarget[l].a2;
+         }
+   }
+
+   runLanes(mLanes, frames + i * L, n - i, false);
+}
+
+template class BiquadBank<4>;
+template class BiquadBank<8>;
+
+/*=================================================================================*/
+/// SVF -- trapezoidal state-variable filter
+
+// tan(x) for 0 <= x <= 0.49 pi within 7e-8 relative: a [7/6] Pade approximant,
+// several times cheaper than tan() in the per sample path.
+static inline double tanPade(double x)
+{
+   double x2 = x * x;
+   return x * (135135 + x2 * (-17325 + x2 * (378 - x2)))
+      / (135135 + x2 * (-62370 + x2 * (3150 - 28 * x2)));
+}
+
+// The prewarped integrator gain of cutoff f.
+static inline double zdfGain(double f, double period)
+{
+   f = std::min(std::max(f, 1.0), 0.49 / period);
+   return tanPade(M_PI * f * period);
+}
+
+// How a filter type mixes the SVF outputs, y = m0 x + m1 band + m2 low, with
+// the damping k and the factor on g (Simper's bell and shelves).
+struct SvfMix
+{
+   double k, m0, m1, m2, gScale;
+
+   SvfMix(FilterType type, double q, double gain)
+   {
+      double A = pow(10, gain / 40);
+      k = 1 / std::max(q, 1e-3);
+      gScale = 1;
+
+      switch (type)
+      {
+         case LOWPASS:     m0 = 0;     m1 = 0;              m2 = 1;     break;
+         case HIGHPASS:    m0 = 1;     m1 = -k;             m2 = -1;    break;
+         case BANDPASS:    m0 = 0;     m1 = k;              m2 = 0;     break;
+         case NOTCH:       m0 = 1;     m1 = -k;             m2 = 0;     break;
+         case PEAK:
+            k /= A;
+            m0 = 1;     m1 = k * (A * A - 1);    m2 = 0;
+            break;
+         case LOWSHELF:
+            gScale = 1 / sqrt(A);
+            m0 = 1;     m1 = k * (A - 1);        m2 = A * A - 1;
+            break;
+         case HIGHSHELF:
+         default:
+            gScale = sqrt(A);
+            m0 = A * A; m1 = k * (1 - A) * A;    m2 = 1 - A * A;
+            break;
+      }
+   }
+};
+
+struct SvfCoefs
+{
+   double a1, a2, a3;
+
+   SvfCoefs(double g, double k)
+   {
+      a1 = 1 / (1 + g * (g + k));
+      a2 = g * a1;
+      a3 = g * a2;
+   }
+};
+
+static inline double svfTick(double x, const SvfCoefs &c, const SvfMix &m, double &ic1, double &ic2)
+{
+   double v3 = x - ic2;
+   double v1 = c.a1 * ic1 + c.a2 * v3;
+   double v2 = ic2 + c.a2 * ic1 + c.a3 * v3;
+   ic1 = 2 * v1 - ic1;
+   ic2 = 2 * v2 - ic2;
+   return m.m0 * x + m.m1 * v1 + m.m2 * v2;
+}
+
+SVF::SVF(FilterType type, double f, double q1, double g) : mType(type)
+{
+   freq = f;
+   q = q1;
+   gain = g;
+   ic1 = ic2 = 0;
+
+   addCtl("freq", &freq, &freqIn);
+   addCtl("q", &q);
+   addCtl("gain", &gain);
+}
+
+double SVF::operator()(uint64_t t, double in)
+{
+   SvfMix m(mType, q, gain);
+   SvfCoefs c(zdfGain(freq, 1 / unitRate()) * m.gScale, m.k);
+   return svfTick(in, c, m, ic1, ic2);
+}
+
+void SVF::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   const SvfMix m(mType, q, gain);
+   double period = 1 / unitRate();
+   double s1 = ic1, s2 = ic2;
+
+   if (freqIn.stride == 0)
+   {
+      const SvfCoefs c(zdfGain(freqIn.at(0), period) * m.gScale, m.k);
+      for (size_t i = 0; i < n; i ++)
+         out[i] = svfTick(in[i], c, m, s1, s2);
+   }
+   else
+   {
+      for (size_t i = 0; i < n; i ++)
+      {
+         SvfCoefs c(zdfGain(freqIn.at(i), period) * m.gScale, m.k);
+         out[i] = svfTick(in[i], c, m, s1, s2);
+      }
+   }
+
+   ic1 = s1;
+   ic2 = s2;
+}
+
+/*=================================================================================*/
+/// Ladder -- four pole zero-delay-feedback ladder
+
+// Soft clipper, a rational fit of tanh that reaches +-1 at +-3.
+static inline double ladderSat(double x)
+{
+   x = std::min(std::max(x, -3.0), 3.0);
+   return x * (27 + x * x) / (27 + 9 * x * x);
+}
+
+// One sample through the ladder of integrator gain g. The feedback is solved
+// for the linear ladder, then the stage input is saturated.
+static inline double ladderTick(double x, double g, double k, double drive, double *s)
+{
+   double b = 1 / (1 + g);
+   double G = g * b;
+   double sum = b * (s[3] + G * (s[2] + G * (s[1] + G * s[0])));
+   double G4 = (G * G) * (G * G);
+
+   double y = ladderSat((drive * x - k * sum) / (1 + k * G4));
+   for (int i = 0; i < 4; i ++)
+   {
+      double v = (y - s[i]) * G;
+      y = v + s[i];
+      s[i] = y + v;
+   }
+   return y;
+}
+
+Ladder::Ladder(double f, double r, double d)
+{
+   freq = f;
+   res = r;
+   drive = d;
+   reset();
+
+   addCtl("freq", &freq, &freqIn);
+   addCtl("res", &res);
+   addCtl("drive", &drive);
+}
+
+double Ladder::operator()(uint64_t t, double in)
+{
+   double k = 4 * std::min(std::max(res, 0.0), 1.25);
+   return ladderTick(in, zdfGain(freq, 1 / unitRate()), k, drive, s);
+}
+
+void Ladder::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   double k = 4 * std::min(std::max(res, 0.0), 1.25);
+   double period = 1 / unitRate();
+   double d = drive;
+
+   if (freqIn.stride == 0)
+   {
+      double g = zdfGain(freqIn.at(0), period);
+      for (size_t i = 0; i < n; i ++)
+         out[i] = ladderTick(in[i], g, k, d, s);
+   }
+   else
+   {
+      for (size_t i = 0; i < n; i ++)
+         out[i] = ladderTick(in[i], zdfGain(freqIn.at(i), period), k, d, s);
+   }
+}
+
+/*=================================================================================*/
+/// Oversampler -- a unit run at a multiple of the sample rate
+
+static const size_t oversampleTaps = 32;      // filter taps per phase
+static const size_t oversampleChunk = 256;    // frames at the outer rate per pass
+
+static double besselI0(double x)
+{
+   double sum = 1, term = 1;
+   for (int k = 1; k < 40; k ++)
+   {
+      term *= (x / (2 * k)) * (x / (2 * k));
+      sum += term;
+   }
+   return sum;
+}
+
+// Kaiser windowed sinc of factor * oversampleTaps taps cut off at the outer
+// Nyquist, 80 dB down past 0.58 of the outer rate, unity gain at DC.
+// Symmetric, so it reads the same forwards and backwards.
+static std::vector<double> oversampleFilter(unsigned factor)
+{
+   size_t n = factor * oversampleTaps;
+   std::vector<double> h(n);
+   double fc = 0.5 / factor;
+   double beta = 7.857;
+   double sum = 0;
+
+   for (size_t i = 0; i < n; i ++)
+   {
+      double x = i - (n - 1) / 2.0;      // never 0, n is even
+      double r = 2 * x / (n - 1);
+      h[i] = sin(2 * M_PI * fc * x) / (M_PI * x) * besselI0(beta * sqrt(1 - r * r)) / besselI0(beta);
+      sum += h[i];
+   }
+   for (double &v : h)
+      v /= sum;
+   return h;
+}
+
+// y[i factor + p] from n input samples x and the oversampleTaps - 1 before them.
+// Each phase is summed over the block so the loops vectorize.
+VECTOR_CLONES
+static void upsample(const float *taps, const sample_t *x, sample_t *y, size_t n, size_t factor)
+{
+   float acc[oversampleChunk];
+
+   for (size_t p = 0; p < factor; p ++)
+   {
+      const float *h = taps + p * oversampleTaps;
+      std::fill(acc, acc + n, 0.0f);
+      for (size_t k = 0; k < oversampleTaps; k ++)
+         for (size_t i = 0; i < n; i ++)
+            acc[i] += h[k] * x[i + k];
+      for (size_t i = 0; i < n; i ++)
+         y[i * factor + p] = acc[i];
+   }
+}
+
+// n outputs, filtered and decimated from the factor * (n + oversampleTaps) - 1
+// samples of z, history first. The phases of z are taken apart to sum them
+// with unit stride.
+VECTOR_CLONES
+static void downsample(const float *taps, const sample_t *z, sample_t *y, size_t n, size_t factor)
+{
+   float phase[oversampleChunk + oversampleTaps];
+
+   std::fill(y, y + n, 0.0f);
+   for (size_t r = 0; r < factor; r ++)
+   {
+      for (size_t m = 0; m < n + oversampleTaps - 1; m ++)
+         phase[m] = z[m * factor + factor - 1 + r];
+      for (size_t q = 0; q < oversampleTaps; q ++)
+      {
+         float h = taps[q * factor + r];
+         for (size_t m = 0; m < n; m ++)
+            y[m] += h * phase[m + q];
+      }
+   }
+}
+
+Oversampler::Oversampler(std::unique_ptr<AudioUnit> &&unit, unsigned factor)
+   : mUnit(std::move(unit)), mFactor(factor)
+{
+   if (factor != 2 && factor != 4)
+      throw Exception("Oversampling factor must be 2 or 4");
+
+   std::vector<double> h = oversampleFilter(factor);
+   mDownTaps.assign(h.begin(), h.end());
+   mUpTaps.resize(h.size());
+   for (size_t p = 0; p < factor; p ++)
+      for (size_t k = 0; k < oversampleTaps; k ++)
+         mUpTaps[p * oversampleTaps + k] = factor * h[(oversampleTaps - 1 - k) * factor + p];
+
+   mIn.assign(oversampleTaps - 1 + oversampleChunk, 0);
+   mHigh.assign(factor * (oversampleTaps + oversampleChunk) - 1, 0);
+
+   // addCtl() keeps pointers into mInputs: size it first.
+   size_t inputs = 0;
+   for (controlIter_t c = mUnit->ctlListIter(); c != mUnit->ctlListEnd(); c ++)
+      if (c->input != NULL)
+         inputs ++;
+   mInputs.reserve(inputs);
+
+   for (controlIter_t c = mUnit->ctlListIter(); c != mUnit->ctlListEnd(); c ++)
+   {
+      if (c->input == NULL)
+      {
+         addCtl(c->name, c->ptr);
+         continue;
+      }
+      mInputs.push_back(*c->input);
+      mUnitInputs.push_back(c->input);
+      mUnitIdle.push_back(*c->input);
+      addCtl(c->name, c->ptr, &mInputs.back());
+   }
+   mModLast.assign(inputs, 0);
+   mModHigh.assign(inputs * oversampleChunk * factor, 0);
+}
+
+// The unit takes its memory at the higher rate.
+void Oversampler::setup()
+{
+   unsigned outer = rateFactor;
+   rateFactor = outer * mFactor;
+
+   try
+   {
+      mUnit->setup();
+   }
+   catch (...)
+   {
+      rateFactor = outer;
+      throw;
+   }
+   rateFactor = outer;
+}
+
+void Oversampler::onControlUpdate()
+{
+   mUnit->onControlUpdate();
+}
+
+// The unit's tail at the outer rate, and the filters emptying.
+uint64_t Oversampler::tailFrames()
+{
+   uint64_t tail = mUnit->isSilent() ? 0 : mUnit->tailFrames();
+   if (tail == noTail)
+      return noTail;
+   return tail / mFactor + 2 * oversampleTaps;
+}
+
+void Oversampler::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   const size_t history = mFactor * oversampleTaps - 1;
+   unsigned outer = rateFactor;
+
+   for (size_t done = 0; done < n; done += oversampleChunk)
+   {
+      size_t len = std::min(oversampleChunk, n - done);
+      size_t high = len * mFactor;
+      sample_t *x = mIn.data();
+      sample_t *z = mHigh.data();
+
+      std::copy(in + done, in + done + len, x + oversampleTaps - 1);
+      upsample(mUpTaps.data(), x, z + history, len, mFactor);
+
+      // Audio-rate modulation is interpolated to the higher rate.
+      for (size_t c = 0; c < mInputs.size(); c ++)
+      {
+         const CtlInput &src = mInputs[c];
+         CtlInput *dst = mUnitInputs[c];
+         dst->depth = src.depth;
+         if (src.stride == 0)
+         {
+            dst->mod = src.mod;
+            dst->stride = 0;
+            mModLast[c] = src.mod[0];
+            continue;
+         }
+
+         sample_t *m = &mModHigh[c * oversampleChunk * mFactor];
+         sample_t last = mModLast[c];
+         for (size_t i = 0; i < len; i ++)
+         {
+            sample_t next = src.mod[done + i];
+            for (size_t p = 0; p < mFactor; p ++)
+               m[i * mFactor + p] = last + (next - last) * (p + 1) / mFactor;
+            last = next;
+         }
+         mModLast[c] = last;
+         dst->mod = m;
+         dst->stride = 1;
+      }
+
+      rateFactor = outer * mFactor;
+      mUnit->process(high, z + history, (t + done) * mFactor);
+      rateFactor = outer;
+
+      downsample(mDownTaps.data(), z, out + done, len, mFactor);
+
+      std::copy(x + len, x + len + oversampleTaps - 1, x);
+      std::copy(z + high, z + high + history, z);
+   }
+
+   for (size_t c = 0; c < mInputs.size(); c ++)
+      *mUnitInputs[c] = mUnitIdle[c];
+}
+
+/*=================================================================================*/
+/// DelayLine -- power of two ring buffer with fractional reads
+
+void DelayLine::setup(size_t frames)
+{
+   size_t size = 8;
+   while (size < frames + 4)
+      size *= 2;
+
+   mBuf.assign(size, 0);
+   mMask = size - 1;
+   mWrite = 0;
+}
+
+void DelayLine::clear()
+{
+   std::fill(mBuf.begin(), mBuf.end(), 0);
+}
+
+// Frames until a loop of the period and gain has died down by 60 dB.
+static uint64_t feedbackTail(double period, double fb)
+{
+   fb = fabs(fb);
+   if (fb >= 0.999)
+      return noTail;
+
+   double loops = fb > 1e-3 ? log(1e-3) / log(fb) : 0;
+   return (uint64_t) (period * (loops + 1)) + 4;
+}
+
+// Frames of a line holding seconds at the rate the unit runs at. Throws when
+// that is too short to read from, as when the rate is not known yet.
+static size_t lineFrames(double seconds)
+{
+   double frames = ceil(seconds * unitRate());
+   if (!(frames >= 4))
+      throw Exception("Delay line too short: is the sample rate known?");
+   return (size_t) frames;
+}
+
+static inline float clampFeedback(double fb)
+{
+   return std::min(std::max(fb, -0.999), 0.999);
+}
+
+/*=================================================================================*/
+/// Delay -- feedback delay
+
+Delay::Delay(double seconds, double fb, double wet, double maxSeconds)
+{
+   time = seconds;
+   feedback = fb;
+   mix = wet;
+   mMaxSeconds = maxSeconds;
+
+   addCtl("time", &time, &timeIn);
+   addCtl("feedback", &feedback);
+   addCtl("mix", &mix);
+}
+
+void Delay::setup()
+{
+   mLine.setup(lineFrames(mMaxSeconds));
+}
+
+double Delay::operator()(uint64_t t, double in)
+{
+   sample_t x = in;
+   processBlock(&x, &x, 1, t);
+   return x;
+}
+
+void Delay::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   double rate = unitRate();
+   float fb = clampFeedback(feedback);
+   float wet = mix;
+
+   for (size_t i = 0; i < n; i ++)
+   {
+      float x = in[i];
+      float y = mLine.readCubic(timeIn.at(i) * rate);
+      mLine.write(x + fb * y);
+      out[i] = x + wet * (y - x);
+   }
+}
+
+uint64_t Delay::tailFrames()
+{
+   return feedbackTail(std::min(time * unitRate(), mLine.maxDelay()), feedback);
+}
+
+/*=================================================================================*/
+/// ModDelay -- swept delay taps: chorus and flanger
+
+ModDelay::ModDelay(unsigned taps, double base, double sweep, double hz, double fb, double wet,
+                   double maxSeconds)
+   : mTaps(std::max(taps, 1u)), mPhase(0), mMaxSeconds(maxSeconds)
+{
+   delay = base;
+   depth = sweep;
+   rate = hz;
+   feedback = fb;
+   mix = wet;
+
+   addCtl("delay", &delay, &delayIn);
+   addCtl("depth", &depth);
+   addCtl("rate", &rate);
+   addCtl("feedback", &feedback);
+   addCtl("mix", &mix);
+}
+
+void ModDelay::setup()
+{
+   mLine.setup(lineFrames(mMaxSeconds));
+}
+
+double ModDelay::operator()(uint64_t t, double in)
+{
+   sample_t x = in;
+   processBlock(&x, &x, 1, t);
+   return x;
+}
+
+void ModDelay::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   double sr = unitRate();
+   double inc = rate / sr;
+   double p = mPhase;
+   float sweep = depth * sr;
+   float fb = clampFeedback(feedback);
+   float wet = mix;
+   float norm = 1.0f / mTaps;
+
+   for (size_t i = 0; i < n; i ++)
+   {
+      double base = delayIn.at(i) * sr;
+      float x = in[i];
+      float y = 0;
+
+      for (unsigned k = 0; k < mTaps; k ++)
+         y += mLine.readCubic(base + sweep * sinCycle(p + (double) k / mTaps));
+      y *= norm;
+
+      mLine.write(x + fb * y);
+      out[i] = x + wet * (y - x);
+
+      p += inc;
+      p -= floor(p);
+   }
+
+   mPhase = p;
+}
+
+uint64_t ModDelay::tailFrames()
+{
+   return feedbackTail(std::min((delay + fabs(depth)) * unitRate(), mLine.maxDelay()), feedback);
+}
+
+/*=================================================================================*/
+/// Comb -- tuned feedback comb filter
+
+Comb::Comb(double f, double fb, double d, double minFreq)
+{
+   freq = f;
+   feedback = fb;
+   damp = d;
+   mAllpass = mLow = 0;
+   mMinFreq = minFreq;
+
+   addCtl("freq", &freq, &freqIn);
+   addCtl("feedback", &feedback);
+   addCtl("damp", &damp);
+}
+
+void Comb::setup()
+{
+   mLine.setup(lineFrames(1 / mMinFreq));
+}
+
+double Comb::operator()(uint64_t t, double in)
+{
+   sample_t x = in;
+   processBlock(&x, &x, 1, t);
+   return x;
+}
+
+void Comb::processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t)
+{
+   double sr = unitRate();
+   float fb = clampFeedback(feedback);
+   float d = std::min(std::max(damp, 0.0), 1.0);
+   float ap = mAllpass, low = mLow;
+
+   for (size_t i = 0; i < n; i ++)
+   {
+      float tap = mLine.readAllpass(sr / std::max(freqIn.at(i), 1.0), ap);
+      low = tap + d * (low - tap);
+
+      float y = in[i] + fb * low;
+      mLine.write(y);
+      out[i] = y;
+   }
+
+   mAllpass = ap;
+   mLow = low;
+}
+
+uint64_t Comb::tailFrames()
 {
-   return signum(sin(T(t - t0) / SampleRate * freq * 2 * M_PI + phase));
+   double period = std::min(unitRate() / std::max(freq, 1.0), mLine.maxDelay());
+   // The damping keeps the loop gain at DC, so the lows decay no faster.
+   return feedbackTail(period, feedback);
 }
@@ -3,114 +3,756 @@
 
 #include <stdint.h>
 
-#include <queue>
+#include <algorithm>
 #include <list>
+#include <memory>
+#include <string>
+#include <vector>
 
 #include "script.h"
 
 extern uint64_t SampleRate;
 
-typedef void (*ScheduleFn)(void);
+// The sample rate of the unit rendering on this thread: SampleRate, times the
+// factor of the Oversampler running it. The units below take their frequencies
+// and times from it.
+double unitRate();
 
-struct Schedule
+// Vectorized sine and cosine of a block, in place if out == x. Dispatched at
+// load time to AVX-512, AVX2 or SSE2 code.
+// blockSinCycles takes the phase in cycles, sin(2 pi c), and is within 2e-7
+// of the exact sine for |c| < 2^22. blockSin and blockCos take radians and are
+// within 3e-7 for |x| <= pi; the conversion to cycles adds about |x| * 1e-7.
+void blockSinCycles(const sample_t *c, sample_t *out, size_t n);
+void blockSin(const sample_t *x, sample_t *out, size_t n);
+void blockCos(const sample_t *x, sample_t *out, size_t n);
+
+/*=================================================================================*/
+
+class Generator : public AudioUnit
 {
-   double startTime;
-   ScheduleFn fn;
+   protected:
+      uint64_t t;
+
+   public:
+      Generator();
+      Generator(uint64_t t1);
 
-   Schedule(double time, ScheduleFn fn)
-   {
-      this->startTime = time;
-      this->fn = fn;
-   }
+      virtual double operator() (uint64_t t, double in = 0) = 0;
 };
 
-struct SchedulePtrLess
+/*=================================================================================*/
+
+// A segment of an envelope: from wherever the envelope is to level in seconds.
+// curve 0 is a straight line; a negative curve moves fast first and settles
+// like an RC decay, a positive one starts slow. About -4 sounds natural.
+struct EnvSegment
 {
-   bool operator() (Schedule *a, Schedule *b);
+   double level;
+   double seconds;
+   double curve;
 };
 
-class Scheduler
+// Envelope shapes shipped as data; see envelopePreset().
+struct EnvelopePreset
 {
+   const char *name;
+   EnvSegment segments[4];
+   size_t count;
+   int sustain;
+};
+
+// A breakpoint envelope rendered a segment at a time. Each segment is a
+// recurrence of one multiply-add per sample and a flat segment is a fill.
+// start() runs the segments before the sustain point and holds the level of
+// the last one; stop() runs the rest from wherever the envelope is. Without a
+// sustain point start() runs them all. The "gate" control starts it when it
+// goes above 0 and stops it when it comes back, on the sample the control
+// change is due. Set the segments before the envelope runs.
+class Envelope : public AudioUnit
+{
+   public:
+      static const size_t maxSegments = 16;
+      static const int noSustain = -1;
+
    private:
-      std::priority_queue<Schedule*,
-                          std::vector<Schedule*>,
-                          SchedulePtrLess> mQueue;
+      EnvSegment mSegments[maxSegments];
+      size_t mCount;
+      int mSustain;
+      enum
+      {
+         IDLE,
+         RUNNING,
+         HOLDING
+      } mStage;
+      size_t mSegment;
+      uint64_t mLeft;      // samples to the end of the segment
+      double mLevel;
+      double mMul, mAdd;   // the recurrence of the segment
+      bool mGateOn;
+
+      void enter(size_t segment);
+      void next();
 
    public:
-      void schedule(double startTime, ScheduleFn fn);
-      void run(double t);
+      Envelope();
+      Envelope(const std::string &preset);
+
+      void setSegments(const EnvSegment *segments, size_t count, int sustain);
+      void setPreset(const EnvelopePreset &preset);
+      void adsr(double a, double d, double s, double r, double curve = 0);
+      void ahdsr(double a, double h, double d, double s, double r, double curve = 0);
+
+      void start();
+      void stop();
+      bool active() { return mStage != IDLE; }
+
+      double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+      void onControlUpdate();
+      bool isSilent() { return mStage == IDLE && mLevel == 0; }
+
+      double gate;
+};
+
+// The named preset, or NULL. Presets: adsr, pluck, perc, organ, pad, brass,
+// strings, swell.
+const EnvelopePreset *envelopePreset(const std::string &name);
+
+// Linear attack, decay and release, as the first envelope of the library had.
+class ADSR : public Envelope
+{
+   public:
+      ADSR();
+      ADSR(double a, double d, double s, double r);
+
+      ADSR* set(double a, double d, double s, double r);
 };
 
 /*=================================================================================*/
 
-class Generator
+// Base of the periodic oscillators: a wrapped phase accumulator where a full
+// cycle is 2^64, so the phase stays exact however long the engine runs and a
+// frequency change never makes it jump.
+class Oscillator : public Generator
 {
    protected:
-      uint64_t t, t0;
+      CtlInput freqIn;
+      uint64_t mAcc;       // phase without the phase control
+      uint64_t mInc;       // per sample increment for mIncCycles
+      double mIncCycles;   // cycles per sample
+      uint64_t mOffset;    // the phase control as an accumulator value
+      double mOffsetPhase;
+      uint64_t mLast;      // time the accumulator is at
+
+      void init(double f);
+      uint64_t increment(double f);
+      uint64_t offset();
+      uint64_t step(uint64_t t);
+
+      template <typename T, typename Wave>
+      void renderWave(T *out, size_t n, uint64_t t, Wave wave);
 
    public:
-      Generator();
-      Generator(uint64_t t1);
+      Oscillator();
+      Oscillator(uint64_t t1);
 
-      virtual double operator() (uint64_t t, double in = 0) = 0;
+      double freq;
+      double phase;        // radians
+};
+
+/*=================================================================================*/
+
+class SinOsc : public Oscillator
+{
+   public:
+      SinOsc();
+      SinOsc(double f);
+      SinOsc(uint64_t t1);
+
+      double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+};
+
+/*=================================================================================*/
+
+// Base of the band-limited analytic oscillators. The steps and corners of the
+// naive waveform are smoothed over the two samples around them with polynomial
+// residuals (PolyBLEP, PolyBLAMP). A rising zero crossing of the "sync" control
+// restarts the cycle between samples: modulate it at audio rate from a master
+// oscillator for hard sync. The step the restart makes is smoothed as well.
+class BlepOsc : public Oscillator
+{
+   public:
+      enum Shape
+      {
+         SAW,
+         PULSE,
+         TRIANGLE
+      };
+
+   protected:
+      CtlInput syncIn;
+      CtlInput widthIn;    // registered by PulseOsc
+      Shape mShape;
+      double mSyncLast;    // the sync input before this block
+
+      BlepOsc(Shape shape, uint64_t t1);
+      float naive(float t, float w);
+
+   public:
+      double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+
+      double sync;
+      double width;        // of the high part of a pulse, in cycles
+};
+
+// The band-limited waveforms of a phase t in cycles [0, 1) advancing dt cycles
+// a sample, as the oscillators render them, for per-sample code.
+float polyBlepSaw(float t, float dt);
+float polyBlepPulse(float t, float dt, float width);
+float polyBlepTri(float t, float dt);
+
+/*=================================================================================*/
+
+class SawOsc : public BlepOsc
+{
+   public:
+      SawOsc();
+      SawOsc(double f);
+      SawOsc(uint64_t t1);
+};
+
+/*=================================================================================*/
+
+class PulseOsc : public BlepOsc
+{
+   public:
+      PulseOsc();
+      PulseOsc(double f, double w = 0.5);
+      PulseOsc(uint64_t t1);
 };
 
 /*=================================================================================*/
 
-class ADSR : public AudioUnit 
+// A pulse of width 1/2.
+class SqrOsc : public PulseOsc
 {
+   public:
+      SqrOsc();
+      SqrOsc(double f);
+      SqrOsc(uint64_t t1);
+};
+
+/*=================================================================================*/
+
+class TriOsc : public BlepOsc
+{
+   public:
+      TriOsc();
+      TriOsc(double f);
+      TriOsc(uint64_t t1);
+};
+
+/*=================================================================================*/
+
+// A single cycle waveform with a band-limited copy per octave, level k holding
+// the harmonics that stay below Nyquist up to 2^k * SampleRate / size. Built
+// once and shared by every oscillator playing it.
+class Wavetable
+{
+   public:
+      static const unsigned sizeBits = 11;
+      static const size_t size = 1 << sizeBits;       // samples of a level
+      static const size_t levels = sizeBits;          // down to a single harmonic
+
+      // Sine amplitudes of harmonics 1, 2, 3, ...
+      Wavetable(const std::vector<double> &harmonics);
+
+      static const Wavetable& saw();
+      static const Wavetable& square();
+      static const Wavetable& triangle();
+
+      // The level to play at a phase increment, a full cycle being 2^64.
+      size_t levelFor(uint64_t inc) const;
+      // A level has a guard sample past its end for the interpolation.
+      const float* level(size_t k) const { return &mData[k * (size + 1)]; }
+
    private:
-      uint64_t t;
-      uint64_t A, D, R;
-      double S;
-      enum
+      std::vector<float> mData;
+};
+
+// Add gain times the level read at the 32-bit phases, linearly interpolated.
+// Dispatched at load time to AVX-512 or AVX2 gathers, or a scalar loop.
+void blockTableRead(const float *level, const uint32_t *phase, float gain, sample_t *out, size_t n);
+
+/*=================================================================================*/
+
+class WaveOsc : public Oscillator
+{
+   private:
+      const Wavetable *mTable;
+
+   public:
+      WaveOsc(const Wavetable &table = Wavetable::saw(), double f = 0);
+
+      void setTable(const Wavetable &table) { mTable = &table; }
+
+      double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+};
+
+/*=================================================================================*/
+
+// Many voices of one wavetable summed into one output, for chords, unisons and
+// additive patches. Voice v has the controls "freq<v>" and "gain<v>".
+class WaveBank : public AudioUnit
+{
+   private:
+      struct Voice
       {
-         ON,
-         OFF,
-         INACTIVE
-      } state;
+         double freq;
+         double gain;
+         uint64_t acc;
+      };
+
+      const Wavetable *mTable;
+      std::vector<Voice> mVoices;
 
    public:
-      ADSR();
-      ADSR(uint64_t t1);
-      ADSR(double a, double d, double s, double r);
+      WaveBank(const Wavetable &table, size_t voices);
 
-      ADSR* set(double a, double d, double s, double r);
+      size_t voices() { return mVoices.size(); }
+      void setVoice(size_t v, double freq, double gain);
+
+      bool isSilent();
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+};
+
+/*=================================================================================*/
+
+// The state of eight xoshiro128+ generators, one per SIMD lane.
+struct RngLanes
+{
+   alignas(32) uint32_t s0[8], s1[8], s2[8], s3[8];
+};
+
+// Uniform noise in [-1, 1) from eight xoshiro128+ generators run side by side.
+// The stream depends on the seed only, never on how it is cut into blocks.
+class NoiseRng
+{
+   public:
+      static const size_t lanes = 8;
+
+      NoiseRng(uint64_t seed = 0);
+
+      void seed(uint64_t seed);
+      void fill(sample_t *out, size_t n);
+
+   private:
+      RngLanes mLanes;
+      float mSpare[lanes];       // the rest of a group cut by a block end
+      size_t mSpareLeft;
+};
+
+// A seed for a new noise unit: the count of the noise units made so far, so a
+// patch built in the same order sounds the same every time.
+uint64_t nextNoiseSeed();
+
+enum NoiseColor
+{
+   WHITE,
+   PINK,       // -3 dB/octave, Voss-McCartney
+   BROWN       // -6 dB/octave down to 10 Hz, a leaky integrator
+};
+
+// Noise of a colour, with the RMS level of the white noise, 1/sqrt(3). The
+// "seed" control restarts it on another stream.
+class Noise : public AudioUnit
+{
+   private:
+      static const unsigned pinkRows = 16;
+
+      NoiseColor mColor;
+      NoiseRng mRng;
+      uint64_t mSeed;
+      float mRows[pinkRows];     // pink: the white values held by each row
+      double mPinkSum;
+      uint32_t mCounter;
+      double mBrown;             // brown: the integrator
+
+      void restart();
+
+   public:
+      Noise(NoiseColor color = WHITE, uint64_t seed = nextNoiseSeed());
 
       double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+      void onControlUpdate();
 
-      void start();
-      void stop();
+      double seed;
+};
+
+class WhiteNoise : public Noise
+{
+   public:
+      WhiteNoise(uint64_t seed = nextNoiseSeed()) : Noise(WHITE, seed) {}
+};
+
+class PinkNoise : public Noise
+{
+   public:
+      PinkNoise(uint64_t seed = nextNoiseSeed()) : Noise(PINK, seed) {}
+};
+
+class BrownNoise : public Noise
+{
+   public:
+      BrownNoise(uint64_t seed = nextNoiseSeed()) : Noise(BROWN, seed) {}
 };
 
 /*=================================================================================*/
 
-class SinOsc : public Generator
+// Filters change their coefficients over this many samples.
+static const size_t filterSmoothFrames = 64;
+
+enum FilterType
 {
+   LOWPASS,
+   HIGHPASS,
+   BANDPASS,      // 0 dB at the center
+   NOTCH,
+   PEAK,
+   LOWSHELF,
+   HIGHSHELF
+};
+
+// Biquad coefficients from the RBJ cookbook, divided through by a0. gain is in
+// dB and only used by PEAK and the shelves.
+struct BiquadCoefs
+{
+   double b0, b1, b2, a1, a2;
+
+   BiquadCoefs() : b0(1), b1(0), b2(0), a1(0), a2(0) {}
+   BiquadCoefs(FilterType type, double freq, double q, double gain = 0);
+};
+
+// A biquad in transposed direct form II, in double. freq may be modulated at
+// control rate; a change of the controls glides over filterSmoothFrames.
+class Biquad : public AudioUnit
+{
+   private:
+      FilterType mType;
+      CtlInput freqIn;
+      double mFreq, mQ, mGain;      // mTarget is for these
+      BiquadCoefs mTarget;
+      BiquadCoefs mCoefs;
+      BiquadCoefs mStep;
+      size_t mRampLeft;
+      double z1, z2;
+
+      void update(double f);
+      double tick(double x);
+
    public:
-      SinOsc();
-      SinOsc(double f);
-      SinOsc(uint64_t t1);
+      Biquad(FilterType type = LOWPASS, double f = 1000, double q = 0.7071067811865476, double g = 0);
+
+      void setType(FilterType type) { mType = type; mFreq = -1; }
+      void reset() { z1 = z2 = 0; }
 
       double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
 
       double freq;
-      double phase;
+      double q;
+      double gain;
+};
+
+// The state of L biquads in float, one per SIMD lane.
+template <size_t L>
+struct BiquadLanes
+{
+   alignas(64) float b0[L], b1[L], b2[L], a1[L], a2[L];
+   alignas(64) float d0[L], d1[L], d2[L], e1[L], e2[L];     // per sample steps
+   alignas(64) float z1[L], z2[L];
+};
+
+// L independent biquads run side by side, so a polyphonic patch filters all its
+// voices in one pass. Samples are interleaved by lane: sample i of lane l is
+// frames[i * L + l]. Built for 4 and 8 lanes.
+template <size_t L>
+class BiquadBank
+{
+   private:
+      BiquadLanes<L> mLanes;
+      BiquadCoefs mTarget[L];
+      size_t mRampLeft;
+
+   public:
+      static const size_t lanes = L;
+
+      BiquadBank();
+
+      // The new coefficients of a lane are glided to over filterSmoothFrames.
+      void set(size_t lane, FilterType type, double freq, double q, double gain = 0);
+      void reset();
+
+      void process(sample_t *frames, size_t n);
 };
 
 /*=================================================================================*/
 
-class SqrOsc : public Generator
+// Zero-delay-feedback filters, discretised with the topology-preserving
+// transform. The coefficients follow the cutoff directly, without a glide, so
+// freq may be modulated at audio rate; a bound audio-rate modulation is
+// followed every sample.
+
+// State-variable filter (trapezoidal SVF), 12 dB/octave, of any FilterType.
+// Stable for any cutoff and q, however fast they move.
+class SVF : public AudioUnit
 {
+   private:
+      FilterType mType;
+      CtlInput freqIn;
+      double ic1, ic2;
+
    public:
-      SqrOsc();
-      SqrOsc(double f);
-      SqrOsc(uint64_t t);
+      SVF(FilterType type = LOWPASS, double f = 1000, double q = 0.7071067811865476, double g = 0);
+
+      void setType(FilterType type) { mType = type; }
+      void reset() { ic1 = ic2 = 0; }
+
+      double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+
+      double freq;
+      double q;
+      double gain;
+};
+
+// Four pole transistor ladder lowpass, 24 dB/octave. res runs from 0 to 1,
+// where the filter self-oscillates; drive scales the input into a soft
+// saturator ahead of the ladder, which keeps the resonance bounded. The
+// saturator makes harmonics: run it in an Oversampler when they would alias.
+class Ladder : public AudioUnit
+{
+   private:
+      CtlInput freqIn;
+      double s[4];
+
+   public:
+      Ladder(double f = 1000, double r = 0, double d = 1);
+
+      void reset() { s[0] = s[1] = s[2] = s[3] = 0; }
+
+      double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+
+      double freq;
+      double res;
+      double drive;
+};
+
+/*=================================================================================*/
+
+// Runs a unit at 2 or 4 times the sample rate, for nonlinear units whose
+// harmonics would otherwise fold back below Nyquist. The input is upsampled and
+// the output decimated through polyphase lowpass filters flat to 20 kHz at
+// 48 kHz, which delay the signal by about 32 samples. The unit sees the higher
+// rate through unitRate() and its sample times are counted at that rate.
+// The controls of the unit are the controls of the Oversampler; set them here,
+// not on the unit.
+class Oversampler : public AudioUnit
+{
+   private:
+      std::unique_ptr<AudioUnit> mUnit;
+      unsigned mFactor;
+      std::vector<float> mUpTaps;      // per phase, in the order they meet the input
+      std::vector<float> mDownTaps;
+      std::vector<sample_t> mIn;       // input history, then the chunk
+      std::vector<sample_t> mHigh;     // output history, then the chunk at the higher rate
+
+      // Modulatable controls of the unit, bound through ours.
+      std::vector<CtlInput> mInputs;
+      std::vector<CtlInput*> mUnitInputs;
+      std::vector<CtlInput> mUnitIdle;
+      std::vector<sample_t> mModLast;
+      std::vector<sample_t> mModHigh;
+
+   public:
+      Oversampler(std::unique_ptr<AudioUnit> &&unit, unsigned factor = 2);
+
+      AudioUnit *unit() { return mUnit.get(); }
+      unsigned factor() { return mFactor; }
+
+      void setup();
+      void onControlUpdate();
+      uint64_t tailFrames();
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+};
+
+/*=================================================================================*/
+
+// A ring buffer of a power of two samples, read at fractional delays. Read the
+// delayed samples first, then write the new one: a delay of 1 is the sample
+// written last. All the memory is taken by setup(); until then it holds a few
+// samples.
+class DelayLine
+{
+   private:
+      std::vector<float> mBuf;
+      size_t mMask;
+      size_t mWrite;
+
+      float at(size_t delay) const { return mBuf[(mWrite - delay) & mMask]; }
+
+   public:
+      DelayLine() { setup(0); }
+
+      // Room for delays up to frames, rounded up to a power of two.
+      void setup(size_t frames);
+      void clear();
+
+      // The longest delay the reads below take; longer ones are clamped.
+      double maxDelay() const { return mMask > 4 ? mMask - 2 : 2; }
+
+      void write(float x) { mBuf[mWrite & mMask] = x; mWrite ++; }
+      float read(size_t delay) const { return at(delay); }
+
+      // 4-point Hermite interpolation, for delays of 2 samples or more. Flat
+      // enough at any fraction that the delay may move every sample.
+      float readCubic(double delay) const
+      {
+         delay = std::min(std::max(delay, 2.0), maxDelay());
+         size_t i = (size_t) delay;
+         float f = delay - i;
+         float xm1 = at(i - 1), x0 = at(i), x1 = at(i + 1), x2 = at(i + 2);
+
+         float c1 = 0.5f * (x1 - xm1);
+         float c2 = xm1 - 2.5f * x0 + 2 * x1 - 0.5f * x2;
+         float c3 = 0.5f * (x2 - xm1) + 1.5f * (x0 - x1);
+         return ((c3 * f + c2) * f + c1) * f + x0;
+      }
+
+      // First order allpass (Thiran) interpolation, for delays of 1.1 samples
+      // or more: flat at every frequency, so a tuned feedback loop keeps its
+      // highs, but state carries over between samples and a jump of the delay
+      // rings briefly. The fraction is kept in [0.1, 1.1), away from the pole
+      // at Nyquist.
+      float readAllpass(double delay, float &state) const
+      {
+         delay = std::min(std::max(delay, 1.1), maxDelay());
+         size_t i = (size_t) (delay - 0.1);
+         float f = delay - i;
+         float a = (1 - f) / (1 + f);
+
+         state = a * (at(i) - state) + at(i + 1);
+         return state;
+      }
+};
+
+// Longest delay of the delay units unless they are told otherwise, in seconds.
+// Their setup() sizes their lines for the rate they run at, and throws when
+// that is not known yet.
+static const double defaultMaxDelay = 2;
+
+// Feedback delay. time may be modulated at audio rate; the read follows it
+// every sample, which makes the usual pitch bends of a tape delay.
+class Delay : public AudioUnit
+{
+   private:
+      DelayLine mLine;
+      CtlInput timeIn;
+      double mMaxSeconds;
+
+   public:
+      Delay(double seconds = 0.3, double fb = 0.4, double wet = 0.5, double maxSeconds = defaultMaxDelay);
+
+      void setup();
+      void reset() { mLine.clear(); }
+
+      double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+      uint64_t tailFrames();
+
+      double time;         // seconds
+      double feedback;     // -1 to 1, exclusive
+      double mix;          // 0 dry, 1 wet
+};
+
+// Taps swept by a sine around a base delay, mixed with the dry signal and fed
+// back. The taps are spread evenly over the cycle of the sweep. The base delay
+// may be modulated at audio rate. Chorus and Flanger are settings of it.
+class ModDelay : public AudioUnit
+{
+   private:
+      DelayLine mLine;
+      CtlInput delayIn;
+      unsigned mTaps;
+      double mPhase;       // of the sweep, in cycles
+      double mMaxSeconds;
+
+   public:
+      ModDelay(unsigned taps, double base, double sweep, double hz, double fb, double wet,
+               double maxSeconds = defaultMaxDelay);
+
+      void setup();
+      void reset() { mLine.clear(); }
+
+      double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+      uint64_t tailFrames();
+
+      double delay;        // seconds, the center of the sweep
+      double depth;        // seconds either side of it
+      double rate;         // Hz of the sweep
+      double feedback;
+      double mix;
+};
+
+// Three taps swept slowly around 20 ms.
+class Chorus : public ModDelay
+{
+   public:
+      Chorus(double hz = 0.8, double sweep = 0.003, double wet = 0.5)
+         : ModDelay(3, 0.02, sweep, hz, 0, wet, 0.1) {}
+};
+
+// One tap swept around 3 ms, fed back.
+class Flanger : public ModDelay
+{
+   public:
+      Flanger(double hz = 0.2, double sweep = 0.002, double fb = 0.5, double wet = 0.5)
+         : ModDelay(1, 0.003, sweep, hz, fb, wet, 0.1) {}
+};
+
+// Feedback comb filter resonating at freq and its harmonics, read through an
+// allpass interpolator so that the tuning is exact and the highs ring as long
+// as the lows. damp (0 to 1) lowpasses the loop so they die out faster, as in
+// a plucked string. freq may be modulated.
+class Comb : public AudioUnit
+{
+   private:
+      DelayLine mLine;
+      CtlInput freqIn;
+      float mAllpass;
+      float mLow;
+      double mMinFreq;
+
+   public:
+      Comb(double f = 440, double fb = 0.9, double d = 0, double minFreq = 20);
+
+      void setup();
+      void reset() { mLine.clear(); mAllpass = mLow = 0; }
 
       double operator()(uint64_t t, double in = 0);
+      void processBlock(const sample_t *in, sample_t *out, size_t n, uint64_t t);
+      uint64_t tailFrames();
 
-      double phase;
       double freq;
+      double feedback;
+      double damp;
 };
 
 #endif
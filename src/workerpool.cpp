@@ -0,0 +1,111 @@
+#include <sched.h>
+
+#include "workerpool.h"
+
+// Rounds the caller spins for the helpers before it starts yielding the CPU
+// to them, should they not run at its priority.
+static const unsigned spinRounds = 1 << 14;
+
+//=================================================================================
+// < WorkerPool >
+// Constructor. Starts threads - 1 helpers; the caller of run() is the last one.
+// Helper i is pinned to cpus[i] when given.
+WorkerPool::WorkerPool(unsigned threads, const std::vector<int> &cpus)
+{
+   mCount = threads > 1 ? threads - 1 : 0;
+   mWorkers.reset(new Worker[mCount]);
+   mJob = NULL;
+   mPending = 0;
+   mStop = false;
+
+   for (unsigned i = 0; i < mCount; i ++)
+   {
+      Worker &w = mWorkers[i];
+      w.pool = this;
+      w.id = i + 1;
+      sem_init(&w.wake, 0, 0);
+      pthread_create(&w.thread, NULL, threadFunc, &w);
+
+      if (i < cpus.size() && cpus[i] >= 0)
+      {
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         CPU_SET(cpus[i], &set);
+         pthread_setaffinity_np(w.thread, sizeof(set), &set);
+      }
+   }
+}
+
+//=================================================================================
+// < WorkerPool >
+// Destructor. Stops and joins the helpers.
+WorkerPool::~WorkerPool()
+{
+   mStop = true;
+   for (unsigned i = 0; i < mCount; i ++)
+      sem_post(&mWorkers[i].wake);
+
+   for (unsigned i = 0; i < mCount; i ++)
+   {
+      pthread_join(mWorkers[i].thread, NULL);
+      sem_destroy(&mWorkers[i].wake);
+   }
+}
+
+//=================================================================================
+// < WorkerPool >
+// Run the job on every thread of the pool and return when all are done.
+void WorkerPool::run(PoolJob &job)
+{
+   mJob = &job;
+   mPending.store(mCount, std::memory_order_release);
+
+   for (unsigned i = 0; i < mCount; i ++)
+      sem_post(&mWorkers[i].wake);
+
+   job.run(0);
+
+   // The helpers finish within the same block; spin rather than sleep.
+   for (unsigned spins = 0; mPending.load(std::memory_order_acquire) != 0; spins ++)
+      if (spins >= spinRounds)
+         sched_yield();
+
+   mJob = NULL;
+}
+
+//=================================================================================
+// < WorkerPool >
+// Give the helpers a realtime priority.
+bool WorkerPool::setRealtime(int priority)
+{
+   struct sched_param param;
+   param.sched_priority = priority;
+   bool ok = true;
+
+   for (unsigned i = 0; i < mCount; i ++)
+      if (pthread_setschedparam(mWorkers[i].thread, SCHED_FIFO, &param) != 0)
+         ok = false;
+
+   return ok;
+}
+
+//=================================================================================
+// < WorkerPool >
+// Thread function of a helper.
+void* WorkerPool::threadFunc(void *arg)
+{
+   Worker *w = (Worker*) arg;
+   WorkerPool *pool = w->pool;
+
+   while (true)
+   {
+      sem_wait(&w->wake);
+      if (pool->mStop)
+         break;
+
+      pool->mJob->run(w->id);
+      pool->mPending.fetch_sub(1, std::memory_order_release);
+   }
+
+   return NULL;
+}
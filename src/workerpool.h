@@ -0,0 +1,53 @@
+#ifndef _WORKERPOOL_H_
+#define _WORKERPOOL_H_
+
+#include <pthread.h>
+#include <semaphore.h>
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+// A piece of parallel work. run() is called once by every thread of the pool.
+class PoolJob
+{
+   public:
+      virtual ~PoolJob() {}
+      virtual void run(unsigned worker) = 0;
+};
+
+/* A fixed set of helper threads that join the calling (render) thread on a job.
+ * Starting a job and waiting for it neither locks nor allocates. The caller
+ * spins while the helpers finish, so they should run at its priority: see
+ * setRealtime(). */
+class WorkerPool
+{
+   private:
+      struct Worker
+      {
+         WorkerPool *pool;
+         unsigned id;
+         pthread_t thread;
+         sem_t wake;
+      };
+
+      std::unique_ptr<Worker[]> mWorkers;
+      unsigned mCount;                    // helper threads
+      PoolJob *mJob;
+      std::atomic<unsigned> mPending;     // helpers still running the job
+      bool mStop;
+
+      static void* threadFunc(void *arg);
+
+   public:
+      WorkerPool(unsigned threads, const std::vector<int> &cpus);
+      ~WorkerPool();
+
+      unsigned size() { return mCount + 1; }
+      void run(PoolJob &job);
+
+      // Run the helpers SCHED_FIFO at priority. False if it is not allowed.
+      bool setRealtime(int priority);
+};
+
+#endif